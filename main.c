@@ -88,6 +88,7 @@
 #include "ble_conn_params.h"
 
 #include "app_timer.h"
+#include "app_scheduler.h"
 #include "app_uart.h"
 #include "app_util_platform.h"
 #include "app_fifo.h"
@@ -155,27 +156,223 @@
 
 #define SAMPLES_IN_BUFFER               50                                          /**< SAADC buffer > */
 
+#define SAADC_SCAN_CHANNELS             3                                           /**< Number of SAADC channels converted in each scan. */
+#define SAADC_SCAN_PH_CH                0                                           /**< Scan channel for the pH transducer (AIN2). */
+#define SAADC_SCAN_BATT_CH              1                                           /**< Scan channel for the battery divider (AIN3). */
+#define SAADC_SCAN_TEMP_CH              2                                           /**< Scan channel for the thermistor (AIN1). */
+#define SAADC_RESOLUTION_BITS           12                                          /**< SAADC result resolution. */
+#define SAADC_MV_PER_FULL_SCALE         3000                                        /**< 600 mV internal reference with gain 1/5. */
+#define SAADC_SCANS_PER_BUFFER          9                                           /**< Scans stored in each EasyDMA buffer before an END event. */
+#define SAADC_SAMPLE_PERIOD_US          1000                                        /**< Interval between hardware triggered scans. */
+#define ISFET_SETTLE_MS                 200                                         /**< Longest ISFET warm-up before a regular reading. */
+#define ISFET_CAL_SETTLE_MS             400                                         /**< Longest ISFET warm-up before a calibration reading. */
+#define ISFET_WARMUP_PROBE_MS           20                                          /**< Interval between warm-up probe samples. */
+#define ISFET_WARMUP_SLOPE_MV           2                                           /**< Largest change between probes that counts as settled. */
+#define ISFET_WARMUP_STABLE_PROBES      3                                           /**< Consecutive settled probes needed to end the warm-up. */
+#define SAADC_CAL_INTERVAL_CYCLES       100                                         /**< Measurement cycles between SAADC offset calibrations. */
+#define SAADC_CAL_TEMP_DELTA_C          2.0                                         /**< Temperature change that forces an offset calibration. */
+
 #define CLIENT_DATA_INTERVAL            10000
 #define DEMO_DATA_INTERVAL              1000
 
 
-#define NRF_SAADC_CUSTOM_CHANNEL_CONFIG_SE(PIN_P) \
+#define NRF_SAADC_CUSTOM_CHANNEL_CONFIG_SE(PIN_P, PROFILE) \
 {                                                   \
     .resistor_p = NRF_SAADC_RESISTOR_DISABLED,      \
     .resistor_n = NRF_SAADC_RESISTOR_DISABLED,      \
     .gain       = NRF_SAADC_GAIN1_5,                \
     .reference  = NRF_SAADC_REFERENCE_INTERNAL,     \
-    .acq_time   = NRF_SAADC_ACQTIME_10US,           \
+    .acq_time   = (PROFILE).acq_time,               \
     .mode       = NRF_SAADC_MODE_SINGLE_ENDED,      \
-    .burst      = NRF_SAADC_BURST_DISABLED,         \
+    .burst      = (PROFILE).burst,                  \
     .pin_p      = (nrf_saadc_input_t)(PIN_P),       \
     .pin_n      = NRF_SAADC_INPUT_DISABLED          \
 }
 
+/* SAADC acquisition profiles. Each reading is the software average of up to
+ * max_samples conversions, and each conversion is itself the hardware average
+ * of 2^oversample samples. With burst enabled a single SAMPLE task runs the
+ * whole oversampling sequence, which is also required when oversampling is
+ * combined with scan mode. One sample takes t_acq + 2us (t_conv).
+ *
+ * Profile       Samples/reading      Noise vs 1 sample   Conversion time / ch  CPU wakeups / reading
+ * LEGACY        1   x 150 (sw) = 150  1/12.2              150 x 12us = 1.8 ms   150 scans (cal: 500 blocking)
+ * REGULAR       16  x 9   (sw) = 144  1/12.0              144 x 12us = 1.7 ms   1 END event
+ *   up to       16  x 36  (sw) = 576  1/24.0              576 x 12us = 6.9 ms   4 END events
+ * CALIBRATION   64  x 9   (sw) = 576  1/24.0              576 x 12us = 6.9 ms   9 blocking reads
+ *   up to       64  x 36  (sw) = 2304 1/48.0              2304 x 12us = 28 ms   36 blocking reads
+ *
+ * Noise assumes uncorrelated (white) noise, which falls by sqrt(samples).
+ * Oversampled results are averaged before the 12 bit result is stored, so
+ * they also keep fractional LSBs that per-sample truncation used to throw away.
+ * The elapsed time of each reading is logged so profiles can be compared on
+ * the target.
+ *
+ * When target_se_uv is set the reading stops early, as soon as at least
+ * min_samples conversions were taken and the standard error of the mean of
+ * every channel is below target_se_uv. The regular scan checks this each
+ * SAADC_SCANS_PER_BUFFER scans, the calibration readers after every sample.
+ * min_samples and max_samples are multiples of SAADC_FILTER_BLOCK so the
+ * robust filter below sees only complete blocks.
+ */
+typedef struct
+{
+    nrf_saadc_oversample_t oversample;   /**< Hardware oversampling, applies to all channels. */
+    nrf_saadc_burst_t      burst;        /**< Must be enabled when oversampling a scan. */
+    nrf_saadc_acqtime_t    acq_time;     /**< Acquisition time per sample. */
+    uint16_t               min_samples;  /**< Conversions always averaged in software on top. */
+    uint16_t               max_samples;  /**< Upper limit when stopping early. */
+    uint16_t               target_se_uv; /**< Stop once the standard error is below this, 0 for a fixed count. */
+} saadc_acq_profile_t;
+
+#define SAADC_PROFILE_LEGACY            0                                           /**< Original behaviour, no hardware oversampling. */
+#define SAADC_PROFILE_REGULAR           1                                           /**< Regular protocol readings. */
+#define SAADC_PROFILE_CALIBRATION       2                                           /**< Calibration points and reference temperature. */
+
+#define REGULAR_SAADC_PROFILE           SAADC_PROFILE_REGULAR                       /**< Profile used by the regular protocol scan. */
+#define CALIBRATION_SAADC_PROFILE       SAADC_PROFILE_CALIBRATION                   /**< Profile used by the calibration readers. */
+
+static const saadc_acq_profile_t m_saadc_profiles[] =
+{
+    [SAADC_PROFILE_LEGACY]      = {NRF_SAADC_OVERSAMPLE_DISABLED, NRF_SAADC_BURST_DISABLED, NRF_SAADC_ACQTIME_10US, 150, 150, 0},
+    [SAADC_PROFILE_REGULAR]     = {NRF_SAADC_OVERSAMPLE_16X,      NRF_SAADC_BURST_ENABLED,  NRF_SAADC_ACQTIME_10US, 9,   36,  500},
+    [SAADC_PROFILE_CALIBRATION] = {NRF_SAADC_OVERSAMPLE_64X,      NRF_SAADC_BURST_ENABLED,  NRF_SAADC_ACQTIME_10US, 9,   36,  250},
+};
+
+/* Streaming estimators used to reduce the samples of one channel to a single
+ * mV value, in constant memory.
+ *
+ * MEAN is the original arithmetic mean, negative codes count as 0 mV and the
+ * divisor is the number of samples, so its output is unchanged.
+ * MEDIAN_OF_BLOCKS takes the median of each block of SAADC_FILTER_BLOCK
+ * samples and averages the medians. A single spike can only move the median
+ * of its own block to the next sample value, instead of adding spike/N to the
+ * mean. Negative codes are treated as invalid and skipped instead of pulling
+ * the result towards 0.
+ *
+ * In both modes the valid samples are also summed, with their squares, in
+ * 64 bit integers. That gives the variance for early termination exactly, without
+ * a soft-float Welford update per sample.
+ */
+typedef enum
+{
+    SAADC_FILTER_MEAN,
+    SAADC_FILTER_MEDIAN_OF_BLOCKS
+} saadc_filter_mode_t;
+
+#define SAADC_FILTER_BLOCK              3                                           /**< Samples per median block. */
+
+typedef struct
+{
+    saadc_filter_mode_t mode;
+    uint32_t            sum;                           /**< Sum of mV (MEAN) or of block medians. */
+    uint16_t            count;                         /**< Samples (MEAN) or complete blocks. */
+    uint16_t            block[SAADC_FILTER_BLOCK];     /**< Current partial block, in mV. */
+    uint8_t             block_len;
+    uint16_t            valid;                         /**< Non-negative samples seen. */
+    uint32_t            valid_sum;                     /**< Sum of valid samples, in mV. */
+    uint64_t            valid_sum_sq;                  /**< Sum of squared valid samples. */
+} saadc_filter_t;
+
+static const saadc_filter_mode_t m_saadc_channel_filter[] =
+{
+    [SAADC_SCAN_PH_CH]   = SAADC_FILTER_MEDIAN_OF_BLOCKS,
+    [SAADC_SCAN_BATT_CH] = SAADC_FILTER_MEAN,
+    [SAADC_SCAN_TEMP_CH] = SAADC_FILTER_MEDIAN_OF_BLOCKS,
+};
+
+/* Per-channel sampling rates. A channel is only part of the scan every
+ * decimation measurement cycles, otherwise its last value is reused and its
+ * age in CHANNEL_AGE grows. The battery changes over hours and the
+ * temperature over minutes, so most scans only convert the pH channel. All
+ * channels of a scan share the profile's sample count because oversampling
+ * is a global SAADC setting
+ */
+typedef struct
+{
+    nrf_saadc_input_t input;
+    uint8_t           decimation;
+} saadc_channel_rate_t;
+
+static const saadc_channel_rate_t m_saadc_channel_rate[] =
+{
+    [SAADC_SCAN_PH_CH]   = {NRF_SAADC_INPUT_AIN2, 1},
+    [SAADC_SCAN_BATT_CH] = {NRF_SAADC_INPUT_AIN3, 60},
+    [SAADC_SCAN_TEMP_CH] = {NRF_SAADC_INPUT_AIN1, 6},
+};
+
+/* Measurement cycle states. pH, battery and temperature are converted by the
+ * same scan, so they share the SAMPLE state
+ */
+typedef enum
+{
+    MEAS_STATE_IDLE,
+    MEAS_STATE_WARMUP,
+    MEAS_STATE_SAMPLE,
+    MEAS_STATE_PUBLISH
+} meas_state_t;
+
+/* Events posted from interrupt context to the measurement state machine
+ */
+typedef enum
+{
+    MEAS_EVT_START,          /**< Interval timer expired, start a cycle. */
+    MEAS_EVT_WARMUP_TICK,    /**< Time for the next ISFET warm-up probe. */
+    MEAS_EVT_SCAN_DONE,      /**< A scan buffer is full. */
+    MEAS_EVT_CALIBRATE_DONE, /**< SAADC offset calibration finished. */
+    MEAS_EVT_ABORT           /**< End any cycle and release the SAADC, see meas_stop(). */
+} meas_evt_type_t;
+
+typedef struct
+{
+    meas_evt_type_t     type;
+    uint8_t             epoch;       /**< m_meas_epoch when posted, see meas_abort(). */
+    uint16_t            size;
+    nrf_saadc_value_t * p_buffer;
+} meas_evt_t;
+
+/* Connection parameter profiles, see conn_profile_update(). All of them stay
+ * within the limits iOS centrals accept
+ *
+ *   profile  interval    latency  timeout  used for
+ *   BULK     15-30 ms    0        4 s      buffered data upload
+ *   LIVE     100-200 ms  4        6 s      demo protocol, 1 Hz readings
+ *   IDLE     400-600 ms  0        6 s      commands, calibration, disconnect delay
+ */
+typedef enum
+{
+    CONN_PROFILE_BULK,
+    CONN_PROFILE_LIVE,
+    CONN_PROFILE_IDLE,
+    CONN_PROFILE_NONE        /**< Not connected, or nothing requested yet. */
+} conn_profile_t;
+
+static conn_profile_t m_conn_profile = CONN_PROFILE_NONE;
+
+/* Negotiated link parameters and the throughput of the last buffered upload,
+ * reported by the "LINKSTATS" command
+ */
+typedef struct
+{
+    uint8_t  tx_phy;                 /**< BLE_GAP_PHY_1MBPS or BLE_GAP_PHY_2MBPS. */
+    uint8_t  rx_phy;
+    uint8_t  data_length;            /**< Link layer payload, 27 until DLE. */
+    uint16_t att_mtu;
+    uint16_t conn_interval;          /**< 1.25 ms units. */
+    uint16_t slave_latency;
+    uint32_t upload_records;         /**< Records sent by the last completed upload. */
+    uint32_t upload_ms;              /**< Its duration, first batch to last TX complete. */
+} link_stats_t;
+
+static link_stats_t m_link_stats;
+
+#define SCHED_MAX_EVENT_DATA_SIZE       sizeof(meas_evt_t)                          /**< Maximum size of scheduler events. */
+#define SCHED_QUEUE_SIZE                8                                           /**< Maximum number of events in the scheduler queue. */
+
 #define PACKET_BVAL_MARKER "%s%d.%1d"
 #define PACKET_FLOAT_MARKER "%s%d.%1d"
-#define PACKET_RVAL_MARKER "%1d.%4d"
-#define LOG_PACKET_FLOAT(val, dec) (uint32_t)(((val) < 0 && (val) > -1.0) ? "-" : ""),   \
+#define PACKET_RVAL_MARKER "%s%d.%02d"
+#define LOG_PACKET_FLOAT(val, dec) (((val) < 0 && (val) > -1.0) ? "-" : ""),             \
                                   (int32_t)(val),                                       \
                                   (int32_t)((((val) > 0) ? (val) - (int32_t)(val)       \
                                                    : (int32_t)(val) - (val))*pow(10,dec))
@@ -191,6 +388,8 @@ NRF_BLE_GATT_DEF(m_gatt);
 NRF_BLE_QWR_DEF(m_qwr);                                                             /**< Context for the Queued Write module.*/
 BLE_ADVERTISING_DEF(m_advertising);                                                 /**< Advertising module instance. */
 APP_TIMER_DEF(m_timer_id);
+APP_TIMER_DEF(m_warmup_timer);
+APP_TIMER_DEF(m_uptime_timer);
 
 // Timer and control flag to enable delay before disconnecting
 APP_TIMER_DEF(m_timer_disconn_delay);
@@ -214,6 +413,8 @@ static ble_uuid_t m_adv_uuids[]          =
 uint32_t AVG_PH_VAL       = 0;
 uint32_t AVG_BATT_VAL     = 0;
 uint32_t AVG_TEMP_VAL     = 0;
+uint16_t AVG_SAMPLE_CNT   = 0;
+uint8_t  CHANNEL_AGE[SAADC_SCAN_CHANNELS];  // Cycles since each channel was last read
 uint32_t PACK_CTR         = 0;
 float     PT1_PH_VAL       = 0;
 float     PT1_MV_VAL       = 0;
@@ -238,9 +439,10 @@ bool     PT1_READ          = false;
 bool     PT2_READ          = false;
 bool     PT3_READ          = false;
 bool     SEND_BUFFERED_DATA  = false;
-bool     HVN_TX_EVT_COMPLETE = false;
 bool     DEMO_PROTO_FLAG     = false; // true
 bool     CLIENT_PROTO_FLAG   = true;  // false  // Always begin in demo mode
+bool     BINARY_FORMAT       = false; // Per connection, ASCII unless "BIN" received
+bool     BROADCAST_FLAG      = false; // Latest reading in advertising data, "BCAST_ON"
 
 static volatile uint8_t write_flag = 0;
 
@@ -264,6 +466,41 @@ uint16_t   total_size = 20;
 uint16_t   total_size_w_index = 20 + 4; // ABC, + core data packet
 // 
 
+/* Binary record format, selected per connection with the "BIN" command
+ * ("ASCII" switches back, every new connection starts in ASCII).
+ *
+ * Each notification starts with a 3 byte header followed by count records:
+ *   [0] format version (BIN_FORMAT_VERSION)
+ *   [1] field mask, BIN_FIELD_* bits set for the fields carrying data
+ *   [2] number of 8 byte records that follow
+ *
+ * A record is one little endian uint64_t:
+ *   bits  0-15  packet index, same value as the ASCII "ABC," prefix
+ *   bits 16-27  raw pH mV
+ *   bits 28-39  battery SAADC mV (x4 for the cell voltage, 3M/1M divider)
+ *   bits 40-49  temperature in 0.1 C, clamped to 0.0 - 102.3 C
+ *   bits 50-60  calibrated pH x 100, clamped to 20.47, 0 when
+ *               BIN_FIELD_CAL_PH is not set
+ *   bit  61     temperature reused from an earlier cycle (HIST_STALE_TEMP)
+ *   bit  62     battery reused from an earlier cycle (HIST_STALE_BATT)
+ *   bit  63     averaging stopped before max_samples (HIST_EARLY), only
+ *               meaningful when BIN_FIELD_EARLY is set
+ *
+ * Version 1 had the calibrated pH in bits 50-63 and no flags. Bit 63 was
+ * reserved (0) before BIN_FIELD_EARLY. The ASCII record has no room for
+ * the flags and is unchanged
+ */
+#define BIN_FORMAT_VERSION   2
+#define BIN_HEADER_LEN       3                              /**< Version, field mask, record count. */
+#define BIN_RECORD_LEN       8                              /**< One packed record. */
+#define BIN_FIELD_INDEX      (1 << 0)
+#define BIN_FIELD_RAW_PH     (1 << 1)
+#define BIN_FIELD_BATT       (1 << 2)
+#define BIN_FIELD_TEMP       (1 << 3)
+#define BIN_FIELD_CAL_PH     (1 << 4)
+#define BIN_FIELD_STALE      (1 << 5)
+#define BIN_FIELD_EARLY      (1 << 6)
+
 /* Used for reading/writing calibration values to flash */
 #define MVAL_FILE_ID      0x1110
 #define MVAL_REC_KEY      0x1111
@@ -279,15 +516,21 @@ uint16_t   total_size_w_index = 20 + 4; // ABC, + core data packet
 #define CURR_PROTO_REC_KEY  0x7771
 #define CURR_STAYON_FILE_ID 0x8890
 #define CURR_STAYON_REC_KEY 0x8891
+#define BROADCAST_FILE_ID   0x9990
+#define BROADCAST_REC_KEY   0x9991
 const float CLIENT = 0.0; // Was 0.0, inverse to swap startup behavior with no flash history
 const float DEMO   = 1.0; // Was 1.0, same thing ^^ 
 float   CURR_STATE = 0.0;//1.0;
 float   STAYON_STORED = 0.0;
+float   BROADCAST_STORED = 0.0;
 
 // Forward declarations
 void create_bluetooth_packet(uint32_t ph_val, uint32_t batt_val,        
                              uint32_t temp_val, float ph_val_cal,
                              uint8_t* total_packet);
+void create_binary_record   (uint32_t index, uint32_t ph_val, uint32_t batt_val,
+                             uint32_t temp_val, float ph_val_cal, uint8_t flags,
+                             uint8_t* record);
 void init_and_start_app_timer   (void);
 void send_data_and_restart_timer(void);
 void enable_pH_voltage_reading  (void);
@@ -295,25 +538,47 @@ void disable_pH_voltage_reading (void);
 void saadc_init                 (void);
 void enable_isfet_circuit       (void);
 void disable_isfet_circuit      (void);
+void enable_isfet_circuit_task_pin(void);
 void turn_chip_power_on         (void);
 void turn_chip_power_off         (void);
 void restart_saadc              (void);
+void saadc_scan_init            (void);
+void saadc_scan_start           (void);
+void isfet_warmup_start         (void);
+void meas_evt_post              (meas_evt_type_t type, nrf_saadc_value_t * p_buffer,
+                                 uint16_t size);
+void meas_abort                 (void);
+void meas_release               (void);
+void meas_stop                  (void);
+void meas_evt_lost_check        (void);
+void log_saadc_profile_duration (int profile, uint16_t sw_samples, uint32_t start_ticks);
+void check_buffered_data_upload_done(void);
+void conn_profile_update        (void);
+void isfet_warmup_blocking      (uint16_t max_ms);
+void process_regular_protocol_readings(void);
 void reset_total_packet         (void);
 void write_cal_values_to_flash   (void);
 void check_for_buffer_done_signal(char **packet);
 void linreg                     (int num, float x[], float y[]);
 void perform_calibration        (uint8_t cal_pts);
-void add_index_to_total_packet  (uint8_t* total_packet, uint8_t* total_pack_w_index);
+void add_index_to_total_packet  (uint32_t index, uint8_t* total_packet, uint8_t* total_pack_w_index);
+uint32_t get_packet_index        (void);
 float calculate_pH_from_mV       (uint32_t ph_val);
 float calculate_celsius_from_mv  (uint32_t mv);
 float validate_float_range        (float val);
 static void advertising_start   (bool erase_bonds);
+void        advertising_update_reading(void);
+void        advertising_update_status (void);
 static void idle_state_handle   (void);
 static void fds_update          (float value, uint16_t FILE_ID, uint16_t REC_KEY);
 static void fds_write           (float value, uint16_t FILE_ID, uint16_t REC_KEY);
 float        fds_read            (uint16_t FILE_ID, uint16_t REC_KEY);
 bool        float_comp           (float f1, float f2);
 uint32_t saadc_result_to_mv     (uint32_t saadc_result);
+void     saadc_filter_reset     (saadc_filter_t * p_filter, saadc_filter_mode_t mode);
+void     saadc_filter_add       (saadc_filter_t * p_filter, nrf_saadc_value_t code);
+uint32_t saadc_filter_result    (saadc_filter_t const * p_filter);
+bool     saadc_filter_converged (saadc_filter_t const * p_filter, uint16_t target_se_uv);
 uint32_t sensor_temp_comp       (uint32_t raw_analyte_mv, uint32_t temp_mv);
 
 /* 
@@ -324,76 +589,1388 @@ uint32_t sensor_temp_comp       (uint32_t raw_analyte_mv, uint32_t temp_mv);
  * connection is made, a "primer" packet containing total number
  * of packets (one packet per data set in buffer) will be sent as
  * one packet, and then the data will be sent in FIFO order. I.E.
- * buffer[0] will contain the "oldest" data, buffer[n-1] will contain
- * the "newest" data, and packets will be sent buffer[0] to buffer [n-1]
+ * position 0 will contain the "oldest" data, position n-1 will contain
+ * the "newest" data, and packets will be sent position 0 to position n-1
+ *
+ * The buffers are a ring: HIST_HEAD is the slot of the oldest reading and
+ * TOTAL_DATA_IN_BUFFERS the number of readings, so position pos lives in
+ * slot hist_slot(pos). Appending, freeing the oldest readings and resetting
+ * are O(1) and no value is used as an "empty" marker, a 0 mV reading is
+ * stored like any other. When the ring is full the oldest reading is
+ * moved to the archive to make room for the newest, see hist_archive_push()
+ *
+ * Buffers can store eight days worth of data. Data is collected once
+ * every 15 minutes; 96 readings per day * 8 days = 768 readings.
+ * Readings are bit packed in hist_store, HIST_RECORD_BITS (47) per reading:
+ *
+ *   bits  0..11  pH mV
+ *   bits 12..23  temperature mV
+ *   bits 24..35  battery mV
+ *   bits 36..43  time delta
+ *   bits 44..46  HIST_STALE_* and HIST_EARLY flags
+ *
+ * so 768 readings take 4.4kB, 4.8kB with the archive. The stale flags mark
+ * a temperature or battery value that was not scanned in the reading's own
+ * cycle but reused from an earlier one, see CHANNEL_AGE. HIST_EARLY marks
+ * a reading whose averaging stopped before max_samples because it had
+ * already converged, AVG_SAMPLE_CNT holds the number of scans.
+ * The mV values come from the 12-bit SAADC and fit the fields, larger
+ * values saturate. The calibrated pH is not stored, it is recomputed from
+ * the pH mV with the current calibration when the reading is sent.
+ * Use hist_read()/hist_write() and hist_dt() to access a slot
+ *
+ * The time delta is the time between reading i-1 and reading i in units of
+ * HIST_DT_UNIT_S seconds (saturating), HIST_LAST_TIME the uptime of the
+ * newest reading. The time of any reading is found by walking back from
+ * the newest one, see hist_time_of(). HIST_SPAN, the sum of the deltas of
+ * all but the oldest reading, is kept up to date by appends and frees so
+ * the oldest time needs no walk, see hist_oldest_time()
  *
- * Buffers can store five days worth of data. Data is collected once 
- * every 15 minutes; 96 readings per day * 5 days = 480 readings.
- * Each reading requires 10 bytes (3x uint16_t, 1x float), so this 
- * buffer system can store 4.8kB of data.
+ * Each buffered reading keeps its packet index (HIST_FIRST_SEQ + position)
+ * until it is freed. A central that sends "ACK_nnn" with the highest index
+ * it received in order frees that reading and all older ones, and after the
+ * first ACK at most HIST_ACK_WINDOW unacknowledged readings are sent ahead.
+ * Unacknowledged readings stay buffered through a disconnect and are sent
+ * again, starting from the oldest, on the next connection. "DONE" frees
+ * everything sent so far. Centrals that never send ACK keep the old
+ * behaviour, the buffers are freed once everything has been sent.
+ * HIST_FIRST_SEQ restarts at 0 whenever the buffers are empty
+ *
+ * The buffers are backed by a log in flash that survives power off and
+ * resets, see hist_log_flush(). HIST_LOG_SEQ is the log sequence number
+ * of position 0, it never restarts
  */
- #define DATA_BUFF_SIZE 500
+ #define DATA_BUFF_SIZE 768
+ #define HIST_ACK_WINDOW 64
+ #define HIST_DT_UNIT_S  10
+ #define HIST_RECORD_BITS 47
+ #define HIST_MV_BITS     12
+ #define HIST_DT_BITS     8
+ #define HIST_FLAG_BITS   3
+ #define HIST_PH_SHIFT    0
+ #define HIST_TEMP_SHIFT  12
+ #define HIST_BATT_SHIFT  24
+ #define HIST_DT_SHIFT    36
+ #define HIST_FLAG_SHIFT  44
+ #define HIST_STALE_TEMP  (1 << 0)     /**< Temperature reused from an earlier cycle. */
+ #define HIST_STALE_BATT  (1 << 1)     /**< Battery reused from an earlier cycle. */
+ #define HIST_EARLY       (1 << 2)     /**< Averaging stopped before max_samples. */
  uint16_t TOTAL_DATA_IN_BUFFERS = 0;
+ uint16_t HIST_HEAD             = 0;
+ uint32_t HIST_FIRST_SEQ        = 0;
+ uint32_t HIST_LAST_TIME        = 0;
+ uint32_t HIST_SPAN             = 0;
+ uint32_t HIST_LOG_SEQ          = 0;
+
+ // Two spare bytes so a field can always be accessed as three bytes
+ uint8_t hist_store[(DATA_BUFF_SIZE * HIST_RECORD_BITS + 7) / 8 + 2];
+
+ typedef struct
+ {
+    uint16_t ph_mv;
+    uint16_t temp_mv;
+    uint16_t batt_mv;
+    uint8_t  dt;
+    uint8_t  flags;                 /**< HIST_STALE_* and HIST_EARLY bits. */
+ } hist_reading_t;
+
+ static uint32_t m_range_next_seq = 0;    // GET/GETT range being sent
+ static uint32_t m_range_end_seq  = 0;
+
+/* Uptime clock. The app timer counter wraps after 2^24 ticks, it is folded
+ * into m_uptime_base_s every UPTIME_TIMER_PERIOD_S, well before that
+ */
+#define UPTIME_TIMER_PERIOD_S   256
+#define APP_TIMER_TICK_FREQ     (APP_TIMER_CLOCK_FREQ / (APP_TIMER_CONFIG_RTC_FREQUENCY + 1))  /**< App timer ticks per second, after the RTC prescaler. */
+static uint32_t m_uptime_base_s     = 0;
+static uint32_t m_uptime_base_ticks = 0;
+
+static void uptime_timer_handler(void * p_context)
+{
+    m_uptime_base_s    += UPTIME_TIMER_PERIOD_S;
+    m_uptime_base_ticks = (m_uptime_base_ticks +
+                           APP_TIMER_TICKS(UPTIME_TIMER_PERIOD_S * 1000)) & APP_TIMER_MAX_CNT_VAL;
+}
+
+// Returns the HIST_STALE_* and HIST_EARLY flags of the current AVG_* values
+uint8_t meas_flags(void)
+{
+    return ((CHANNEL_AGE[SAADC_SCAN_TEMP_CH] > 0) ? HIST_STALE_TEMP : 0) |
+           ((CHANNEL_AGE[SAADC_SCAN_BATT_CH] > 0) ? HIST_STALE_BATT : 0) |
+           ((AVG_SAMPLE_CNT < m_saadc_profiles[REGULAR_SAADC_PROFILE].max_samples) ?
+            HIST_EARLY : 0);
+}
+
+// Returns seconds since boot
+uint32_t uptime_seconds(void)
+{
+    return m_uptime_base_s +
+           app_timer_cnt_diff_compute(app_timer_cnt_get(), m_uptime_base_ticks) /
+           APP_TIMER_TICK_FREQ;
+}
+
+// Converts an app timer tick count to 1/units_per_s seconds, e.g. 1000 for ms
+uint32_t ticks_to_time(uint32_t ticks, uint32_t units_per_s)
+{
+    return (uint32_t)(((uint64_t)ticks * units_per_s) / APP_TIMER_TICK_FREQ);
+}
+
+// Returns the buffer slot of the reading at position pos (0 = oldest)
+ uint16_t hist_slot(uint32_t pos)
+ {
+    uint32_t slot = HIST_HEAD + pos;
+    return (uint16_t)((slot >= DATA_BUFF_SIZE) ? slot - DATA_BUFF_SIZE : slot);
+ }
+
+// Reads the width bit field at bit offset shift of the reading in slot
+ static uint32_t hist_field_get(uint16_t slot, uint8_t shift, uint8_t width)
+ {
+    uint32_t bit = (uint32_t)slot * HIST_RECORD_BITS + shift;
+    uint8_t *p   = &hist_store[bit / 8];
+    uint32_t raw = p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16);
+
+    return (raw >> (bit % 8)) & ((1UL << width) - 1);
+ }
+
+// Writes value, saturated to width bits, to a field of the reading in slot
+ static void hist_field_set(uint16_t slot, uint8_t shift, uint8_t width, uint32_t value)
+ {
+    uint32_t bit  = (uint32_t)slot * HIST_RECORD_BITS + shift;
+    uint8_t *p    = &hist_store[bit / 8];
+    uint32_t mask = ((1UL << width) - 1) << (bit % 8);
+    uint32_t raw  = p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16);
+
+    value = MIN(value, (1UL << width) - 1);
+    raw   = (raw & ~mask) | (value << (bit % 8));
+    p[0]  = (uint8_t)raw;
+    p[1]  = (uint8_t)(raw >> 8);
+    p[2]  = (uint8_t)(raw >> 16);
+ }
 
- uint16_t ph_mv  [DATA_BUFF_SIZE];
- uint16_t temp_mv[DATA_BUFF_SIZE];
- uint16_t batt_mv[DATA_BUFF_SIZE];
- float     ph_cal [DATA_BUFF_SIZE];
+ void hist_read(uint16_t slot, hist_reading_t * p_reading)
+ {
+    p_reading->ph_mv   = hist_field_get(slot, HIST_PH_SHIFT,   HIST_MV_BITS);
+    p_reading->temp_mv = hist_field_get(slot, HIST_TEMP_SHIFT, HIST_MV_BITS);
+    p_reading->batt_mv = hist_field_get(slot, HIST_BATT_SHIFT, HIST_MV_BITS);
+    p_reading->dt      = hist_field_get(slot, HIST_DT_SHIFT,   HIST_DT_BITS);
+    p_reading->flags   = hist_field_get(slot, HIST_FLAG_SHIFT, HIST_FLAG_BITS);
+ }
+
+ void hist_write(uint16_t slot, hist_reading_t const * p_reading)
+ {
+    hist_field_set(slot, HIST_PH_SHIFT,   HIST_MV_BITS, p_reading->ph_mv);
+    hist_field_set(slot, HIST_TEMP_SHIFT, HIST_MV_BITS, p_reading->temp_mv);
+    hist_field_set(slot, HIST_BATT_SHIFT, HIST_MV_BITS, p_reading->batt_mv);
+    hist_field_set(slot, HIST_DT_SHIFT,   HIST_DT_BITS, p_reading->dt);
+    hist_field_set(slot, HIST_FLAG_SHIFT, HIST_FLAG_BITS, p_reading->flags);
+ }
+
+// Returns the time delta of the reading in slot, in seconds
+ uint32_t hist_dt(uint16_t slot)
+ {
+    return hist_field_get(slot, HIST_DT_SHIFT, HIST_DT_BITS) * HIST_DT_UNIT_S;
+ }
 
 // Function to initialize all buffers with values of 0
  void init_data_buffers(void)
  {
-    for(int i = 0; i < DATA_BUFF_SIZE; i++) {
-        ph_mv  [i] = 0;
-        temp_mv[i] = 0;
-        batt_mv[i] = 0;
-        ph_cal [i] = 0;
-    }
+    memset(hist_store, 0, sizeof(hist_store));
+    TOTAL_DATA_IN_BUFFERS = 0;
+    HIST_HEAD = 0;
+    HIST_SPAN = 0;
     PACK_CTR = 0;
  }
 
  void reset_data_buffers(void)
  {
     NRF_LOG_INFO("RESETTING PH BUFFERS");
-    int i = 0;
-    while(ph_mv[i] != 0) {
-        ph_mv  [i] = 0;
-        temp_mv[i] = 0;
-        batt_mv[i] = 0;
-        ph_cal [i] = 0;
-        i++;
+    HIST_LOG_SEQ += TOTAL_DATA_IN_BUFFERS;
+    TOTAL_DATA_IN_BUFFERS = 0;
+    HIST_HEAD = 0;
+    HIST_SPAN = 0;
+    PACK_CTR = 0;
+    HIST_FIRST_SEQ = 0;
+    m_range_next_seq = 0;
+    m_range_end_seq  = 0;
+    advertising_update_status();
+ }
+
+// Frees the cnt oldest readings by moving the head of the ring past them
+ void free_data_buffers(uint16_t cnt)
+ {
+    uint16_t remaining;
+
+    if (cnt >= TOTAL_DATA_IN_BUFFERS) {
+        reset_data_buffers();
+        return;
+    }
+    remaining = TOTAL_DATA_IN_BUFFERS - cnt;
+    // The delta of the new oldest reading no longer counts either
+    for (uint16_t i = 1; i <= cnt; i++)
+        HIST_SPAN -= hist_dt(hist_slot(i));
+    HIST_HEAD = hist_slot(cnt);
+    HIST_LOG_SEQ += cnt;
+    TOTAL_DATA_IN_BUFFERS = remaining;
+    PACK_CTR = (PACK_CTR > cnt) ? PACK_CTR - cnt : 0;
+    HIST_FIRST_SEQ += cnt;
+    NRF_LOG_INFO("%d readings acknowledged, %d left", cnt, remaining);
+    advertising_update_status();
+ }
+
+// Returns the uptime in seconds at which the oldest reading was buffered
+ uint32_t hist_oldest_time(void)
+ {
+    return (HIST_LAST_TIME > HIST_SPAN) ? HIST_LAST_TIME - HIST_SPAN : 0;
+ }
+
+// Returns the uptime in seconds at which the reading at pos was buffered
+ uint32_t hist_time_of(uint32_t pos)
+ {
+    uint32_t t = HIST_LAST_TIME;
+    if (pos == 0)
+        return hist_oldest_time();
+    for (uint32_t i = TOTAL_DATA_IN_BUFFERS - 1; i > pos; i--) {
+        uint32_t dt = hist_dt(hist_slot(i));
+        t = (t > dt) ? t - dt : 0;
+    }
+    return t;
+ }
+
+/* History archive
+ *
+ * Readings that overflow the buffers are kept at a lower resolution. Each
+ * archive entry aggregates a run of consecutive readings (first and last
+ * time, count, pH mV average/min/max, temperature and battery mV average).
+ * The overflowing reading is appended as a new entry of one reading. When
+ * the archive is full, the two adjacent entries with the smallest combined
+ * count are merged first (the older pair on a tie), so recent overflow
+ * stays finer than old overflow and the archive never grows or drops data.
+ *
+ * "ARCH" replies "ARCH,<entries>\n" and then sends one
+ * "A,<first time>,<last time>,<count>,<pH avg>,<pH min>,<pH max>,<temp avg>,<batt avg>\n"
+ * line per entry, oldest first. "ARCH_CLR" then frees the entries sent.
+ * An archive that changes during the transfer is not freed. The archive is
+ * kept in the history log as a snapshot, see History log
+ */
+ #define HIST_ARCHIVE_SIZE 16
+
+ typedef struct
+ {
+    uint32_t t_first;
+    uint32_t t_last;
+    uint32_t count;
+    uint16_t ph_avg;
+    uint16_t ph_min;
+    uint16_t ph_max;
+    uint16_t temp_avg;
+    uint16_t batt_avg;
+ } hist_aggregate_t;
+
+ hist_aggregate_t hist_archive[HIST_ARCHIVE_SIZE];
+ uint8_t          HIST_ARCHIVE_CNT = 0;
+
+ static uint8_t m_arch_next = 0;    // ARCH transfer, entries m_arch_next to m_arch_end
+ static uint8_t m_arch_end  = 0;
+
+ static bool     m_arch_dirty     = false;   // readings archived since the last snapshot
+ static uint32_t m_arch_dirty_seq = 0;       // sequence of the first of them
+ static bool     m_arch_snap_due  = false;   // entries freed since the last snapshot
+ static uint32_t m_arch_gen       = 0;       // counts changes of the archive
+
+// Count weighted average of two aggregate averages
+ static uint16_t hist_weighted_avg(uint16_t a, uint32_t a_cnt, uint16_t b, uint32_t b_cnt)
+ {
+    uint64_t total = (uint64_t)a_cnt + b_cnt;
+    return (uint16_t)(((uint64_t)a * a_cnt + (uint64_t)b * b_cnt + total / 2) / total);
+ }
+
+// Merges archive entry i + 1 into entry i
+ static void hist_archive_merge(uint8_t i)
+ {
+    hist_aggregate_t *a = &hist_archive[i];
+    hist_aggregate_t *b = &hist_archive[i + 1];
+
+    a->ph_avg   = hist_weighted_avg(a->ph_avg,   a->count, b->ph_avg,   b->count);
+    a->temp_avg = hist_weighted_avg(a->temp_avg, a->count, b->temp_avg, b->count);
+    a->batt_avg = hist_weighted_avg(a->batt_avg, a->count, b->batt_avg, b->count);
+    a->ph_min   = MIN(a->ph_min, b->ph_min);
+    a->ph_max   = MAX(a->ph_max, b->ph_max);
+    a->t_last   = b->t_last;
+    a->count   += b->count;
+    memmove(&hist_archive[i + 1], &hist_archive[i + 2], 
+            (HIST_ARCHIVE_CNT - i - 2) * sizeof(hist_archive[0]));
+    HIST_ARCHIVE_CNT--;
+ }
+
+// Moves the oldest buffered reading to the archive and frees it
+ void hist_archive_push(void)
+ {
+    hist_reading_t    reading;
+    hist_aggregate_t *p_entry;
+
+    if (HIST_ARCHIVE_CNT == HIST_ARCHIVE_SIZE) {
+        uint8_t  merge = 0;
+        uint32_t best  = UINT32_MAX;
+        for (uint8_t i = 0; i + 1 < HIST_ARCHIVE_CNT; i++) {
+            uint32_t cnt = hist_archive[i].count + hist_archive[i + 1].count;
+            if (cnt < best) {
+                best  = cnt;
+                merge = i;
+            }
+        }
+        hist_archive_merge(merge);
+    }
+    // Entries sent so far may have moved, keep them
+    m_arch_next = 0;
+    m_arch_end  = 0;
+
+    hist_read(hist_slot(0), &reading);
+    p_entry = &hist_archive[HIST_ARCHIVE_CNT++];
+    p_entry->t_first  = hist_oldest_time();
+    p_entry->t_last   = p_entry->t_first;
+    p_entry->count    = 1;
+    p_entry->ph_avg   = reading.ph_mv;
+    p_entry->ph_min   = reading.ph_mv;
+    p_entry->ph_max   = reading.ph_mv;
+    p_entry->temp_avg = reading.temp_mv;
+    p_entry->batt_avg = reading.batt_mv;
+    if (!m_arch_dirty) {
+        m_arch_dirty     = true;
+        m_arch_dirty_seq = HIST_LOG_SEQ;
+    }
+    m_arch_gen++;
+    free_data_buffers(1);
+ }
+
+// Appends a reading to the buffers, archiving the oldest one if they are full
+ void hist_append(hist_reading_t const * p_reading)
+ {
+    if (TOTAL_DATA_IN_BUFFERS >= DATA_BUFF_SIZE) {
+        NRF_LOG_INFO("BUFFERS FULL, ARCHIVING OLDEST READING");
+        hist_archive_push();
+    }
+    hist_write(hist_slot(TOTAL_DATA_IN_BUFFERS), p_reading);
+    if (TOTAL_DATA_IN_BUFFERS > 0)
+        HIST_SPAN += hist_dt(hist_slot(TOTAL_DATA_IN_BUFFERS));
+    TOTAL_DATA_IN_BUFFERS++;
+ }
+
+/* History log
+ *
+ * Buffered readings are appended to a log in the HIST_LOG_PAGES flash pages
+ * right below the FDS pages, so they survive PWROFF, the power off after an
+ * advertising timeout and resets. Each page starts with a header
+ * (HIST_LOG_MAGIC, page sequence, acknowledged sequence) followed by
+ * entries. Entries are little endian 32-bit words:
+ *
+ *   word 0    HIST_LOG_TAG_DATA or HIST_LOG_TAG_ACK | payload bytes << 8 | count
+ *             or HIST_LOG_TAG_ARCH | archive entries
+ *   word 1    sequence of the first reading (data) or acknowledged sequence
+ *   payload   compressed readings, zero padded to a word, or the archive
+ *             entries as hist_aggregate_t
+ *   last word sequence ^ HIST_LOG_MAGIC
+ *
+ * The payload of a data block is a bit stream holding count readings,
+ * each one as four codes in the order pH mV, temperature mV, battery mV,
+ * and the time delta shifted left by HIST_FLAG_BITS with the flags below
+ * it. Every code holds the zig-zag encoded difference z to the same
+ * field of the previous reading, the first reading of a block to 0.
+ * Zig-zag maps a difference d to (d << 1) ^ (d >> 31). Bits are packed
+ * least significant first, from bit 0 of byte 0 on, the last byte is
+ * zero padded. A code is a prefix followed by z in as many bits:
+ *
+ *   prefix   z bits   for
+ *   0        -        z = 0
+ *   10       2        z < 4
+ *   110      4        z < 16
+ *   1110     6        z < 64
+ *   11110    12       z < 4096
+ *   11111    32       any other z
+ *
+ * Prefix bits are read first to last. An unchanged reading takes 4 bits, a
+ * slowly changing one about 8 to 20, the first reading of a block about 7
+ * bytes; instead of 20 bytes as ASCII or 8 unpacked. The benchmark corpus
+ * of test_getblk averages about 2.1 bytes per reading with the entry
+ * overhead. Blocks are sealed at HIST_LOG_BLOCK_READINGS readings or
+ * HIST_LOG_MAX_PAYLOAD bytes and are never re-encoded, "GETBLK" sends
+ * them as stored, see check_for_block_request().
+ *
+ * The last word of an entry is written last, an entry without it was cut
+ * by a power loss and is skipped. The magic word of a page header is
+ * written after the rest of it for the same reason. Readings are written
+ * in blocks of up to HIST_LOG_BLOCK_READINGS. A shorter block, and an ack marker if readings
+ * were freed since the last one, are only written before the chip powers
+ * itself off, see chip_power_off(). Readings below the acknowledged
+ * sequence (HIST_LOG_SEQ when they were written) are not restored. When a
+ * page is full the other one is erased and written next, its header
+ * carries the acknowledged sequence over. Entries wait until the erase and
+ * the header are done. Readings still buffered whose only copy is on the
+ * page being erased are moved to the archive first, see hist_log_new_page().
+ *
+ * A flash operation that fails is issued again, up to HIST_LOG_RETRIES
+ * times. After that only its own entry is given up: the readings of a
+ * block stay pending and are written with the next one, an ack marker
+ * stays due and a new page is erased again.
+ *
+ * An archive snapshot holds the whole archive and acknowledges the
+ * readings before it, the last one found at boot becomes the archive. The
+ * log only acknowledges readings up to the first one archived since the
+ * last snapshot, so readings moved to the archive are restored as readings
+ * instead of being lost; readings sent and freed after it may be sent
+ * again after a reset. A snapshot is written after "ARCH_CLR", before the
+ * chip powers itself off and before a page switch, into the last
+ * HIST_LOG_ARCH_LEN(HIST_ARCHIVE_SIZE) bytes of the full page kept free for
+ * it, so the page that survives the erase holds one.
+ *
+ * hist_log_init() restores the log at boot by hopping from entry to entry
+ * of the (at most two) pages, words that start no valid entry, erased or
+ * left by a write that was given up, are stepped over. Readings not yet
+ * written are lost on a reset, at most one block. Times of the restored
+ * readings are relative to boot, archive entries keep the times of the
+ * session they were recorded in
+ */
+#define HIST_LOG_PAGE_SIZE       4096
+#define HIST_LOG_PAGES           2
+#define HIST_LOG_END_ADDR        (0x30000 - FDS_VIRTUAL_PAGES * FDS_VIRTUAL_PAGE_SIZE * 4)  /**< nRF52810 flash end, FDS pages above. */
+#define HIST_LOG_START_ADDR      (HIST_LOG_END_ADDR - HIST_LOG_PAGES * HIST_LOG_PAGE_SIZE)  /**< 0x2B000, where the linker FLASH region ends. */
+#define HIST_LOG_MAGIC           0x34474C48                 /**< "HLG4", bit packed readings with HIST_EARLY. */
+#define HIST_LOG_TAG_DATA        0xDA7A0000
+#define HIST_LOG_TAG_ACK         0xACC00000
+#define HIST_LOG_TAG_ARCH        0xA4C80000
+#define HIST_LOG_HDR_LEN         12
+#define HIST_LOG_ACK_LEN         12
+#define HIST_LOG_BLOCK_READINGS  32
+#define HIST_LOG_MAX_PAYLOAD     88                         /**< A sealed block fits one notification of NUS_TX_ITEM_MAX_LEN. */
+#define HIST_LOG_ENTRY_LEN(len)  (12 + (((len) + 3) & ~3))
+#define HIST_LOG_ARCH_LEN(cnt)   HIST_LOG_ENTRY_LEN((cnt) * sizeof(hist_aggregate_t))
+#define HIST_LOG_DATA_END        (HIST_LOG_PAGE_SIZE - HIST_LOG_ARCH_LEN(HIST_ARCHIVE_SIZE))  /**< Data and acks end here, a snapshot fits after. */
+#define HIST_LOG_RETRIES         3                          /**< Attempts of a flash operation before it is given up. */
+
+static void hist_log_evt_handler(nrf_fstorage_evt_t * p_evt);
+
+NRF_FSTORAGE_DEF(nrf_fstorage_t m_log_fs) =
+{
+    .evt_handler = hist_log_evt_handler,
+    .start_addr  = HIST_LOG_START_ADDR,
+    .end_addr    = HIST_LOG_END_ADDR - 1,
+};
+
+static uint32_t m_log_buf[HIST_LOG_ENTRY_LEN(HIST_LOG_MAX_PAYLOAD) / 4];   // data block being written
+static uint32_t m_log_ack_buf[3];                            // ack marker being written
+static uint32_t m_log_page_hdr[3];                           // page header being written
+static uint32_t m_log_arch_buf[HIST_LOG_ARCH_LEN(HIST_ARCHIVE_SIZE) / 4];  // archive snapshot being written
+static volatile bool m_log_data_busy = false;
+static volatile bool m_log_ack_busy  = false;
+static volatile bool m_log_arch_busy = false;
+static volatile bool m_log_hdr_busy  = false;              // erase or header of a new page
+static volatile uint8_t m_log_ops_pending = 0;               // flash operations queued
+static volatile bool m_log_flush_busy    = false;            // hist_log_flush() running
+static volatile bool m_log_flush_retry   = false;            // called again meanwhile
+static volatile bool m_log_flush_partial = false;            // with partial set
+static uint8_t m_log_data_tries  = 0;                        // attempts left of each operation
+static uint8_t m_log_ack_tries   = 0;
+static uint8_t m_log_hdr_tries   = 0;
+static uint8_t m_log_arch_tries  = 0;
+static uint8_t m_log_erase_tries = 0;
+
+static uint8_t  m_log_page      = 0;     // page written to
+static uint32_t m_log_page_seq  = 0;
+static uint32_t m_log_offset    = 0;     // next entry in m_log_page
+static uint32_t m_log_page_first = 0;    // readings below it are on the other page
+static bool     m_log_page_snap  = false; // archive snapshot in m_log_page
+static uint32_t m_log_arch_gen   = 0;     // m_arch_gen of the snapshot being written
+static bool     m_log_page_ready = true; // header of m_log_page written
+static uint32_t m_log_written   = 0;     // first reading not in the log
+static uint32_t m_log_data_end  = 0;     // m_log_written once the block is written
+static uint32_t m_log_acked     = 0;     // acknowledged sequence in the log
+
+static volatile bool m_power_off_pending = false;
+
+static uint8_t  m_blk_pass   = 3;       // GETBLK: 0 older page, 1 newer page, 2 end, 3 idle
+static uint32_t m_blk_offset = 0;
+
+#define HIST_CODE_CLASSES   5
+static uint8_t const m_hist_code_bits[HIST_CODE_CLASSES] = {2, 4, 6, 12, 32};  // z bits after a prefix of class + 1 ones
+
+// Appends the bits lowest bits of value at bit *p_pos of the zeroed p_out
+static void hist_bits_put(uint8_t * p_out, uint32_t * p_pos, uint32_t value, uint8_t bits)
+{
+    for (uint8_t i = 0; i < bits; i++, (*p_pos)++) {
+        if (value & (1UL << i))
+            p_out[*p_pos >> 3] |= (uint8_t)(1 << (*p_pos & 7));
+    }
+}
+
+// Reads bits bits at bit *p_pos, bits from end on read as 0
+static uint32_t hist_bits_get(uint8_t const * p_in, uint32_t * p_pos, uint32_t end, uint8_t bits)
+{
+    uint32_t value = 0;
+
+    for (uint8_t i = 0; i < bits; i++, (*p_pos)++) {
+        if (*p_pos < end && (p_in[*p_pos >> 3] & (1 << (*p_pos & 7))))
+            value |= 1UL << i;
+    }
+    return value;
+}
+
+// Returns the class of a non-zero z, the first whose z bits hold it
+static uint8_t hist_code_class(uint32_t z)
+{
+    uint8_t class = 0;
+
+    while (class < HIST_CODE_CLASSES - 1 && z >= (1UL << m_hist_code_bits[class]))
+        class++;
+    return class;
+}
+
+// Returns the length in bits of the code of z, see History log
+static uint8_t hist_code_len(uint32_t z)
+{
+    uint8_t class = hist_code_class(z);
+
+    if (z == 0)
+        return 1;
+    return MIN(class + 2, HIST_CODE_CLASSES) + m_hist_code_bits[class];
+}
+
+static void hist_code_put(uint8_t * p_out, uint32_t * p_pos, uint32_t z)
+{
+    uint8_t class = hist_code_class(z);
+
+    if (z == 0) {
+        (*p_pos)++;
+        return;
+    }
+    // class + 1 ones, and a zero unless it is the last class
+    hist_bits_put(p_out, p_pos, (1UL << (class + 1)) - 1, MIN(class + 2, HIST_CODE_CLASSES));
+    hist_bits_put(p_out, p_pos, z, m_hist_code_bits[class]);
+}
+
+static uint32_t hist_code_get(uint8_t const * p_in, uint32_t * p_pos, uint32_t end)
+{
+    uint8_t ones = 0;
+
+    while (ones < HIST_CODE_CLASSES && hist_bits_get(p_in, p_pos, end, 1))
+        ones++;
+    if (ones == 0)
+        return 0;
+    return hist_bits_get(p_in, p_pos, end, m_hist_code_bits[ones - 1]);
+}
+
+static uint32_t hist_zigzag(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t hist_unzigzag(uint32_t value)
+{
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+#define HIST_FIELDS     4
+
+// The fields of a reading in code order, see History log
+static void hist_fields_get(hist_reading_t const * p_reading, int32_t * p_field)
+{
+    p_field[0] = p_reading->ph_mv;
+    p_field[1] = p_reading->temp_mv;
+    p_field[2] = p_reading->batt_mv;
+    p_field[3] = (p_reading->dt << HIST_FLAG_BITS) | p_reading->flags;
+}
+
+static void hist_fields_set(hist_reading_t * p_reading, int32_t const * p_field)
+{
+    p_reading->ph_mv   = (uint16_t)p_field[0];
+    p_reading->temp_mv = (uint16_t)p_field[1];
+    p_reading->batt_mv = (uint16_t)p_field[2];
+    p_reading->dt      = (uint8_t)(p_field[3] >> HIST_FLAG_BITS);
+    p_reading->flags   = p_field[3] & ((1 << HIST_FLAG_BITS) - 1);
+}
+
+/* Compresses up to count readings from buffer position pos into p_out,
+ * which must be zeroed, see History log. Returns the number of readings
+ * encoded, *p_len the payload length
+ */
+static uint8_t hist_block_encode(uint32_t pos, uint32_t count, uint8_t * p_out, uint8_t * p_len)
+{
+    int32_t        prev[HIST_FIELDS] = {0};
+    int32_t        field[HIST_FIELDS];
+    hist_reading_t reading;
+    uint32_t       bits = 0;
+    uint8_t        n;
+
+    for (n = 0; n < count; n++) {
+        uint32_t len = 0;
+
+        hist_read(hist_slot(pos + n), &reading);
+        hist_fields_get(&reading, field);
+        for (int f = 0; f < HIST_FIELDS; f++)
+            len += hist_code_len(hist_zigzag(field[f] - prev[f]));
+        if (bits + len > HIST_LOG_MAX_PAYLOAD * 8)
+            break;
+        for (int f = 0; f < HIST_FIELDS; f++) {
+            hist_code_put(p_out, &bits, hist_zigzag(field[f] - prev[f]));
+            prev[f] = field[f];
+        }
+    }
+    *p_len = (uint8_t)((bits + 7) / 8);
+    return n;
+}
+
+static uint32_t hist_log_page_addr(uint8_t page)
+{
+    return HIST_LOG_START_ADDR + page * HIST_LOG_PAGE_SIZE;
+}
+
+static uint32_t hist_log_word(uint32_t addr)
+{
+    uint32_t word = 0xFFFFFFFF;
+    (void)nrf_fstorage_read(&m_log_fs, addr, &word, sizeof(word));
+    return word;
+}
+
+// Attempts left of the operation on p_param, the erase has none
+static uint8_t * hist_log_tries(void const * p_param)
+{
+    if (p_param == m_log_buf)
+        return &m_log_data_tries;
+    if (p_param == m_log_ack_buf)
+        return &m_log_ack_tries;
+    if (p_param == m_log_page_hdr || p_param == &m_log_page_hdr[1])
+        return &m_log_hdr_tries;
+    if (p_param == m_log_arch_buf)
+        return &m_log_arch_tries;
+    return &m_log_erase_tries;
+}
+
+// Queues a write of len bytes at addr
+static bool hist_log_queue(uint32_t addr, uint32_t const * p_src, uint32_t len)
+{
+    uint32_t err_code = nrf_fstorage_write(&m_log_fs, addr, p_src, len, (void *)p_src);
+    if (err_code != NRF_SUCCESS) {
+        NRF_LOG_WARNING("History log write not queued: 0x%x", err_code);
+        return false;
+    }
+    *hist_log_tries(p_src) = HIST_LOG_RETRIES;
+    CRITICAL_REGION_ENTER();
+    m_log_ops_pending++;
+    CRITICAL_REGION_EXIT();
+    return true;
+}
+
+// Queues a write of len bytes at the end of the log
+static bool hist_log_write(uint32_t const * p_src, uint32_t len)
+{
+    if (!hist_log_queue(hist_log_page_addr(m_log_page) + m_log_offset, p_src, len))
+        return false;
+    m_log_offset += len;
+    return true;
+}
+
+// Queues the erase of m_log_page, hist_log_evt_handler() writes its header
+static bool hist_log_erase(void)
+{
+    if (nrf_fstorage_erase(&m_log_fs, hist_log_page_addr(m_log_page), 1, NULL) != NRF_SUCCESS)
+        return false;
+    m_log_erase_tries = HIST_LOG_RETRIES;
+    CRITICAL_REGION_ENTER();
+    m_log_ops_pending++;
+    CRITICAL_REGION_EXIT();
+    m_log_hdr_busy = true;
+    return true;
+}
+
+// Sequence the log may acknowledge, readings archived since the last snapshot are not
+static uint32_t hist_log_ack_seq(void)
+{
+    return m_arch_dirty ? MIN(HIST_LOG_SEQ, m_arch_dirty_seq) : HIST_LOG_SEQ;
+}
+
+// Queues a snapshot of the archive, it acknowledges the readings freed so far
+static void hist_log_snapshot(void)
+{
+    uint32_t len = HIST_LOG_ARCH_LEN(HIST_ARCHIVE_CNT);
+
+    m_log_arch_buf[0] = HIST_LOG_TAG_ARCH | HIST_ARCHIVE_CNT;
+    m_log_arch_buf[1] = HIST_LOG_SEQ;
+    memcpy(&m_log_arch_buf[2], hist_archive, HIST_ARCHIVE_CNT * sizeof(hist_archive[0]));
+    m_log_arch_buf[len / 4 - 1] = HIST_LOG_SEQ ^ HIST_LOG_MAGIC;
+    m_log_arch_gen  = m_arch_gen;
+    m_log_arch_busy = hist_log_write(m_log_arch_buf, len);
+    if (m_log_arch_busy)
+        m_arch_snap_due = false;
+}
+
+// Moves the log to the other page and erases it, see hist_log_switch()
+static void hist_log_new_page(void)
+{
+    // A block in flight still lands on the old page
+    m_log_page_first  = m_log_data_busy ? m_log_data_end : m_log_written;
+    m_log_page        = m_log_page ^ 1;
+    m_log_offset      = HIST_LOG_HDR_LEN;
+    m_log_page_ready  = false;
+    m_log_page_snap   = false;
+    m_log_page_hdr[0] = HIST_LOG_MAGIC;
+    m_log_page_hdr[1] = ++m_log_page_seq;
+    m_log_page_hdr[2] = hist_log_ack_seq();
+    // A GETBLK transfer would read the page being erased
+    if (m_blk_pass < 2)
+        m_blk_pass = 2;
+    (void)hist_log_erase();
+}
+
+/* Leaves the full page. Buffered readings below m_log_page_first would be
+ * lost on a reset once the other page is erased, they are archived instead.
+ * The archive is written to the full page first unless it holds a current
+ * snapshot, the other page may hold the only one. hist_log_evt_handler()
+ * calls hist_log_flush() once it is written, which comes back here. If the
+ * erase cannot be queued, hist_log_flush() tries again
+ */
+static void hist_log_switch(void)
+{
+    uint32_t drop = (m_log_page_first > HIST_LOG_SEQ) ? m_log_page_first - HIST_LOG_SEQ : 0;
+
+    if (m_log_arch_busy)
+        return;
+    if (drop > 0) {
+        NRF_LOG_WARNING("History log full, archiving %d readings", drop);
+        while (drop-- > 0 && TOTAL_DATA_IN_BUFFERS > 0)
+            hist_archive_push();
+    }
+    if (m_arch_dirty || m_arch_snap_due || (!m_log_page_snap && HIST_ARCHIVE_CNT > 0)) {
+        if (m_log_offset + HIST_LOG_ARCH_LEN(HIST_ARCHIVE_CNT) <= HIST_LOG_PAGE_SIZE) {
+            hist_log_snapshot();
+            return;
+        }
+        // No room left, the new page starts with it
+        m_arch_snap_due = true;
+    }
+    hist_log_new_page();
+}
+
+// Does the work of hist_log_flush()
+static void hist_log_flush_once(bool partial)
+{
+    uint32_t pending;
+    uint32_t count = 0;
+    uint32_t len;
+    uint8_t  payload_len = 0;
+    bool     ack;
+
+    if (m_log_written < HIST_LOG_SEQ)
+        m_log_written = HIST_LOG_SEQ;
+    if (!m_log_page_ready) {
+        // The erase or the header of the new page was given up, start over
+        if (!m_log_hdr_busy)
+            (void)hist_log_erase();
+        return;
+    }
+    if (!m_log_arch_busy && (m_arch_snap_due || (partial && m_arch_dirty))) {
+        // The space after HIST_LOG_DATA_END stays free for hist_log_switch()
+        if (m_log_offset + HIST_LOG_ARCH_LEN(HIST_ARCHIVE_CNT) > HIST_LOG_DATA_END) {
+            hist_log_switch();
+            return;
+        }
+        hist_log_snapshot();
+    }
+    pending = HIST_LOG_SEQ + TOTAL_DATA_IN_BUFFERS - m_log_written;
+    if (!m_log_data_busy && (pending >= HIST_LOG_BLOCK_READINGS || (partial && pending > 0))) {
+        // Seal a block, the rest stays pending for the next one
+        memset(&m_log_buf[2], 0, HIST_LOG_MAX_PAYLOAD + 3);
+        count = hist_block_encode(m_log_written - HIST_LOG_SEQ,
+                                  MIN(pending, HIST_LOG_BLOCK_READINGS),
+                                  (uint8_t *)&m_log_buf[2], &payload_len);
+    }
+    ack = !m_log_ack_busy && hist_log_ack_seq() > m_log_acked && (partial || count > 0);
+    if (count == 0 && !ack)
+        return;
+
+    len = (count > 0 ? HIST_LOG_ENTRY_LEN(payload_len) : 0) + (ack ? HIST_LOG_ACK_LEN : 0);
+    if (m_log_offset + len > HIST_LOG_DATA_END) {
+        // The page header carries the acknowledged sequence, the block is
+        // sealed again once the page is ready
+        hist_log_switch();
+        return;
+    }
+    if (ack) {
+        m_log_ack_buf[0] = HIST_LOG_TAG_ACK;
+        m_log_ack_buf[1] = hist_log_ack_seq();
+        m_log_ack_buf[2] = m_log_ack_buf[1] ^ HIST_LOG_MAGIC;
+        m_log_ack_busy   = hist_log_write(m_log_ack_buf, HIST_LOG_ACK_LEN);
+    }
+    if (count > 0) {
+        uint32_t entry_len = HIST_LOG_ENTRY_LEN(payload_len);
+
+        m_log_buf[0] = HIST_LOG_TAG_DATA | (payload_len << 8) | count;
+        m_log_buf[1] = m_log_written;
+        m_log_buf[entry_len / 4 - 1] = m_log_written ^ HIST_LOG_MAGIC;
+        m_log_data_end  = m_log_written + count;
+        m_log_data_busy = hist_log_write(m_log_buf, entry_len);
+    }
+}
+
+/* Writes the buffered readings not in the log yet, a block at a time, and
+ * a snapshot of the archive if it was freed. With partial set, fewer
+ * readings than a block, the acknowledged sequence and the archive if it
+ * changed are written too. Called from the main loop and from
+ * hist_log_evt_handler(), m_log_flush_busy keeps the two from sealing the
+ * same block twice, like nus_tx_flush()
+ */
+void hist_log_flush(bool partial)
+{
+    bool busy;
+
+    CRITICAL_REGION_ENTER();
+    busy = m_log_flush_busy;
+    m_log_flush_busy     = true;
+    m_log_flush_retry    = busy;
+    m_log_flush_partial |= partial;
+    CRITICAL_REGION_EXIT();
+    // The interrupted flush sees m_log_flush_retry and runs once more
+    if (busy)
+        return;
+
+    do {
+        CRITICAL_REGION_ENTER();
+        m_log_flush_retry   = false;
+        partial             = m_log_flush_partial;
+        m_log_flush_partial = false;
+        CRITICAL_REGION_EXIT();
+        hist_log_flush_once(partial);
+        CRITICAL_REGION_ENTER();
+        busy = m_log_flush_retry;
+        m_log_flush_busy = busy;
+        CRITICAL_REGION_EXIT();
+    } while (busy);
+}
+
+// Turns the chip off by releasing its power pin
+static void chip_power_cut(void)
+{
+    m_power_off_pending = false;
+    nrfx_gpiote_out_clear(CHIP_POWER_PIN);
+    nrfx_gpiote_out_uninit(CHIP_POWER_PIN);
+    nrfx_gpiote_uninit();
+}
+
+/* Writes what the history log is missing, then turns the chip off. If flash
+ * operations are queued the power is cut once the last one completes
+ */
+void chip_power_off(void)
+{
+    if (m_power_off_pending)
+        return;
+    hist_log_flush(true);
+    if (m_log_ops_pending > 0)
+        m_power_off_pending = true;
+    else
+        chip_power_cut();
+}
+
+static void hist_log_evt_handler(nrf_fstorage_evt_t * p_evt)
+{
+    bool      ok      = (p_evt->result == NRF_SUCCESS);
+    uint8_t * p_tries = hist_log_tries(p_evt->p_param);
+
+    if (!ok && *p_tries > 1) {
+        uint32_t err_code;
+
+        // Same flash again, the operation stays counted in m_log_ops_pending
+        (*p_tries)--;
+        if (p_evt->id == NRF_FSTORAGE_EVT_ERASE_RESULT)
+            err_code = nrf_fstorage_erase(&m_log_fs, p_evt->addr, 1, NULL);
+        else
+            err_code = nrf_fstorage_write(&m_log_fs, p_evt->addr, p_evt->p_src, 
+                                          p_evt->len, p_evt->p_param);
+        if (err_code == NRF_SUCCESS)
+            return;
+    }
+    if (!ok)
+        NRF_LOG_WARNING("History log flash operation failed: 0x%x", p_evt->result);
+    if (p_evt->p_param == m_log_buf) {
+        // Readings of a block given up are written with the next one
+        if (ok)
+            m_log_written = m_log_data_end;
+        m_log_data_busy = false;
+    }
+    else if (p_evt->p_param == m_log_ack_buf) {
+        if (ok)
+            m_log_acked = MAX(m_log_acked, m_log_ack_buf[1]);
+        m_log_ack_busy = false;
+    }
+    else if (p_evt->p_param == m_log_arch_buf) {
+        if (ok) {
+            m_log_acked     = MAX(m_log_acked, m_log_arch_buf[1]);
+            m_log_page_snap = true;
+            // Readings archived while it was written are not in it
+            if (m_arch_gen == m_log_arch_gen)
+                m_arch_dirty = false;
+            else
+                m_arch_dirty_seq = m_log_arch_buf[1];
+        }
+        else
+            m_arch_snap_due = true;
+        m_log_arch_busy = false;
+    }
+    else if (p_evt->p_param == &m_log_page_hdr[1]) {
+        // The magic word goes last, it makes the page valid
+        m_log_hdr_busy = ok && hist_log_queue(hist_log_page_addr(m_log_page), 
+                                              m_log_page_hdr, 4);
+    }
+    else if (p_evt->p_param == m_log_page_hdr) {
+        if (ok) {
+            m_log_acked      = MAX(m_log_acked, m_log_page_hdr[2]);
+            m_log_page_ready = true;
+            NRF_LOG_INFO("History log page %d, sequence %d", m_log_page, m_log_page_hdr[1]);
+        }
+        m_log_hdr_busy = false;
+    }
+    else {
+        // Page erased, entries follow its header
+        m_log_hdr_busy = ok && hist_log_queue(hist_log_page_addr(m_log_page) + 4, 
+                                              &m_log_page_hdr[1], HIST_LOG_HDR_LEN - 4);
+    }
+    CRITICAL_REGION_ENTER();
+    m_log_ops_pending--;
+    CRITICAL_REGION_EXIT();
+    // Readings left behind by an operation that was in flight. After a
+    // failure the next reading tries again
+    if (ok)
+        hist_log_flush(m_power_off_pending);
+    if (m_power_off_pending && m_log_ops_pending == 0)
+        chip_power_cut();
+}
+
+/* Reads the header of the entry at addr, at most room bytes long. Returns
+ * the entry length, 0 if addr is erased or holds no valid entry. The
+ * payload of a snapshot is *p_count archive entries
+ */
+static uint32_t hist_log_entry(uint32_t addr, uint32_t room, uint32_t * p_tag, uint32_t * p_seq, 
+                               uint32_t * p_count, uint32_t * p_payload_len)
+{
+    uint32_t header = hist_log_word(addr);
+    uint32_t len;
+
+    *p_tag         = header & 0xFFFF0000;
+    *p_count       = header & 0xFF;
+    *p_payload_len = (header >> 8) & 0xFF;
+    if (header == 0xFFFFFFFF)
+        return 0;
+    if (*p_tag == HIST_LOG_TAG_ACK) {
+        if (*p_count != 0 || *p_payload_len != 0)
+            return 0;
+    }
+    else if (*p_tag == HIST_LOG_TAG_ARCH) {
+        if (*p_count > HIST_ARCHIVE_SIZE || *p_payload_len != 0)
+            return 0;
+        *p_payload_len = *p_count * sizeof(hist_aggregate_t);
+    }
+    else if (*p_tag != HIST_LOG_TAG_DATA || 
+             *p_count > HIST_LOG_BLOCK_READINGS || *p_payload_len > HIST_LOG_MAX_PAYLOAD)
+        return 0;
+    len = HIST_LOG_ENTRY_LEN(*p_payload_len);
+    if (len > room)
+        return 0;
+    *p_seq = hist_log_word(addr + 4);
+    return len;
+}
+
+// What hist_log_walk() found so far
+typedef struct
+{
+    uint32_t acked;       // highest acknowledged sequence
+    uint32_t next_seq;    // past the last reading
+    uint32_t first;       // first reading of the page walked
+    uint32_t snap_addr;   // last archive snapshot, 0 if none
+    uint32_t restored;    // past the last reading appended
+    bool     restore;     // append the readings from acked on to the buffers
+} hist_log_scan_t;
+
+/* Hops over the entries of page and adds them to *p_scan. Returns the
+ * offset past the last word written in page
+ */
+static uint32_t hist_log_walk(uint8_t page, hist_log_scan_t * p_scan)
+{
+    uint32_t base   = hist_log_page_addr(page);
+    uint32_t offset = HIST_LOG_HDR_LEN;
+    uint32_t end    = HIST_LOG_HDR_LEN;
+
+    while (offset + HIST_LOG_ACK_LEN <= HIST_LOG_PAGE_SIZE) {
+        uint32_t tag, seq, count, payload_len, len;
+
+        len = hist_log_entry(base + offset, HIST_LOG_PAGE_SIZE - offset, 
+                             &tag, &seq, &count, &payload_len);
+        if (len == 0) {
+            // Erased, or left by a write that was given up
+            if (hist_log_word(base + offset) != 0xFFFFFFFF)
+                end = offset + 4;
+            offset += 4;
+            continue;
+        }
+        // Skip entries cut by a power loss
+        if (hist_log_word(base + offset + len - 4) == (seq ^ HIST_LOG_MAGIC)) {
+            if (tag == HIST_LOG_TAG_ACK)
+                p_scan->acked = MAX(p_scan->acked, seq);
+            else if (tag == HIST_LOG_TAG_ARCH) {
+                p_scan->acked     = MAX(p_scan->acked, seq);
+                p_scan->snap_addr = base + offset;
+            }
+            else if (count > 0) {
+                p_scan->next_seq = MAX(p_scan->next_seq, seq + count);
+                p_scan->first    = MIN(p_scan->first, seq);
+            }
+            if (p_scan->restore && tag == HIST_LOG_TAG_DATA && count > 0) {
+                uint8_t         payload[HIST_LOG_MAX_PAYLOAD];
+                int32_t         field[HIST_FIELDS] = {0};
+                hist_reading_t  reading;
+                uint32_t        bits = 0;
+
+                (void)nrf_fstorage_read(&m_log_fs, base + offset + 8, payload, payload_len);
+                for (uint32_t i = 0; i < count; i++) {
+                    for (int f = 0; f < HIST_FIELDS; f++)
+                        field[f] += hist_unzigzag(hist_code_get(payload, &bits, payload_len * 8));
+                    hist_fields_set(&reading, field);
+                    // Acknowledged, or written again after a failed write
+                    if (seq + i < p_scan->acked || seq + i < p_scan->restored)
+                        continue;
+                    // Only freed readings are left out of the log, and they
+                    // are freed oldest first. A block can land before the
+                    // ack marker that frees them when the marker was retried
+                    if (seq + i > p_scan->restored && TOTAL_DATA_IN_BUFFERS > 0)
+                        free_data_buffers(TOTAL_DATA_IN_BUFFERS);
+                    hist_append(&reading);
+                    p_scan->restored = seq + i + 1;
+                }
+            }
+        }
+        offset += len;
+        end     = offset;
+    }
+    return end;
+}
+
+/* Restores the archive and the readings in the history log that were not
+ * acknowledged and finds the end of the log. Call after init_data_buffers()
+ */
+void hist_log_init(void)
+{
+    uint32_t        hdr[HIST_LOG_PAGES][3];
+    hist_log_scan_t scan   = {0};
+    int8_t          newest = -1;
+    int8_t          oldest = -1;
+    uint32_t        err_code;
+
+    err_code = nrf_fstorage_init(&m_log_fs, &nrf_fstorage_sd, NULL);
+    APP_ERROR_CHECK(err_code);
+
+    for (uint8_t page = 0; page < HIST_LOG_PAGES; page++) {
+        (void)nrf_fstorage_read(&m_log_fs, hist_log_page_addr(page), hdr[page], sizeof(hdr[page]));
+        if (hdr[page][0] != HIST_LOG_MAGIC)
+            continue;
+        scan.acked = MAX(scan.acked, hdr[page][2]);
+        if (newest < 0 || hdr[page][1] > hdr[newest][1]) {
+            oldest = newest;
+            newest = page;
+        }
+        else
+            oldest = page;
+    }
+    if (newest < 0) {
+        // Empty log, the first write starts page 0
+        m_log_page   = 1;
+        m_log_offset = HIST_LOG_PAGE_SIZE;
+        NRF_LOG_INFO("History log empty");
+        return;
+    }
+
+    // Acknowledgements and the archive first, then the readings after them
+    if (oldest >= 0)
+        (void)hist_log_walk(oldest, &scan);
+    scan.first   = UINT32_MAX;
+    m_log_offset = hist_log_walk(newest, &scan);
+    m_log_page_first = MIN(scan.first, MAX(scan.next_seq, scan.acked));
+    m_log_page_snap  = (scan.snap_addr >= hist_log_page_addr(newest) &&
+                        scan.snap_addr <  hist_log_page_addr(newest) + HIST_LOG_PAGE_SIZE);
+    if (scan.snap_addr != 0) {
+        HIST_ARCHIVE_CNT = hist_log_word(scan.snap_addr) & 0xFF;
+        (void)nrf_fstorage_read(&m_log_fs, scan.snap_addr + 8, hist_archive, 
+                                HIST_ARCHIVE_CNT * sizeof(hist_archive[0]));
+    }
+    scan.restore = true;
+    if (oldest >= 0)
+        (void)hist_log_walk(oldest, &scan);
+    (void)hist_log_walk(newest, &scan);
+
+    scan.next_seq  = MAX(scan.next_seq, scan.acked);
+    HIST_LOG_SEQ   = scan.next_seq - TOTAL_DATA_IN_BUFFERS;
+    HIST_LAST_TIME = uptime_seconds();
+    // Readings that overflowed the buffers while restoring are archived
+    // but not in a snapshot yet
+    m_arch_dirty     = (HIST_LOG_SEQ > scan.acked);
+    m_arch_dirty_seq = scan.acked;
+    m_log_written  = scan.next_seq;
+    m_log_acked    = scan.acked;
+    m_log_page     = newest;
+    m_log_page_seq = hdr[newest][1];
+    NRF_LOG_INFO("History log: %d readings and %d archive entries restored, page %d offset %d", 
+                 TOTAL_DATA_IN_BUFFERS, HIST_ARCHIVE_CNT, newest, m_log_offset);
+    advertising_update_status();
+}
+
+/* Function to store data in buffer in case of advertising timeout
+ *
+ * On the next connection after timeouts causing data to be buffered,
+ * first add the most recent data to the buffer then call send_buffered_data()
+ * If the buffer is full the oldest reading is archived first
+ */
+void add_data_to_buffers(void)
+{
+    hist_reading_t reading;
+    uint32_t now = uptime_seconds();
+
+    reading.ph_mv   = (uint16_t)MIN(AVG_PH_VAL,   UINT16_MAX);
+    reading.temp_mv = (uint16_t)MIN(AVG_TEMP_VAL, UINT16_MAX);
+    reading.batt_mv = (uint16_t)MIN(AVG_BATT_VAL, UINT16_MAX);
+    reading.dt      = (uint8_t)MIN((now - HIST_LAST_TIME) / HIST_DT_UNIT_S, UINT8_MAX);
+    reading.flags   = meas_flags();
+    hist_append(&reading);
+    HIST_LAST_TIME = now;
+    NRF_LOG_INFO("* * * Total data in BUFFERS: %d \n", TOTAL_DATA_IN_BUFFERS);
+    hist_log_flush(false);
+    advertising_update_status();
+}
+
+/* Notification TX queue
+ *
+ * Every notification goes through nus_tx_enqueue(). The SoftDevice is given
+ * NUS_HVN_TX_QUEUE_SIZE notification buffers per link, each one is a credit.
+ * Queued packets are handed over while credits are left, the rest wait here
+ * and are flushed on BLE_GATTS_EVT_HVN_TX_COMPLETE, which returns as many
+ * credits as packets it reports sent, so no caller spins on the radio.
+ *
+ * Once the queue is empty, the credits left are filled with batches of
+ * buffered records (SEND_BUFFERED_DATA), so every connection event of a
+ * history upload carries as many packets as the link allows. Records are
+ * counted as sent when their packet completes.
+ *
+ * Flushes run from BLE and timer interrupts as well as the main loop,
+ * m_nus_tx_busy keeps them from sending the same packet twice
+ */
+#define NUS_TX_QUEUE_SIZE     4                             /**< Packets waiting for a SoftDevice buffer. */
+#define NUS_TX_ITEM_MAX_LEN   100                           /**< Fits 4 ASCII or 12 binary records. */
+#define NUS_HVN_TX_QUEUE_SIZE 4                             /**< SoftDevice notification buffers per link (BLE_CONN_CFG_GATTS). */
+
+typedef struct
+{
+    uint16_t len;
+    uint8_t  data[NUS_TX_ITEM_MAX_LEN];
+} nus_tx_item_t;
+
+NRF_QUEUE_DEF(nus_tx_item_t, m_nus_tx_queue, NUS_TX_QUEUE_SIZE, NRF_QUEUE_MODE_NO_OVERFLOW);
+static volatile bool m_nus_tx_busy  = false;
+static volatile bool m_nus_tx_retry = false;
+
+static uint8_t          m_tx_records[NUS_HVN_TX_QUEUE_SIZE]; // buffered records in each packet in flight
+static uint8_t          m_tx_head      = 0;                  // oldest packet in flight
+static volatile uint8_t m_tx_in_flight = 0;                  // packets accepted by the SoftDevice
+
+static uint32_t m_upload_records_sent = 0;
+static uint32_t m_upload_start_ticks  = 0;
+
+static bool              m_hist_ack_mode     = false; // central sent ACK this connection
+static volatile int32_t  m_hist_ack_index    = -1;    // last ACK_nnn index, not applied yet
+static volatile bool     m_hist_ack_all_sent = false; // DONE received, not applied yet
+
+bool send_buffered_data(void);
+bool send_range_data(void);
+bool hist_range_pending(void);
+bool send_archive_data(void);
+bool send_block_data(void);
+
+// Modulus of the packet indexes in the format of this connection
+uint32_t hist_index_modulus(void)
+{
+    return BINARY_FORMAT ? 65536 : 1000;
+}
+
+// Buffer position of the reading sent with packet index
+uint32_t hist_pos_of_index(uint32_t index)
+{
+    uint32_t modulus = hist_index_modulus();
+    return ((index % modulus) + modulus - (HIST_FIRST_SEQ % modulus)) % modulus;
+}
+
+/* Frees the readings acknowledged since the last flush. Runs inside the
+ * flush, so it never moves the buffers under a batch being packed.
+ * Indexes are sent modulo 1000 (ASCII) or 65536 (binary), which is
+ * unambiguous as fewer than DATA_BUFF_SIZE readings are buffered
+ */
+void hist_apply_acks(void)
+{
+    int32_t  index   = m_hist_ack_index;
+    uint32_t offset;
+
+    m_hist_ack_index = -1;
+    if (index >= 0) {
+        offset = hist_pos_of_index((uint32_t)index);
+        // Only readings that have been sent can be acknowledged
+        if (offset < PACK_CTR)
+            free_data_buffers(offset + 1);
+    }
+    if (m_hist_ack_all_sent) {
+        m_hist_ack_all_sent = false;
+        free_data_buffers(PACK_CTR);
+    }
+}
+
+uint8_t nus_tx_credits(void)
+{
+    return NUS_HVN_TX_QUEUE_SIZE - m_tx_in_flight;
+}
+
+/* Hands one packet to the SoftDevice, carrying records buffered records.
+ * Non critical faults are silently ignored, as before
+ */
+uint32_t nus_tx_send(uint8_t * p_data, uint16_t len, uint8_t records)
+{
+    uint32_t err_code = ble_nus_data_send(&m_nus, p_data, &len, m_conn_handle);
+
+    if (err_code == NRF_SUCCESS) {
+        CRITICAL_REGION_ENTER();
+        m_tx_records[(m_tx_head + m_tx_in_flight) % NUS_HVN_TX_QUEUE_SIZE] = records;
+        m_tx_in_flight++;
+        CRITICAL_REGION_EXIT();
+    }
+    else if ((err_code != NRF_ERROR_RESOURCES) &&
+             (err_code != NRF_ERROR_INVALID_STATE) &&
+             (err_code != NRF_ERROR_NOT_FOUND) &&
+             (err_code != BLE_ERROR_GATTS_SYS_ATTR_MISSING))
+    {   
+        APP_ERROR_CHECK(err_code);              
+    }
+    return err_code;
+}
+
+/* Sends queued packets, then buffered records, until the queue is empty, 
+ * the upload is done or no credits are left
+ */
+void nus_tx_flush(void)
+{
+    nus_tx_item_t item;
+    uint32_t      err_code;
+    bool          busy;
+
+    CRITICAL_REGION_ENTER();
+    busy = m_nus_tx_busy;
+    m_nus_tx_busy  = true;
+    m_nus_tx_retry = busy;
+    CRITICAL_REGION_EXIT();
+    // The interrupted flush sees m_nus_tx_retry and runs once more
+    if (busy)
+        return;
+
+    do {
+        m_nus_tx_retry = false;
+        hist_apply_acks();
+        while (nus_tx_credits() > 0 && 
+               nrf_queue_peek(&m_nus_tx_queue, &item) == NRF_SUCCESS) {
+            err_code = nus_tx_send(item.data, item.len, 0);
+            if (err_code == NRF_ERROR_RESOURCES)
+                break;
+            (void)nrf_queue_pop(&m_nus_tx_queue, &item);
+        }
+        // Range requests go ahead of the backlog upload
+        while (nus_tx_credits() > 0 && nrf_queue_is_empty(&m_nus_tx_queue)) {
+            if (hist_range_pending()) {
+                if (!send_range_data())
+                    break;
+            }
+            else if (m_arch_next < m_arch_end) {
+                if (!send_archive_data())
+                    break;
+            }
+            else if (m_blk_pass < 3) {
+                if (!send_block_data())
+                    break;
+            }
+            else if (SEND_BUFFERED_DATA && PACK_CTR < TOTAL_DATA_IN_BUFFERS &&
+                     (!m_hist_ack_mode || PACK_CTR < HIST_ACK_WINDOW)) {
+                if (!send_buffered_data())
+                    break;
+            }
+            else
+                break;
+        }
+        CRITICAL_REGION_ENTER();
+        busy = m_nus_tx_retry;
+        m_nus_tx_busy = busy;
+        CRITICAL_REGION_EXIT();
+    } while (busy);
+    // A range, ARCH or GETBLK transfer may have started or ended
+    conn_profile_update();
+}
+
+/* Queues one notification and sends it right away if the SoftDevice has a
+ * free buffer. Returns NRF_ERROR_NO_MEM and drops the packet if the queue
+ * is full
+ */
+uint32_t nus_tx_enqueue(uint8_t const * p_data, uint16_t len)
+{
+    nus_tx_item_t item;
+    uint32_t      err_code;
+
+    if (m_conn_handle == BLE_CONN_HANDLE_INVALID)
+        return NRF_ERROR_INVALID_STATE;
+    item.len = MIN(len, NUS_TX_ITEM_MAX_LEN);
+    memcpy(item.data, p_data, item.len);
+    err_code = nrf_queue_push(&m_nus_tx_queue, &item);
+    if (err_code != NRF_SUCCESS) {
+        NRF_LOG_WARNING("NUS TX queue full, packet dropped");
+        return err_code;
     }
-    TOTAL_DATA_IN_BUFFERS = 0;
-    PACK_CTR = 0;
- }
+    nus_tx_flush();
+    return NRF_SUCCESS;
+}
 
-/* Function to store data in buffer in case of advertising timeout
- *
- * On the next connection after timeouts causing data to be buffered,
- * first add the most recent data to the buffer then call send_buffered_data()
+/* Returns the credits of the count packets reported by
+ * BLE_GATTS_EVT_HVN_TX_COMPLETE and refills them
  */
-void add_data_to_buffers(void)
+void nus_tx_complete(uint8_t count)
 {
-    // Values stored in ph_cal[i] may be zero while other values are
-    // non-zero. Iterate through ph_mv to find first "empty" buffer index
-    // and store data at the same index for other buffers
-    int i = 0;
-    while(ph_mv[i] != 0) { i++; }
-    ph_mv[i]   = (uint16_t) AVG_PH_VAL;
-    temp_mv[i] = (uint16_t) AVG_TEMP_VAL;
-    batt_mv[i] = (uint16_t) AVG_BATT_VAL;
-    if(CAL_PERFORMED) {
-        //float ph_cal_val = calculate_pH_from_mV(sensor_temp_comp(AVG_PH_VAL, AVG_TEMP_VAL));
-        float ph_cal_val = calculate_pH_from_mV(AVG_PH_VAL);
-        ph_cal[i] = validate_float_range(ph_cal_val);
+    CRITICAL_REGION_ENTER();
+    while (count > 0 && m_tx_in_flight > 0) {
+        m_upload_records_sent += m_tx_records[m_tx_head];
+        m_tx_head = (m_tx_head + 1) % NUS_HVN_TX_QUEUE_SIZE;
+        m_tx_in_flight--;
+        count--;
     }
-    TOTAL_DATA_IN_BUFFERS++;
-    NRF_LOG_INFO("* * * Total data in BUFFERS: %d \n", TOTAL_DATA_IN_BUFFERS);
+    CRITICAL_REGION_EXIT();
+    nus_tx_flush();
+}
+
+/* Drops queued packets and credits in use, on disconnect. Buffered readings
+ * that were not acknowledged are sent again on the next connection
+ */
+void nus_tx_reset(void)
+{
+    nrf_queue_reset(&m_nus_tx_queue);
+    CRITICAL_REGION_ENTER();
+    m_tx_head      = 0;
+    m_tx_in_flight = 0;
+    CRITICAL_REGION_EXIT();
+    m_hist_ack_mode     = false;
+    m_hist_ack_index    = -1;
+    m_hist_ack_all_sent = false;
+    m_range_next_seq    = 0;
+    m_range_end_seq     = 0;
+    m_arch_next         = 0;
+    m_arch_end          = 0;
+    m_blk_pass          = 3;
+    PACK_CTR = 0;
 }
 
 void create_and_send_buffer_primer_packet(void)
 {
-    uint32_t err_code;
     uint32_t ASCII_DIG_BASE = 48;
     uint16_t primer_len = 10;
     // Format and send primer packet first
@@ -410,44 +1987,393 @@ void create_and_send_buffer_primer_packet(void)
         }
     }
     // Send primer packet
-    do{
-         err_code = ble_nus_data_send(&m_nus, primer, &primer_len, m_conn_handle);
-         NRF_LOG_INFO("error code: %u", err_code);
-         if ((err_code != NRF_ERROR_INVALID_STATE) &&
-             (err_code != NRF_ERROR_RESOURCES) &&
-             (err_code != NRF_ERROR_NOT_FOUND) &&
-             (err_code != BLE_ERROR_GATTS_SYS_ATTR_MISSING))
-         {   
-             APP_ERROR_CHECK(err_code);              
-         }
-         nrf_delay_us(100);
-    } while (err_code == NRF_ERROR_RESOURCES);
+    (void)nus_tx_enqueue(primer, primer_len);
 }
 
-void send_buffered_data(void)
+// Batch upload and GETBLK packets only, sent from nus_tx_flush(). Live 
+// readings are built in a buffer on the stack of the sender
+static uint8_t m_batch_packet[BLE_NUS_MAX_DATA_LEN];    // largest ATT payload at the maximum MTU
+
+// Size of one record in the format selected for this connection
+uint16_t record_size(void)
 {
-    uint32_t err_code;
+    return BINARY_FORMAT ? BIN_RECORD_LEN : total_size_w_index;
+}
+
+// Writes the binary header (if any) to p_packet, returns its length
+uint16_t start_record_packet(uint8_t* p_packet)
+{
+    if (!BINARY_FORMAT)
+        return 0;
+    p_packet[0] = BIN_FORMAT_VERSION;
+    p_packet[1] = BIN_FIELD_INDEX | BIN_FIELD_RAW_PH | BIN_FIELD_BATT | BIN_FIELD_TEMP |
+                  BIN_FIELD_STALE | BIN_FIELD_EARLY;
+    if (CAL_PERFORMED)
+        p_packet[1] |= BIN_FIELD_CAL_PH;
+    p_packet[2] = 0;
+    return BIN_HEADER_LEN;
+}
+
+/* Appends one reading at p_packet[len] in the selected format and returns
+ * the new packet length. The ASCII record is built on the stack from the
+ * total_packet template, so BLE event and scheduler code can both call this
+ */
+uint16_t add_record_to_packet(uint32_t index,
+                              uint32_t ph_val,   uint32_t batt_val,
+                              uint32_t temp_val, float ph_val_cal, uint8_t flags,
+                              uint8_t* p_packet, uint16_t len)
+{
+    if (BINARY_FORMAT) {
+        create_binary_record(index, ph_val, batt_val, temp_val,
+                             ph_val_cal, flags, &p_packet[len]);
+        p_packet[2]++;
+        return len + BIN_RECORD_LEN;
+    }
+    uint8_t core[sizeof(total_packet)];
+    uint8_t line[sizeof(total_packet_with_index)];
 
-    create_bluetooth_packet((uint32_t)ph_mv[PACK_CTR], 
-                            (uint32_t)batt_mv[PACK_CTR], 
-                            (uint32_t)temp_mv[PACK_CTR], 
-                             ph_cal[PACK_CTR], total_packet);
+    memcpy(core, total_packet, sizeof(core));
+    memcpy(line, total_packet_with_index, sizeof(line));
+    create_bluetooth_packet(ph_val, batt_val, temp_val, ph_val_cal, core);
     // Prefix appropriate array index
-    add_index_to_total_packet(total_packet, total_packet_with_index);
-    
+    add_index_to_total_packet(index, core, line);
+    memcpy(&p_packet[len], line, total_size_w_index);
+    return len + total_size_w_index;
+}
+
+/* Packs as many buffered readings as fit in the negotiated ATT payload
+ * (m_ble_nus_max_data_len, up to MTU - 3 bytes) into one notification,
+ * from buffer position *p_pos up to end. ASCII records keep their EOL, so the
+ * central still splits them by line. At least one record is sent per call, as
+ * before the MTU exchange. Returns false, leaving *p_pos unchanged, if the
+ * SoftDevice had no buffer for it
+ */
+bool send_buffered_range(uint32_t * p_pos, uint32_t end)
+{
+    uint32_t pos = *p_pos;
+    uint16_t batch_len = start_record_packet(m_batch_packet);
+
     do {
-        err_code = ble_nus_data_send(&m_nus, total_packet_with_index, 
-                                     &total_size_w_index, m_conn_handle);
-        // Silently fail, intentionally, as these are not critical faults
-        if ((err_code != NRF_ERROR_INVALID_STATE) &&
-            (err_code != NRF_ERROR_RESOURCES) &&
-            (err_code != NRF_ERROR_NOT_FOUND) &&
-            (err_code != BLE_ERROR_GATTS_SYS_ATTR_MISSING))
-        {   
-            APP_ERROR_CHECK(err_code);              
+        hist_reading_t reading;
+        float          ph_cal = 0;
+
+        hist_read(hist_slot(pos), &reading);
+        if (CAL_PERFORMED) {
+            //ph_cal = calculate_pH_from_mV(sensor_temp_comp(reading.ph_mv, reading.temp_mv));
+            ph_cal = validate_float_range(calculate_pH_from_mV(reading.ph_mv));
+        }
+        batch_len = add_record_to_packet(HIST_FIRST_SEQ + pos,
+                                         (uint32_t)reading.ph_mv, 
+                                         (uint32_t)reading.batt_mv, 
+                                         (uint32_t)reading.temp_mv, 
+                                         ph_cal, reading.flags, 
+                                         m_batch_packet, batch_len);
+        pos++;
+    } while (pos < end &&
+             batch_len + record_size() <= m_ble_nus_max_data_len &&
+             batch_len + record_size() <= sizeof(m_batch_packet));
+    
+    if (nus_tx_send(m_batch_packet, batch_len, pos - *p_pos) == NRF_ERROR_RESOURCES)
+        return false;
+    *p_pos = pos;
+    return true;
+}
+
+// Sends the next batch of the backlog upload, starting at PACK_CTR
+bool send_buffered_data(void)
+{
+    if (!send_buffered_range(&PACK_CTR, TOTAL_DATA_IN_BUFFERS))
+        return false;
+    NRF_LOG_INFO("%d PACKETS SENT", PACK_CTR);
+    return true;
+}
+
+bool hist_range_pending(void)
+{
+    return m_range_next_seq < m_range_end_seq;
+}
+
+/* Sends the next batch of a GET/GETT range. Readings acknowledged in the
+ * meantime are skipped
+ */
+bool send_range_data(void)
+{
+    uint32_t pos, end;
+
+    if (m_range_next_seq < HIST_FIRST_SEQ)
+        m_range_next_seq = HIST_FIRST_SEQ;
+    pos = m_range_next_seq - HIST_FIRST_SEQ;
+    end = MIN(m_range_end_seq - HIST_FIRST_SEQ, TOTAL_DATA_IN_BUFFERS);
+    if (pos >= end) {
+        m_range_next_seq = m_range_end_seq;
+        return true;
+    }
+    if (!send_buffered_range(&pos, end))
+        return false;
+    m_range_next_seq = HIST_FIRST_SEQ + pos;
+    return true;
+}
+
+// Sends the next entry of an ARCH transfer
+bool send_archive_data(void)
+{
+    hist_aggregate_t *p_entry = &hist_archive[m_arch_next];
+    char              line[72];
+    int               len;
+
+    len = sprintf(line, "A,%u,%u,%u,%u,%u,%u,%u,%u\n",
+                  p_entry->t_first, p_entry->t_last, p_entry->count,
+                  p_entry->ph_avg, p_entry->ph_min, p_entry->ph_max,
+                  p_entry->temp_avg, p_entry->batt_avg);
+    if (nus_tx_send((uint8_t *)line, (uint16_t)len, 0) == NRF_ERROR_RESOURCES)
+        return false;
+    m_arch_next++;
+    return true;
+}
+
+/* Sends the next sealed block of a GETBLK transfer as stored, without the
+ * last word. Blocks that only hold freed readings are skipped
+ */
+bool send_block_data(void)
+{
+    uint8_t  page = (m_blk_pass == 0) ? m_log_page ^ 1 : m_log_page;
+    uint32_t base = hist_log_page_addr(page);
+    uint32_t tag, seq, count, payload_len, len;
+
+    while (m_blk_pass < 2) {
+        if (m_blk_offset == 0) {
+            if (hist_log_word(base) != HIST_LOG_MAGIC)
+                len = 0;
+            else {
+                m_blk_offset = HIST_LOG_HDR_LEN;
+                continue;
+            }
+        }
+        else if (m_blk_offset + HIST_LOG_ACK_LEN > HIST_LOG_PAGE_SIZE)
+            len = 0;
+        else {
+            len = hist_log_entry(base + m_blk_offset, HIST_LOG_PAGE_SIZE - m_blk_offset, 
+                                 &tag, &seq, &count, &payload_len);
+            if (len == 0) {
+                // Erased, or left by a write that was given up
+                m_blk_offset += 4;
+                continue;
+            }
         }
-    } while (err_code == NRF_ERROR_RESOURCES);
-    NRF_LOG_INFO("%d PACKETS SENT", PACK_CTR+1);
+        if (len == 0) {
+            // End of this page
+            m_blk_pass++;
+            m_blk_offset = 0;
+            return true;
+        }
+        if (tag == HIST_LOG_TAG_DATA && count > 0 && seq + count > HIST_LOG_SEQ &&
+            hist_log_word(base + m_blk_offset + len - 4) == (seq ^ HIST_LOG_MAGIC)) {
+            (void)nrf_fstorage_read(&m_log_fs, base + m_blk_offset, m_batch_packet, len - 4);
+            if (nus_tx_send(m_batch_packet, len - 4, 0) == NRF_ERROR_RESOURCES)
+                return false;
+            m_blk_offset += len;
+            return true;
+        }
+        m_blk_offset += len;
+    }
+    if (nus_tx_send((uint8_t *)"BLKEND\n", 7, 0) == NRF_ERROR_RESOURCES)
+        return false;
+    m_blk_pass = 3;
+    return true;
+}
+
+/* Starts sending the buffered records after the primer packet, see 
+ * nus_tx_flush()
+ */
+void start_buffered_data_upload(void)
+{
+    m_upload_records_sent = 0;
+    m_upload_start_ticks  = app_timer_cnt_get();
+    create_and_send_buffer_primer_packet();
+    SEND_BUFFERED_DATA = true;
+    conn_profile_update();
+    nus_tx_flush();
+    // Nothing is in flight if the central has not enabled notifications
+    check_buffered_data_upload_done();
+}
+
+/* Replies with the negotiated link parameters:
+ * "LINK,<tx phy>,<rx phy>,<data length>,<ATT MTU>,<interval 1.25 ms>,<latency>\n"
+ */
+void check_for_link_stats(char **packet)
+{
+    char *LINKSTATS = "LINKSTATS";
+    char  reply[64];
+    if (strstr(*packet, LINKSTATS) != NULL) {
+        int len = sprintf(reply, "LINK,%u,%u,%u,%u,%u,%u,%u,%u\n", 
+                          m_link_stats.tx_phy, m_link_stats.rx_phy, 
+                          m_link_stats.data_length, m_link_stats.att_mtu,
+                          m_link_stats.conn_interval, m_link_stats.slave_latency,
+                          m_link_stats.upload_records, m_link_stats.upload_ms);
+        (void)nus_tx_enqueue((uint8_t *)reply, (uint16_t)len);
+    }
+}
+
+/* Selects the record format for the rest of this connection */
+void check_for_record_format(char **packet)
+{
+    char *BIN   = "BIN";
+    char *ASCII = "ASCII";
+    if (strstr(*packet, BIN) != NULL) {
+        BINARY_FORMAT = true;
+        NRF_LOG_INFO("Binary record format v%d selected", BIN_FORMAT_VERSION);
+    }
+    else if (strstr(*packet, ASCII) != NULL) {
+        BINARY_FORMAT = false;
+        NRF_LOG_INFO("ASCII record format selected");
+    }
+}
+
+/* Starts sending buffered readings first to last (buffer positions) after a
+ * "RANGE,<first index>,<count>,<first time>,<last time>\n" reply
+ */
+void start_range_reply(uint32_t first, uint32_t last)
+{
+    char     reply[48];
+    int      len;
+    uint32_t count = (first <= last && last < TOTAL_DATA_IN_BUFFERS) ? last - first + 1 : 0;
+
+    if (count == 0)
+        len = sprintf(reply, "RANGE,0,0,0,0\n");
+    else
+        len = sprintf(reply, "RANGE,%u,%u,%u,%u\n", 
+                      (HIST_FIRST_SEQ + first) % hist_index_modulus(), count,
+                      hist_time_of(first), hist_time_of(last));
+    (void)nus_tx_enqueue((uint8_t *)reply, (uint16_t)len);
+    if (count > 0) {
+        m_range_next_seq = HIST_FIRST_SEQ + first;
+        m_range_end_seq  = HIST_FIRST_SEQ + last + 1;
+        nus_tx_flush();
+    }
+}
+
+/* Reads from the history store without touching the backlog upload:
+ *   "GET_i_j"     readings with packet indexes i to j
+ *   "GETT_t0_t1"  readings buffered between uptime seconds t0 and t1
+ *   "NOW"         replies "NOW,<uptime>,<first index>,<count>\n"
+ */
+void check_for_range_request(char **packet)
+{
+    char *GET  = "GET_";
+    char *GETT = "GETT_";
+    char *NOW  = "NOW";
+    char *p_arg;
+
+    if ((p_arg = strstr(*packet, GET)) != NULL) {
+        char    *p_end;
+        uint32_t first = hist_pos_of_index(strtoul(p_arg + 4, &p_end, 10));
+        uint32_t last  = first;
+        if (*p_end == '_')
+            last = hist_pos_of_index(strtoul(p_end + 1, NULL, 10));
+        // An end index past the newest reading wraps below first
+        if (last < first || last >= TOTAL_DATA_IN_BUFFERS)
+            last = TOTAL_DATA_IN_BUFFERS - 1;
+        start_range_reply(first, last);
+    }
+    else if ((p_arg = strstr(*packet, GETT)) != NULL) {
+        char    *p_end;
+        uint32_t t0 = strtoul(p_arg + 5, &p_end, 10);
+        uint32_t t1 = (*p_end == '_') ? strtoul(p_end + 1, NULL, 10) : UINT32_MAX;
+        uint32_t t  = HIST_LAST_TIME;
+        uint32_t first = 1, last = 0;
+        // Walk back from the newest reading, times only decrease
+        for (int32_t i = (int32_t)TOTAL_DATA_IN_BUFFERS - 1; i >= 0; i--) {
+            if (t >= t0 && t <= t1) {
+                if (last < first)
+                    last = i;
+                first = i;
+            }
+            if (t < t0)
+                break;
+            uint32_t dt = hist_dt(hist_slot(i));
+            t = (t > dt) ? t - dt : 0;
+        }
+        start_range_reply(first, last);
+    }
+    else if (strstr(*packet, NOW) != NULL) {
+        char reply[40];
+        int  len = sprintf(reply, "NOW,%u,%u,%u\n", uptime_seconds(),
+                           HIST_FIRST_SEQ % hist_index_modulus(), TOTAL_DATA_IN_BUFFERS);
+        (void)nus_tx_enqueue((uint8_t *)reply, (uint16_t)len);
+    }
+}
+
+/* "ARCH" sends the history archive, "ARCH_CLR" frees the entries sent */
+void check_for_archive_request(char **packet)
+{
+    char *ARCH     = "ARCH";
+    char *ARCH_CLR = "ARCH_CLR";
+    char  reply[16];
+    int   len;
+
+    if (strstr(*packet, ARCH_CLR) != NULL) {
+        if (m_arch_end > 0 && m_arch_next == m_arch_end) {
+            memmove(&hist_archive[0], &hist_archive[m_arch_end], 
+                    (HIST_ARCHIVE_CNT - m_arch_end) * sizeof(hist_archive[0]));
+            HIST_ARCHIVE_CNT -= m_arch_end;
+            NRF_LOG_INFO("%d archive entries freed", m_arch_end);
+            m_arch_snap_due = true;
+            m_arch_gen++;
+        }
+        m_arch_next = 0;
+        m_arch_end  = 0;
+    }
+    else if (strstr(*packet, ARCH) != NULL) {
+        len = sprintf(reply, "ARCH,%u\n", HIST_ARCHIVE_CNT);
+        (void)nus_tx_enqueue((uint8_t *)reply, (uint16_t)len);
+        m_arch_next = 0;
+        m_arch_end  = HIST_ARCHIVE_CNT;
+        nus_tx_flush();
+    }
+}
+
+/* "GETBLK" sends the sealed blocks of the history log as stored, oldest
+ * first, after a "BLK,<first seq>,<first index>,<end seq>\n" reply and
+ * before "BLKEND\n". Sequences are log sequences: the oldest reading
+ * buffered has <first seq> and packet index <first index>, readings from
+ * <end seq> on are not in a block yet and can be read with GET_i_j.
+ * Readings below <first seq> were freed and are to be ignored. Blocks
+ * need an ATT payload of HIST_LOG_ENTRY_LEN(HIST_LOG_MAX_PAYLOAD) - 4
+ * bytes, with less "BLK,0,0,0\n" is the only reply. Decoding is
+ * described with the History log
+ */
+void check_for_block_request(char **packet)
+{
+    char *GETBLK = "GETBLK";
+    char  reply[40];
+    int   len;
+
+    if (strstr(*packet, GETBLK) == NULL)
+        return;
+    if (m_ble_nus_max_data_len < HIST_LOG_ENTRY_LEN(HIST_LOG_MAX_PAYLOAD) - 4) {
+        len = sprintf(reply, "BLK,0,0,0\n");
+        (void)nus_tx_enqueue((uint8_t *)reply, (uint16_t)len);
+        return;
+    }
+    len = sprintf(reply, "BLK,%u,%u,%u\n", HIST_LOG_SEQ, 
+                  HIST_FIRST_SEQ % hist_index_modulus(), MAX(m_log_written, HIST_LOG_SEQ));
+    (void)nus_tx_enqueue((uint8_t *)reply, (uint16_t)len);
+    m_blk_pass   = 0;
+    m_blk_offset = 0;
+    nus_tx_flush();
+}
+
+/* "ACK_nnn" acknowledges every buffered reading up to index nnn */
+void check_for_buffer_ack(char **packet)
+{
+    char *ACK = "ACK_";
+    char *p_ack = strstr(*packet, ACK);
+    if (p_ack != NULL) {
+        m_hist_ack_mode  = true;
+        m_hist_ack_index = atoi(p_ack + 4);
+        nus_tx_flush();
+        check_buffered_data_upload_done();
+    }
 }
 
 void check_for_buffer_done_signal(char **packet)
@@ -456,6 +2382,9 @@ void check_for_buffer_done_signal(char **packet)
     char *DONE  = "DONE";
     if (strstr(*packet, DONE) != NULL){
         NRF_LOG_INFO("Received DONE signal");
+        // Everything sent so far was received
+        m_hist_ack_all_sent = true;
+        nus_tx_flush();
         // Disconnect
         uint32_t err_code;
         err_code = sd_ble_gap_disconnect(m_conn_handle, 
@@ -693,21 +2622,27 @@ void substring(char s[], char sub[], int p, int l) {
    sub[c] = '\0';
 }
 
-void read_saadc_and_store_avg_in_cal_pt(int samples)
+void read_saadc_and_store_avg_in_cal_pt(saadc_acq_profile_t const * p_profile)
 {
     uint32_t AVG_MV_VAL = 0;
     nrf_saadc_value_t temp_val = 0;
     ret_code_t err_code;
-    // Average readings
-    for (int i = 0; i < samples; i++) {
+    saadc_filter_t filter;
+    uint16_t samples = 0;
+    uint32_t start_ticks = app_timer_cnt_get();
+    // Average readings, stopping early once the reading is stable
+    saadc_filter_reset(&filter, m_saadc_channel_filter[SAADC_SCAN_PH_CH]);
+    while (samples < p_profile->max_samples) {
       err_code = nrfx_saadc_sample_convert(0, &temp_val);
       APP_ERROR_CHECK(err_code);
-      if (temp_val < 0)
-          AVG_MV_VAL += 0;
-      else
-          AVG_MV_VAL += saadc_result_to_mv(temp_val);
+      saadc_filter_add(&filter, temp_val);
+      samples++;
+      if (samples >= p_profile->min_samples && (samples % SAADC_FILTER_BLOCK) == 0 &&
+          saadc_filter_converged(&filter, p_profile->target_se_uv))
+          break;
     }
-    AVG_MV_VAL = AVG_MV_VAL / samples;
+    AVG_MV_VAL = saadc_filter_result(&filter);
+    log_saadc_profile_duration(CALIBRATION_SAADC_PROFILE, samples, start_ticks);
     // Assign averaged readings to the correct calibration point
     if(!PT1_READ){
       PT1_MV_VAL = (float)AVG_MV_VAL;
@@ -720,21 +2655,27 @@ void read_saadc_and_store_avg_in_cal_pt(int samples)
     }  
 }
 
-void read_saadc_and_set_ref_temp(int samples)
+void read_saadc_and_set_ref_temp(saadc_acq_profile_t const * p_profile)
 {
     uint32_t AVG_MV_VAL = 0;
     nrf_saadc_value_t temp_val = 0;
     ret_code_t err_code;
-    // Average readings
-    for (int i = 0; i < samples; i++) {
+    saadc_filter_t filter;
+    uint16_t samples = 0;
+    uint32_t start_ticks = app_timer_cnt_get();
+    // Average readings, stopping early once the reading is stable
+    saadc_filter_reset(&filter, m_saadc_channel_filter[SAADC_SCAN_TEMP_CH]);
+    while (samples < p_profile->max_samples) {
       err_code = nrfx_saadc_sample_convert(0, &temp_val);
       APP_ERROR_CHECK(err_code);
-      if (temp_val < 0)
-          AVG_MV_VAL += 0;
-      else
-          AVG_MV_VAL += saadc_result_to_mv(temp_val);
+      saadc_filter_add(&filter, temp_val);
+      samples++;
+      if (samples >= p_profile->min_samples && (samples % SAADC_FILTER_BLOCK) == 0 &&
+          saadc_filter_converged(&filter, p_profile->target_se_uv))
+          break;
     }
-    AVG_MV_VAL = AVG_MV_VAL / samples;
+    AVG_MV_VAL = saadc_filter_result(&filter);
+    log_saadc_profile_duration(CALIBRATION_SAADC_PROFILE, samples, start_ticks);
     if (!PT1_READ) {
         CURR_TEMP = calculate_celsius_from_mv(AVG_MV_VAL);
         CURR_TEMP = validate_float_range(CURR_TEMP); 
@@ -763,16 +2704,18 @@ void read_saadc_and_set_ref_temp(int samples)
  */
 void read_saadc_for_calibration(void) 
 {
-    int NUM_SAMPLES = 500;
+    saadc_acq_profile_t const * p_profile = &m_saadc_profiles[CALIBRATION_SAADC_PROFILE];
     PH_IS_READ      = false;
     BATTERY_IS_READ = false;
     
+    // A regular measurement cycle must not touch the SAADC meanwhile
+    meas_abort();
     // Reset SAADC state before taking first calibration point
     if (!PT1_READ) {disable_pH_voltage_reading();}
     enable_isfet_circuit();
-    nrf_delay_ms(400);
     enable_pH_voltage_reading();
-    read_saadc_and_store_avg_in_cal_pt(NUM_SAMPLES);   
+    isfet_warmup_blocking(ISFET_CAL_SETTLE_MS);
+    read_saadc_and_store_avg_in_cal_pt(p_profile);   
     // Reset saadc to read temperature value
 //    disable_isfet_circuit();
 //    disable_pH_voltage_reading();
@@ -780,7 +2723,7 @@ void read_saadc_for_calibration(void)
     BATTERY_IS_READ = true; // Work around to read temperature values
 //    enable_pH_voltage_reading();
     restart_saadc();
-    read_saadc_and_set_ref_temp(NUM_SAMPLES);
+    read_saadc_and_set_ref_temp(p_profile);
     disable_pH_voltage_reading();
     nrf_delay_ms(25);
 }
@@ -916,9 +2859,7 @@ void check_for_pwroff(char **packet)
         if(fds_read(CURR_STAYON_FILE_ID, CURR_STAYON_REC_KEY) != STAYON_STORED) {
           fds_write(STAYON_STORED, CURR_STAYON_FILE_ID, CURR_STAYON_REC_KEY);
         }
-        nrfx_gpiote_out_clear(CHIP_POWER_PIN);
-        nrfx_gpiote_out_uninit(CHIP_POWER_PIN);
-        nrfx_gpiote_uninit();
+        chip_power_off();
     }
 }
 
@@ -970,10 +2911,33 @@ void check_for_client_protocol(char **packet)
         ret_code_t err_code = app_timer_start(m_timer_disconn_delay, 
                                          APP_TIMER_TICKS(DISCONN_DELAY_MS), NULL);
         APP_ERROR_CHECK(err_code);
+        conn_profile_update();
         NRF_LOG_INFO("Client protocol started\n");
     }
 }
 
+/* Turns broadcasting of the latest reading in the advertising data on 
+ * ("BCAST_ON") or off ("BCAST_OFF"), stored in flash like STAYON
+ */
+void check_for_broadcast(char **packet)
+{
+    char *BCAST_ON  = "BCAST_ON";
+    char *BCAST_OFF = "BCAST_OFF";
+    if (strstr(*packet, BCAST_ON) != NULL)
+        BROADCAST_FLAG = true;
+    else if (strstr(*packet, BCAST_OFF) != NULL)
+        BROADCAST_FLAG = false;
+    else
+        return;
+    NRF_LOG_INFO("Broadcast %s\n", BROADCAST_FLAG ? "on" : "off");
+    BROADCAST_STORED = BROADCAST_FLAG ? 1.0 : 0.0;
+    fds_update(BROADCAST_STORED, BROADCAST_FILE_ID, BROADCAST_REC_KEY);
+    if(!(float_comp(fds_read(BROADCAST_FILE_ID, BROADCAST_REC_KEY), BROADCAST_STORED))) {
+      fds_write(BROADCAST_STORED, BROADCAST_FILE_ID, BROADCAST_REC_KEY);
+    }
+    advertising_update_reading();
+}
+
 /* Switches from client protocol to demo protocol.
  * If STAYON flag is set, the flag is turned off
  */
@@ -1003,11 +2967,46 @@ void check_for_demo_protocol(char **packet)
         ret_code_t err_code;
         err_code = app_timer_start(m_timer_id, APP_TIMER_TICKS(DEMO_DATA_INTERVAL), NULL);
         APP_ERROR_CHECK(err_code); 
+        conn_profile_update();
         NRF_LOG_INFO("Demo protocol started");
     }
 }
 
 
+/* Reads a calibration point and sends its confirmation, and the results
+ * after the last point. Runs from the main loop, after the abort posted by
+ * STARTCAL, so the SAADC is not shared with a measurement cycle
+ */
+void cal_point_evt_handler(void * p_event_data, uint16_t event_size)
+{
+    int cal_pt = *(int const *)p_event_data;
+    char CALRESULTS[80];
+    char PT_CONFS[3][24];
+    // Variables to hold sizes of strings for ble_nus_send function
+    uint16_t SIZE_CONF    = 24;
+    uint16_t SIZE_RESULTS;
+
+    uint32_t err_code;
+
+    // Read calibration data and send confirmation packet
+    read_saadc_for_calibration();
+    pack_cal_values_into_confirm_packet(PT_CONFS, cal_pt);
+    (void)nus_tx_enqueue((uint8_t const *)PT_CONFS[cal_pt - 1], SIZE_CONF);
+    // Restart normal data transmission if calibration is complete
+    if (NUM_CAL_PTS == cal_pt) {
+      perform_calibration(cal_pt);
+      pack_lin_reg_values_into_packet(CALRESULTS, &SIZE_RESULTS);
+      (void)nus_tx_enqueue((uint8_t const *)CALRESULTS, SIZE_RESULTS);
+      write_cal_values_to_flash();
+      reset_calibration_state();
+      conn_profile_update();
+      err_code = app_timer_start(m_timer_disconn_delay, 
+                                 APP_TIMER_TICKS(10000), NULL);
+      APP_ERROR_CHECK(err_code);
+      //disconnect_from_central();
+    }
+}
+
 /*
  * Checks packet contents to appropriately perform calibration
  */
@@ -1018,12 +3017,8 @@ void check_for_calibration(char **packet)
     char *PT        = "PT";
     // Possible strings to send to mobile application
     char CALBEGIN[9] = {"CALBEGIN\n"};   
-    char CALRESULTS[80];
-    char PT_CONFS[3][24];
     // Variables to hold sizes of strings for ble_nus_send function
     uint16_t SIZE_BEGIN   = 9;
-    uint16_t SIZE_CONF    = 24;
-    uint16_t SIZE_RESULTS;
     // Used for parsing out pH value from PT1_X.Y (etc) packets
     char pH_val_substring[4];
 
@@ -1033,18 +3028,12 @@ void check_for_calibration(char **packet)
         char cal_pts_str[1];
         CAL_MODE = true;
         stop_disconn_delay_timer();
-        disable_pH_voltage_reading();
+        meas_stop();
         // Parse integer from STARTCALX packet, where X is 1, 2 or 3
         substring(*packet, cal_pts_str, 9, 1);
         NUM_CAL_PTS = atoi(cal_pts_str);
-        err_code = ble_nus_data_send(&m_nus, CALBEGIN, &SIZE_BEGIN, m_conn_handle);
-        if ((err_code != NRF_ERROR_INVALID_STATE) &&
-            (err_code != NRF_ERROR_RESOURCES) &&
-            (err_code != NRF_ERROR_NOT_FOUND) &&
-            (err_code != BLE_ERROR_GATTS_SYS_ATTR_MISSING))
-         {   
-            APP_ERROR_CHECK(err_code);              
-         }
+        conn_profile_update();
+        (void)nus_tx_enqueue((uint8_t const *)CALBEGIN, SIZE_BEGIN);
     }
 
     if (strstr(*packet, PT) != NULL) {
@@ -1063,37 +3052,10 @@ void check_for_calibration(char **packet)
             PT2_PH_VAL = atof(pH_val_substring); 
         else if (cal_pt == 3)
             PT3_PH_VAL = atof(pH_val_substring); 
-        // Read calibration data and send confirmation packet
-        read_saadc_for_calibration();
-        pack_cal_values_into_confirm_packet(PT_CONFS, cal_pt);
-        err_code = ble_nus_data_send(&m_nus, PT_CONFS[cal_pt - 1], 
-                                     &SIZE_CONF, m_conn_handle);
-        if ((err_code != NRF_ERROR_INVALID_STATE) &&
-            (err_code != NRF_ERROR_RESOURCES) &&
-            (err_code != NRF_ERROR_NOT_FOUND) &&
-            (err_code != BLE_ERROR_GATTS_SYS_ATTR_MISSING))
-         {   
-            APP_ERROR_CHECK(err_code);              
-         }
-        // Restart normal data transmission if calibration is complete
-        if (NUM_CAL_PTS == cal_pt) {
-          perform_calibration(cal_pt);
-          pack_lin_reg_values_into_packet(CALRESULTS, &SIZE_RESULTS);
-          err_code = ble_nus_data_send(&m_nus, CALRESULTS, &SIZE_RESULTS, m_conn_handle);
-          if ((err_code != NRF_ERROR_INVALID_STATE) &&
-              (err_code != NRF_ERROR_RESOURCES) &&
-              (err_code != NRF_ERROR_NOT_FOUND) &&
-              (err_code != BLE_ERROR_GATTS_SYS_ATTR_MISSING))
-          {   
-             APP_ERROR_CHECK(err_code);              
-          }
-          write_cal_values_to_flash();
-          reset_calibration_state();
-          err_code = app_timer_start(m_timer_disconn_delay, 
-                                     APP_TIMER_TICKS(10000), NULL);
-          APP_ERROR_CHECK(err_code);
-          //disconnect_from_central();
-        }
+        // The SAADC is read from the main loop, see cal_point_evt_handler()
+        err_code = app_sched_event_put(&cal_pt, sizeof(cal_pt), cal_point_evt_handler);
+        if (err_code != NRF_SUCCESS)
+            NRF_LOG_WARNING("calibration point %d not queued (0x%x)", cal_pt, err_code);
     }
 }
 
@@ -1106,41 +3068,39 @@ void check_for_calibration(char **packet)
  * @param[in] p_evt       Nordic UART Service event.
  */
 /**@snippet [Handling the data received over BLE] */
+#define NUS_RX_CMD_MAX_LEN  24                              /**< Longest command accepted from the central. */
+
 void nus_data_handler(ble_nus_evt_t * p_evt)
 {
 
     if (p_evt->type == BLE_NUS_EVT_RX_DATA)
     {
         NRF_LOG_INFO("RECEIVED DATA FROM NUS DATA HANDLER");
-        // Array to store data received by smartphone will never exceed 9 characters
-        char data[10];
+        // Array to store data received by smartphone, longest command is 
+        // "GETT_t0_t1". Null terminated for the strstr() checks below
+        char data[NUS_RX_CMD_MAX_LEN + 1];
         // Pointer to array
         char *data_ptr = data;
-        uint32_t err_code;
+        uint16_t length = MIN(p_evt->params.rx_data.length, NUS_RX_CMD_MAX_LEN);
 
         NRF_LOG_DEBUG("Received data from BLE NUS.\n");
         NRF_LOG_HEXDUMP_DEBUG(p_evt->params.rx_data.p_data, 
                                             p_evt->params.rx_data.length);
 
-        for (uint32_t i = 0; i < p_evt->params.rx_data.length; i++)
-        {
-            do
-            {
-                // Parse data into array
-                data[i] = p_evt->params.rx_data.p_data[i];
-                if ((err_code != NRF_SUCCESS) && (err_code != NRF_ERROR_BUSY))
-                {
-                    NRF_LOG_ERROR("Failed receiving NUS message. Error 0x%x. ", 
-                                                                    err_code);
-                    APP_ERROR_CHECK(err_code);
-                }
-            } while (err_code == NRF_ERROR_BUSY);
-        }
+        memcpy(data, p_evt->params.rx_data.p_data, length);
+        data[length] = '\0';
         // Check pack for various BLE commands
         check_for_calibration(&data_ptr);
         check_for_pwroff(&data_ptr);
         check_for_stayon(&data_ptr);
+        check_for_broadcast(&data_ptr);
+        check_for_buffer_ack(&data_ptr);
+        check_for_range_request(&data_ptr);
+        check_for_archive_request(&data_ptr);
+        check_for_block_request(&data_ptr);
         check_for_buffer_done_signal(&data_ptr);
+        check_for_record_format(&data_ptr);
+        check_for_link_stats(&data_ptr);
         check_for_client_protocol(&data_ptr);
         check_for_demo_protocol(&data_ptr);
     }
@@ -1188,23 +3148,19 @@ static void services_init(void)
  * @details This function will be called for all events in the Connection 
  *          Parameters Module which are passed to the application.
  *
- * @note All this function does is to disconnect. This could have been done by 
- *       simply setting the disconnect_on_fail config parameter, but instead 
- *       we use the event handler mechanism to demonstrate its use.
+ * @note A failed update only means the central kept its own parameters, the
+ *       link is still usable so it is kept. The refused profile stays in
+ *       m_conn_profile, it is not asked for again until the mode changes.
  *
  * @param[in] p_evt  Event received from the Connection Parameters Module.
  */
 static void on_conn_params_evt(ble_conn_params_evt_t * p_evt)
 {
-    uint32_t err_code;
-
     NRF_LOG_INFO("INSIDE CONN PARAMS EVT\n");
 
     if (p_evt->evt_type == BLE_CONN_PARAMS_EVT_FAILED)
     {
-        err_code = sd_ble_gap_disconnect(m_conn_handle, 
-                                         BLE_HCI_CONN_INTERVAL_UNACCEPTABLE);
-        APP_ERROR_CHECK(err_code);
+        NRF_LOG_INFO("connection profile %d refused, keeping link", m_conn_profile);
     }
 }
 
@@ -1221,6 +3177,70 @@ static void conn_params_error_handler(uint32_t nrf_error)
 
 /**@brief Function for initializing the Connection Parameters module.
  */
+static ble_gap_conn_params_t m_conn_profiles[] =
+{
+    [CONN_PROFILE_BULK] = {MSEC_TO_UNITS(15, UNIT_1_25_MS),  MSEC_TO_UNITS(30, UNIT_1_25_MS),
+                           0, MSEC_TO_UNITS(4000, UNIT_10_MS)},
+    [CONN_PROFILE_LIVE] = {MSEC_TO_UNITS(100, UNIT_1_25_MS), MSEC_TO_UNITS(200, UNIT_1_25_MS),
+                           4, MSEC_TO_UNITS(6000, UNIT_10_MS)},
+    [CONN_PROFILE_IDLE] = {MSEC_TO_UNITS(400, UNIT_1_25_MS), MSEC_TO_UNITS(600, UNIT_1_25_MS),
+                           0, MSEC_TO_UNITS(6000, UNIT_10_MS)},
+};
+
+/* Asks for LE 2M PHY before a buffered data upload. The central may refuse,
+ * the link then simply stays on 1M PHY, see BLE_GAP_EVT_PHY_UPDATE. The data
+ * length is already negotiated by nrf_ble_gatt right after connecting
+ */
+void link_speed_up_request(void)
+{
+    uint32_t err_code;
+    ble_gap_phys_t const phys =
+    {
+        .rx_phys = BLE_GAP_PHY_2MBPS,
+        .tx_phys = BLE_GAP_PHY_2MBPS,
+    };
+
+    err_code = sd_ble_gap_phy_update(m_conn_handle, &phys);
+    NRF_LOG_INFO("2M PHY requested (0x%x)", err_code);
+}
+
+/* Picks the connection parameter profile for the current mode. BULK only
+ * while a transfer runs, buffered readings alone do not need it
+ */
+conn_profile_t conn_profile_for_mode(void)
+{
+    if (SEND_BUFFERED_DATA || hist_range_pending() || m_arch_next < m_arch_end ||
+        m_blk_pass < 3)
+        return CONN_PROFILE_BULK;
+    if (DEMO_PROTO_FLAG && !CAL_MODE)
+        return CONN_PROFILE_LIVE;
+    return CONN_PROFILE_IDLE;
+}
+
+/* Requests the profile for the current mode if it changed. Called right after
+ * connecting, on every mode change and after each nus_tx_flush(), which
+ * starts and ends the transfers. If the central rejects it, the Connection
+ * Parameters Module retries up to MAX_CONN_PARAMS_UPDATE_COUNT times, see
+ * on_conn_params_evt()
+ */
+void conn_profile_update(void)
+{
+    uint32_t       err_code;
+    conn_profile_t profile = conn_profile_for_mode();
+
+    if (m_conn_handle == BLE_CONN_HANDLE_INVALID || profile == m_conn_profile)
+        return;
+    err_code = ble_conn_params_change_conn_params(m_conn_handle, &m_conn_profiles[profile]);
+    if ((err_code != NRF_SUCCESS) &&
+        (err_code != NRF_ERROR_BUSY) &&
+        (err_code != NRF_ERROR_INVALID_STATE))
+    {
+        APP_ERROR_CHECK(err_code);
+    }
+    NRF_LOG_INFO("connection profile %d requested (0x%x)", profile, err_code);
+    m_conn_profile = profile;
+}
+
 static void conn_params_init(void)
 {
     uint32_t               err_code;
@@ -1282,21 +3302,13 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
     {
         case 38:
             NRF_LOG_INFO("CASE 38\n");
-            // Store data in buffer if there is space remaining
-            if (TOTAL_DATA_IN_BUFFERS < DATA_BUFF_SIZE - 1)
-                add_data_to_buffers();
-                /* 
-                 * TO DO: Figure out how to compress data if buffer
-                 *        fills up to 480. Unlikely, but application
-                 *        should be able to handle this.
-                 */
+            // Store data in buffer, the oldest reading is dropped if it is full
+            add_data_to_buffers();
             if(STAYON_FLAG) {
                 init_and_start_app_timer();
             }
             else {
-                nrfx_gpiote_out_clear(CHIP_POWER_PIN);
-                nrfx_gpiote_out_uninit(CHIP_POWER_PIN);
-                nrfx_gpiote_uninit();
+                chip_power_off();
             }    
             break;
 
@@ -1307,6 +3319,18 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
             CONNECTION_MADE = true;
             // Set TX power to highest setting
             sd_ble_gap_tx_power_set(BLE_GAP_TX_POWER_ROLE_ADV, m_conn_handle, 4);
+            m_link_stats.tx_phy        = BLE_GAP_PHY_1MBPS;
+            m_link_stats.rx_phy        = BLE_GAP_PHY_1MBPS;
+            m_link_stats.data_length   = 27;
+            m_link_stats.att_mtu       = BLE_GATT_ATT_MTU_DEFAULT;
+            m_link_stats.conn_interval = 
+                p_ble_evt->evt.gap_evt.params.connected.conn_params.max_conn_interval;
+            m_link_stats.slave_latency = 
+                p_ble_evt->evt.gap_evt.params.connected.conn_params.slave_latency;
+            // Don't wait FIRST_CONN_PARAMS_UPDATE_DELAY, client sessions are shorter
+            conn_profile_update();
+            if (TOTAL_DATA_IN_BUFFERS > 0)
+                link_speed_up_request();
 
             NRF_LOG_INFO("CONNECTION MADE (ble_gap_evt) \n");
 
@@ -1322,25 +3346,24 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
 
             m_conn_handle = BLE_CONN_HANDLE_INVALID;
             CONNECTION_MADE = false;
-            disable_pH_voltage_reading();
+            BINARY_FORMAT = false;
+            nus_tx_reset();
+            m_conn_profile = CONN_PROFILE_NONE;
+            meas_stop();
             
             ret_code_t err_code;
             app_timer_stop(m_timer_id);
             APP_ERROR_CHECK(err_code);
             NRF_LOG_INFO("DISCONNECTED\n");
 
-            if (SEND_BUFFERED_DATA == true) {
-                SEND_BUFFERED_DATA = false;
-                reset_data_buffers();
-            }
+            // Unacknowledged readings stay buffered for the next connection
+            SEND_BUFFERED_DATA = false;
 
             if(STAYON_FLAG) {
                 init_and_start_app_timer();
             }
             else {
-                nrfx_gpiote_out_clear(CHIP_POWER_PIN);
-                nrfx_gpiote_out_uninit(CHIP_POWER_PIN);
-                nrfx_gpiote_uninit();
+                chip_power_off();
             }   
 
             break;
@@ -1358,6 +3381,22 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
             APP_ERROR_CHECK(err_code);
         } break;
 
+        case BLE_GAP_EVT_PHY_UPDATE:
+            // On failure the PHYs reported are the ones still in use
+            m_link_stats.tx_phy = p_ble_evt->evt.gap_evt.params.phy_update.tx_phy;
+            m_link_stats.rx_phy = p_ble_evt->evt.gap_evt.params.phy_update.rx_phy;
+            NRF_LOG_INFO("PHY update status 0x%x, tx %d rx %d", 
+                         p_ble_evt->evt.gap_evt.params.phy_update.status,
+                         m_link_stats.tx_phy, m_link_stats.rx_phy);
+            break;
+
+        case BLE_GAP_EVT_CONN_PARAM_UPDATE:
+            m_link_stats.conn_interval = 
+                p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params.max_conn_interval;
+            m_link_stats.slave_latency = 
+                p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params.slave_latency;
+            break;
+
         case BLE_GATTC_EVT_TIMEOUT:
             NRF_LOG_INFO("TIMEOUT GATTC EVT\n");
             // Disconnect on GATT Client timeout event.
@@ -1369,9 +3408,7 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
                 init_and_start_app_timer();
             }
             else {
-                nrfx_gpiote_out_clear(CHIP_POWER_PIN);
-                nrfx_gpiote_out_uninit(CHIP_POWER_PIN);
-                nrfx_gpiote_uninit();
+                chip_power_off();
             }   
             break;
 
@@ -1388,9 +3425,7 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
                 init_and_start_app_timer();
             }
             else {
-                nrfx_gpiote_out_clear(CHIP_POWER_PIN);
-                nrfx_gpiote_out_uninit(CHIP_POWER_PIN);
-                nrfx_gpiote_uninit();
+                chip_power_off();
             }   
             break;
 
@@ -1401,9 +3436,7 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
                 init_and_start_app_timer();
             }
             else {
-                nrfx_gpiote_out_clear(CHIP_POWER_PIN);
-                nrfx_gpiote_out_uninit(CHIP_POWER_PIN);
-                nrfx_gpiote_uninit();
+                chip_power_off();
             }   
             break;
 
@@ -1421,7 +3454,8 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
             break;
 
         case BLE_GATTS_EVT_HVN_TX_COMPLETE:   
-            HVN_TX_EVT_COMPLETE = true;
+            nus_tx_complete(p_ble_evt->evt.gatts_evt.params.hvn_tx_complete.count);
+            check_buffered_data_upload_done();
             break;
 
         default:
@@ -1448,6 +3482,16 @@ static void ble_stack_init(void)
     err_code = nrf_sdh_ble_default_cfg_set(APP_BLE_CONN_CFG_TAG, &ram_start);
     APP_ERROR_CHECK(err_code);
 
+    // Let the SoftDevice queue several notifications per link, see nus_tx_flush().
+    // The extra buffers come out of SoftDevice RAM, the application RAM starts
+    // at 0x20002600 in the linker settings to leave room for them
+    ble_cfg_t ble_cfg;
+    memset(&ble_cfg, 0, sizeof(ble_cfg));
+    ble_cfg.conn_cfg.conn_cfg_tag = APP_BLE_CONN_CFG_TAG;
+    ble_cfg.conn_cfg.params.gatts_conn_cfg.hvn_tx_queue_size = NUS_HVN_TX_QUEUE_SIZE;
+    err_code = sd_ble_cfg_set(BLE_CONN_CFG_GATTS, &ble_cfg, ram_start);
+    APP_ERROR_CHECK(err_code);
+
     // Enable BLE stack.
     err_code = nrf_sdh_ble_enable(&ram_start);
     APP_ERROR_CHECK(err_code);
@@ -1507,6 +3551,131 @@ static void delete_bonds(void)
 
 /**@brief Function for initializing the Advertising functionality.
  */
+/* Broadcast payload, manufacturer specific data in the advertising packet
+ * after the flags and the NUS UUID (31 bytes in total):
+ *   [0]    sequence number, incremented with every new reading
+ *   [1-5]  little endian, bits  0-11  raw pH mV
+ *                         bits 12-21  temperature in 0.1 C (0.0 - 102.3 C)
+ *                         bits 22-29  battery voltage in 20 mV units
+ *                         bits 30-39  readings buffered (capped at 1023)
+ * ADV_COMPANY_ID is the Bluetooth SIG ID reserved for testing
+ *
+ * Status payload, manufacturer specific data in the scan response after the
+ * device name, so a central can decide whether connecting is worthwhile:
+ *   [0-1]  readings buffered, little endian
+ *   [2-3]  age of the oldest buffered reading in minutes (saturating)
+ *   [4]    bits 0-2  battery bucket, 0 below 2.8 V then 200 mV steps
+ *          bit  3    calibration valid
+ *          bit  4    buffers more than 90% full
+ */
+#define ADV_COMPANY_ID          0xFFFF
+#define ADV_MANUF_PAYLOAD_LEN   6
+#define SCAN_STATUS_PAYLOAD_LEN 5
+#define BATT_BUCKET_MIN_MV      2800
+#define BATT_BUCKET_STEP_MV     200
+
+static uint8_t                  m_adv_manuf_payload[ADV_MANUF_PAYLOAD_LEN];
+static uint8_t                  m_adv_seq = 0;
+static ble_advdata_manuf_data_t m_adv_manuf_data =
+{
+    .company_identifier = ADV_COMPANY_ID,
+    .data               = { .size = ADV_MANUF_PAYLOAD_LEN, .p_data = m_adv_manuf_payload },
+};
+
+static uint8_t                  m_scan_status_payload[SCAN_STATUS_PAYLOAD_LEN];
+static ble_advdata_manuf_data_t m_scan_status_data =
+{
+    .company_identifier = ADV_COMPANY_ID,
+    .data               = { .size = SCAN_STATUS_PAYLOAD_LEN, .p_data = m_scan_status_payload },
+};
+
+// Fills the advertising and scan response data
+static void advertising_data_set(ble_advdata_t * p_advdata, ble_advdata_t * p_srdata)
+{
+    p_advdata->uuids_complete.uuid_cnt = sizeof(m_adv_uuids) / sizeof(m_adv_uuids[0]);
+    p_advdata->uuids_complete.p_uuids  = m_adv_uuids;
+
+    p_advdata->include_appearance = false;
+    p_advdata->flags               = BLE_GAP_ADV_FLAGS_LE_ONLY_LIMITED_DISC_MODE;
+    p_advdata->p_manuf_specific_data = BROADCAST_FLAG ? &m_adv_manuf_data : NULL;
+
+    p_srdata->name_type          = BLE_ADVDATA_FULL_NAME;
+    p_srdata->p_manuf_specific_data = &m_scan_status_data;
+}
+
+// Packs the backlog status into the scan response payload
+static void scan_status_pack(void)
+{
+    uint32_t age_min = 0;
+    uint32_t batt    = calculate_battvoltage_from_mv(AVG_BATT_VAL);
+    uint8_t  flags;
+
+    if (TOTAL_DATA_IN_BUFFERS > 0)
+        age_min = MIN((uptime_seconds() - hist_oldest_time()) / 60, 0xFFFF);
+    flags = (uint8_t)MIN((batt > BATT_BUCKET_MIN_MV) ? 
+                         (batt - BATT_BUCKET_MIN_MV) / BATT_BUCKET_STEP_MV : 0, 7);
+    if (CAL_PERFORMED)
+        flags |= (1 << 3);
+    if (TOTAL_DATA_IN_BUFFERS > (DATA_BUFF_SIZE * 9) / 10)
+        flags |= (1 << 4);
+
+    m_scan_status_payload[0] = (uint8_t)(TOTAL_DATA_IN_BUFFERS);
+    m_scan_status_payload[1] = (uint8_t)(TOTAL_DATA_IN_BUFFERS >> 8);
+    m_scan_status_payload[2] = (uint8_t)(age_min);
+    m_scan_status_payload[3] = (uint8_t)(age_min >> 8);
+    m_scan_status_payload[4] = flags;
+}
+
+static uint32_t advertising_data_push(void)
+{
+    ble_advdata_t advdata;
+    ble_advdata_t srdata;
+
+    memset(&advdata, 0, sizeof(advdata));
+    memset(&srdata, 0, sizeof(srdata));
+    advertising_data_set(&advdata, &srdata);
+    return ble_advertising_advdata_update(&m_advertising, &advdata, &srdata);
+}
+
+/* Refreshes the scan response status, called whenever the buffers change.
+ * Failing is not critical, the next advertising cycle updates it again
+ */
+void advertising_update_status(void)
+{
+    uint32_t err_code;
+
+    scan_status_pack();
+    err_code = advertising_data_push();
+    if (err_code != NRF_SUCCESS)
+        NRF_LOG_WARNING("scan response status not updated (0x%x)", err_code);
+}
+
+/* Puts the latest reading into the advertising data, so passive scanners
+ * get it without connecting. Called before every advertising cycle
+ */
+void advertising_update_reading(void)
+{
+    uint32_t      err_code;
+    uint64_t      packed;
+    int32_t       temp_dc;
+
+    if (BROADCAST_FLAG) {
+        temp_dc = (int32_t)roundf(validate_float_range(calculate_celsius_from_mv(AVG_TEMP_VAL)) * 10);
+        temp_dc = (temp_dc < 0) ? 0 : ((temp_dc > 0x3FF) ? 0x3FF : temp_dc);
+        packed  = (uint64_t)(AVG_PH_VAL & 0xFFF);
+        packed |= (uint64_t)temp_dc << 12;
+        packed |= (uint64_t)MIN(calculate_battvoltage_from_mv(AVG_BATT_VAL) / 20, 0xFF) << 22;
+        packed |= (uint64_t)MIN(TOTAL_DATA_IN_BUFFERS, 0x3FF) << 30;
+        m_adv_manuf_payload[0] = ++m_adv_seq;
+        for (int i = 0; i < ADV_MANUF_PAYLOAD_LEN - 1; i++)
+            m_adv_manuf_payload[i + 1] = (uint8_t)(packed >> (8 * i));
+    }
+    scan_status_pack();
+
+    err_code = advertising_data_push();
+    APP_ERROR_CHECK(err_code);
+}
+
 static void advertising_init(void)
 {
     uint32_t               err_code;
@@ -1514,14 +3683,7 @@ static void advertising_init(void)
 
     memset(&init, 0, sizeof(init));
 
-    
-    init.advdata.uuids_complete.uuid_cnt = sizeof(m_adv_uuids) / sizeof(m_adv_uuids[0]);
-    init.advdata.uuids_complete.p_uuids  = m_adv_uuids;
-
-    init.advdata.include_appearance = false;
-    init.advdata.flags               = BLE_GAP_ADV_FLAGS_LE_ONLY_LIMITED_DISC_MODE;
-
-    init.srdata.name_type          = BLE_ADVDATA_FULL_NAME;
+    advertising_data_set(&init.advdata, &init.srdata);
    
     init.config.ble_adv_fast_enabled  = true;
     init.config.ble_adv_fast_interval = APP_ADV_INTERVAL;
@@ -1593,6 +3755,8 @@ static void advertising_start(bool erase_bonds)
 
 /* This function sets enable pin for ISFET circuitry to HIGH
  */
+static bool m_isfet_task_pin = false;
+
 void enable_isfet_circuit(void)
 {
     ret_code_t err_code;
@@ -1606,6 +3770,23 @@ void enable_isfet_circuit(void)
     nrf_drv_gpiote_out_set(ENABLE_ISFET_PIN);
 }
 
+/* Same as enable_isfet_circuit, but leaves the pin LOW and under GPIOTE task
+ * control so it can be raised through PPI by the SAADC sequencer
+ */
+void enable_isfet_circuit_task_pin(void)
+{
+    ret_code_t err_code;
+    nrf_drv_gpiote_out_config_t config = NRFX_GPIOTE_CONFIG_OUT_TASK_TOGGLE(false);
+    if(nrf_drv_gpiote_is_init() == false) {
+          err_code = nrf_drv_gpiote_init();
+          APP_ERROR_CHECK(err_code);
+    }
+    err_code = nrf_drv_gpiote_out_init(ENABLE_ISFET_PIN, &config);
+    APP_ERROR_CHECK(err_code);
+    nrfx_gpiote_out_task_enable(ENABLE_ISFET_PIN);
+    m_isfet_task_pin = true;
+}
+
 /* This function holds POWER ON line HIGH to keep chip turned on
  */
 void turn_chip_power_on(void)
@@ -1629,7 +3810,14 @@ void turn_chip_power_off(void)
  */
 void disable_isfet_circuit(void)
 {
-     nrfx_gpiote_out_clear(ENABLE_ISFET_PIN);
+     if (m_isfet_task_pin) {
+         nrfx_gpiote_clr_task_trigger(ENABLE_ISFET_PIN);
+         nrfx_gpiote_out_task_disable(ENABLE_ISFET_PIN);
+         m_isfet_task_pin = false;
+     }
+     else {
+         nrfx_gpiote_out_clear(ENABLE_ISFET_PIN);
+     }
      nrfx_gpiote_out_uninit(ENABLE_ISFET_PIN);
 }
 
@@ -1820,21 +4008,47 @@ void create_bluetooth_packet(uint32_t ph_val,   uint32_t batt_val,
     pack_uncalibrated_ph_val(ph_val, total_packet);   
 }
 
+// Packs values into an 8 byte binary record, see BIN_FORMAT_VERSION
+void create_binary_record(uint32_t index, uint32_t ph_val, uint32_t batt_val,
+                          uint32_t temp_val, float ph_val_cal, uint8_t flags,
+                          uint8_t* record)
+{
+    uint64_t packed = 0;
+    int32_t  temp_dc = 0;           // temperature in 0.1 C
+    int32_t  ph_x100 = 0;
+
+    temp_dc = (int32_t)roundf(validate_float_range(calculate_celsius_from_mv(temp_val)) * 10);
+    temp_dc = (temp_dc < 0) ? 0 : ((temp_dc > 0x3FF) ? 0x3FF : temp_dc);
+    if (CAL_PERFORMED) {
+        float real_pH = (ph_val_cal == 0) ? 
+                        validate_float_range(calculate_pH_from_mV(ph_val)) : ph_val_cal;
+        ph_x100 = (int32_t)roundf(real_pH * 100);
+        ph_x100 = (ph_x100 < 0) ? 0 : ((ph_x100 > 0x7FF) ? 0x7FF : ph_x100);
+    }
+
+    packed  = (uint64_t)(index & 0xFFFF);
+    packed |= (uint64_t)(validate_uint_range(ph_val)   & 0xFFF) << 16;
+    packed |= (uint64_t)(validate_uint_range(batt_val) & 0xFFF) << 28;
+    packed |= (uint64_t)temp_dc << 40;
+    packed |= (uint64_t)ph_x100 << 50;
+    packed |= (uint64_t)(flags & ((1 << HIST_FLAG_BITS) - 1)) << 61;
+    for (int i = 0; i < BIN_RECORD_LEN; i++)
+        record[i] = (uint8_t)(packed >> (8 * i));
+}
+
 // Returns the index to prefix each packet with, as uint8_t
 uint32_t get_packet_index() {
     if (TOTAL_DATA_IN_BUFFERS == 0) {
         return (uint32_t)0;
     } 
     else {
-        return (uint32_t)PACK_CTR;
+        return HIST_FIRST_SEQ + PACK_CTR;
     }
 }
 
 // Copies "core" data packet into array size [core_pack_length + 4]
-void add_index_to_total_packet (uint8_t* total_packet, uint8_t* total_pack_w_index) {
+void add_index_to_total_packet (uint32_t index, uint8_t* total_packet, uint8_t* total_pack_w_index) {
     uint32_t ASCII_DIG_BASE = 48;
-    uint32_t index = 0;
-    index = get_packet_index();
     // Format and insert packet index to array
     for(int i = 2; i >= 0; i--){
         if (i == 2) total_pack_w_index[i] = (uint8_t)(index % 10 + ASCII_DIG_BASE);
@@ -1849,85 +4063,144 @@ void add_index_to_total_packet (uint8_t* total_packet, uint8_t* total_pack_w_ind
     }
 }
 
-uint32_t saadc_result_to_mv(uint32_t saadc_result)
+/* Converts a 12 bit SAADC code to mV: code * 600 mV reference * 5 (gain 1/5)
+ * / 4096. Done in integer math, the nRF52810 has no FPU. This is bit exact
+ * with the old float version ((code*600.0)/4096.0)*5.0 truncated, because
+ * code*375/512 is exactly representable in a float for every 12 bit code
+ */
+uint32_t saadc_result_to_mv(uint32_t saadc_result)
+{
+    return (saadc_result * SAADC_MV_PER_FULL_SCALE) >> SAADC_RESOLUTION_BITS;
+}
+
+void saadc_filter_reset(saadc_filter_t * p_filter, saadc_filter_mode_t mode)
+{
+    memset(p_filter, 0, sizeof(saadc_filter_t));
+    p_filter->mode = mode;
+}
+
+static uint16_t median_of_3(uint16_t a, uint16_t b, uint16_t c)
+{
+    if (a > b) { uint16_t t = a; a = b; b = t; }
+    if (b > c) { b = c; }
+    return (a > b) ? a : b;
+}
+
+/* Adds one SAADC code to the running estimate
+ */
+void saadc_filter_add(saadc_filter_t * p_filter, nrf_saadc_value_t code)
+{
+    uint32_t mv;
+
+    if (code < 0) {
+        // MEAN keeps counting negative codes as 0 mV
+        if (p_filter->mode == SAADC_FILTER_MEAN)
+            p_filter->count++;
+        return;
+    }
+    mv = saadc_result_to_mv(code);
+    p_filter->valid++;
+    p_filter->valid_sum    += mv;
+    p_filter->valid_sum_sq += (uint64_t)(mv * mv);
+
+    if (p_filter->mode == SAADC_FILTER_MEAN) {
+        p_filter->sum += mv;
+        p_filter->count++;
+        return;
+    }
+
+    p_filter->block[p_filter->block_len++] = mv;
+    if (p_filter->block_len == SAADC_FILTER_BLOCK) {
+        p_filter->sum += median_of_3(p_filter->block[0], p_filter->block[1], 
+                                     p_filter->block[2]);
+        p_filter->count++;
+        p_filter->block_len = 0;
+    }
+}
+
+/* True once the standard error of the mean of the valid samples is below
+ * target_se_uv. With n samples, s = sum and q = sum of squares:
+ *   SE^2 = (n*q - s^2) / (n^2 * (n-1))
+ * compared in uV^2 without division
+ */
+bool saadc_filter_converged(saadc_filter_t const * p_filter, uint16_t target_se_uv)
+{
+    uint64_t n = p_filter->valid;
+    uint64_t spread;
+
+    if (target_se_uv == 0 || n < 2)
+        return false;
+    spread = n * p_filter->valid_sum_sq - 
+             (uint64_t)p_filter->valid_sum * p_filter->valid_sum;
+    return spread * 1000000 < (uint64_t)target_se_uv * target_se_uv * n * n * (n - 1);
+}
+
+/* Returns the estimate in mV. Leftover samples that do not fill a block are
+ * only used when no complete block was collected
+ */
+uint32_t saadc_filter_result(saadc_filter_t const * p_filter)
 {
-    float adc_denom     = 4096.0;
-    float adc_ref_mv    = 600.0;
-    float adc_prescale  = 5.0;
-    float adc_res_in_mv = (((float)saadc_result*adc_ref_mv)/adc_denom) * adc_prescale;
+    uint32_t partial_sum = 0;
+
+    if (p_filter->count > 0)
+        return p_filter->sum / p_filter->count;
+    if (p_filter->block_len == 0)
+        return 0;
+    for (int i = 0; i < p_filter->block_len; i++)
+        partial_sum += p_filter->block[i];
+    return partial_sum / p_filter->block_len;
+}
 
-    return (uint32_t)adc_res_in_mv;
+/* Logs how long a reading took with the given acquisition profile, including
+ * the time spent in the SAADC handlers
+ */
+void log_saadc_profile_duration(int profile, uint16_t sw_samples, uint32_t start_ticks)
+{
+    uint32_t ticks = app_timer_cnt_diff_compute(app_timer_cnt_get(), start_ticks);
+    NRF_LOG_INFO("saadc profile %d: %d x %d samples in %d us", profile, sw_samples,
+                 (1 << m_saadc_profiles[profile].oversample),
+                 ticks_to_time(ticks, 1000000));
 }
 
-// Read saadc values for temperature, battery level, and pH to store for calibration
+// Read saadc values for temperature, battery level, and pH in a single scan,
+// once the ISFET has settled
 void read_saadc_for_regular_protocol(void) 
 {
-    int NUM_SAMPLES = 150;
-    nrf_saadc_value_t temp_val = 0;
-    ret_code_t err_code;
-    uint32_t AVG_MV_VAL = 0;
+    isfet_warmup_start();
+}
 
-    for (int i = 0; i < NUM_SAMPLES; i++) {
-      err_code = nrfx_saadc_sample_convert(0, &temp_val);
-      APP_ERROR_CHECK(err_code);
-      if (temp_val < 0) {
-          AVG_MV_VAL += 0;
-      } else {
-          AVG_MV_VAL += saadc_result_to_mv(temp_val);
-      }
-    }
-    AVG_MV_VAL = AVG_MV_VAL / NUM_SAMPLES;
-    // Assign averaged readings to the correct calibration point
-    if(!PH_IS_READ){
-      AVG_PH_VAL = AVG_MV_VAL;
-      NRF_LOG_FLUSH();
-      NRF_LOG_INFO("read pH val, restarting: %d", AVG_PH_VAL);
-      PH_IS_READ = true;
-      restart_saadc();
-    }
-    else if (!(PH_IS_READ && BATTERY_IS_READ)){
-      AVG_BATT_VAL = AVG_MV_VAL;
-      NRF_LOG_FLUSH();
-      NRF_LOG_INFO("read batt val, restarting: %d", AVG_BATT_VAL);
-      BATTERY_IS_READ = true;
-      restart_saadc();
+// Publish (or hand off to advertising) the averaged regular protocol readings
+void process_regular_protocol_readings(void)
+{
+    NRF_LOG_FLUSH();
+    NRF_LOG_INFO("read pH val: %d, batt val: %d, temp val: %d (%d samples)", 
+                 AVG_PH_VAL, AVG_BATT_VAL, AVG_TEMP_VAL, AVG_SAMPLE_CNT);
+    NRF_LOG_INFO("value age in cycles, batt: %d, temp: %d", 
+                 CHANNEL_AGE[SAADC_SCAN_BATT_CH], CHANNEL_AGE[SAADC_SCAN_TEMP_CH]);
+    if (CLIENT_PROTO_FLAG) {
+        disable_pH_voltage_reading();
+        advertising_update_reading();
+        advertising_start(false);
     }
-    else {
-       AVG_TEMP_VAL = AVG_MV_VAL;
-       NRF_LOG_FLUSH();
-       NRF_LOG_INFO("read temp val, restarting: %d", AVG_TEMP_VAL);
-       PH_IS_READ = false;
-       BATTERY_IS_READ = false;
-       if (CLIENT_PROTO_FLAG) {
-          disable_pH_voltage_reading();
-          advertising_start(false);
-       }
-       else if (DEMO_PROTO_FLAG) {
-          if (!CAL_MODE) {
-            // Create bluetooth data packet
-            create_bluetooth_packet(AVG_PH_VAL, AVG_BATT_VAL, 
-                                    AVG_TEMP_VAL, NULL, total_packet);
-            // Prefix appropriate array index
-            add_index_to_total_packet(total_packet, total_packet_with_index);
+    else if (DEMO_PROTO_FLAG) {
+        if (!CAL_MODE) {
+            // Create bluetooth data packet in the format of this connection
+            uint8_t  packet[NUS_TX_ITEM_MAX_LEN];
+            uint16_t packet_len = start_record_packet(packet);
+            packet_len = add_record_to_packet(get_packet_index(),
+                                              AVG_PH_VAL, AVG_BATT_VAL, AVG_TEMP_VAL, 
+                                              NULL, meas_flags(), 
+                                              packet, packet_len);
 
             // Send data
-            err_code = ble_nus_data_send(&m_nus, total_packet_with_index, 
-                                     &total_size_w_index, m_conn_handle);
-            if ((err_code != NRF_ERROR_INVALID_STATE) &&
-                (err_code != NRF_ERROR_RESOURCES) &&
-                (err_code != NRF_ERROR_NOT_FOUND) &&
-                (err_code != BLE_ERROR_GATTS_SYS_ATTR_MISSING))
-            {   
-                 APP_ERROR_CHECK(err_code);              
-            }
+            (void)nus_tx_enqueue(packet, packet_len);
               
             NRF_LOG_INFO("BLUETOOTH DATA SENT\n");
 
             reset_total_packet();
-          }
-          disable_pH_voltage_reading();
-       }
-    }    
+        }
+        disable_pH_voltage_reading();
+    }
 }
 
 
@@ -1941,7 +4214,10 @@ void saadc_blocking_callback(nrf_drv_saadc_evt_t const * p_event)
 void init_saadc_for_blocking_sample_conversion(nrf_saadc_channel_config_t channel_config)
 {
     ret_code_t err_code;
-    err_code = nrf_drv_saadc_init(NULL, saadc_blocking_callback);
+    nrf_drv_saadc_config_t saadc_config = NRF_DRV_SAADC_DEFAULT_CONFIG;
+    saadc_config.oversample = m_saadc_profiles[CALIBRATION_SAADC_PROFILE].oversample;
+
+    err_code = nrf_drv_saadc_init(&saadc_config, saadc_blocking_callback);
     APP_ERROR_CHECK(err_code);
 
     err_code = nrf_drv_saadc_channel_init(0, &channel_config);
@@ -1965,19 +4241,620 @@ void saadc_init(void)
     }
 
     nrf_saadc_channel_config_t channel_config =
-            NRF_SAADC_CUSTOM_CHANNEL_CONFIG_SE(ANALOG_INPUT);
+            NRF_SAADC_CUSTOM_CHANNEL_CONFIG_SE(ANALOG_INPUT, 
+                                               m_saadc_profiles[CALIBRATION_SAADC_PROFILE]);
     
     init_saadc_for_blocking_sample_conversion(channel_config);
 }
 
 
-/* This function initializes and enables SAADC sampling
+/*
+ * Multi-channel scan used by the regular protocol. pH, battery and temperature
+ * inputs are configured once as channels of the same scan, so every SAMPLE task
+ * converts all three into the current EasyDMA buffer. Each buffer holds
+ * SAADC_SCANS_PER_BUFFER scans and two buffers are kept queued in the driver,
+ * so the CPU only wakes on the END event of a full buffer.
+ *
+ * SAMPLE is not triggered by the CPU. TIMER1 and PPI sequence the whole
+ * acquisition (P = sample period, S = optional extra settling time, 0 after
+ * the probe based warm-up below):
+ *
+ *   CC0 = P       : SAADC SAMPLE + TIMER CLEAR  (only while the PPI group is on)
+ *   CC1 = P+1     : ISFET enable pin SET through GPIOTE
+ *   CC2 = P+1+S   : enable PPI group + TIMER CLEAR
+ *
+ * The timer passes CC0 once with the group off, raises the ISFET enable at
+ * CC1, and after the settling time CC2 turns the sample channel on and clears
+ * the timer. From then on CC0 fires every P and clears the timer before CC1
+ * and CC2 can be reached again. The last DONE event stops the timer.
+ */
+static nrf_saadc_value_t m_scan_buffer[2][SAADC_SCANS_PER_BUFFER * SAADC_SCAN_CHANNELS];
+static saadc_filter_t    m_scan_filter[SAADC_SCAN_CHANNELS];
+static uint16_t          m_scans_done  = 0;
+static uint16_t          m_scans_armed = 0;
+static uint16_t          m_scans_total = 0;
+static uint32_t          m_scan_start_ticks;
+static uint8_t           m_scan_active[SAADC_SCAN_CHANNELS];
+static uint8_t           m_scan_active_cnt = 0;
+static uint32_t          m_meas_cycle      = 0;
+static uint32_t * const  m_scan_result[]   =
+{
+    [SAADC_SCAN_PH_CH]   = &AVG_PH_VAL,
+    [SAADC_SCAN_BATT_CH] = &AVG_BATT_VAL,
+    [SAADC_SCAN_TEMP_CH] = &AVG_TEMP_VAL,
+};
+
+static const nrf_drv_timer_t m_sequencer_timer = NRF_DRV_TIMER_INSTANCE(1);
+static nrf_ppi_channel_t       m_ppi_sample;
+static nrf_ppi_channel_t       m_ppi_isfet_on;
+static nrf_ppi_channel_t       m_ppi_arm;
+static nrf_ppi_channel_group_t m_ppi_sample_group;
+static bool                    m_sequencer_ready = false;
+
+void sequencer_timer_handler(nrf_timer_event_t event_type, void * p_context)
+{
+    // Compare interrupts are not enabled, everything is done through PPI
+}
+
+/* Sets up TIMER1 compare values and allocates the PPI channels once. The
+ * timer and PPI are left configured between readings.
+ */
+void saadc_sequencer_init(void)
+{
+    ret_code_t err_code;
+    uint32_t   period_ticks;
+    nrf_drv_timer_config_t timer_config = NRF_DRV_TIMER_DEFAULT_CONFIG;
+
+    timer_config.frequency = NRF_TIMER_FREQ_1MHz;
+    timer_config.bit_width = NRF_TIMER_BIT_WIDTH_32;
+    err_code = nrf_drv_timer_init(&m_sequencer_timer, &timer_config, 
+                                  sequencer_timer_handler);
+    APP_ERROR_CHECK(err_code);
+
+    period_ticks = nrf_drv_timer_us_to_ticks(&m_sequencer_timer, SAADC_SAMPLE_PERIOD_US);
+    nrf_drv_timer_compare(&m_sequencer_timer, NRF_TIMER_CC_CHANNEL0, 
+                          period_ticks, false);
+    nrf_drv_timer_compare(&m_sequencer_timer, NRF_TIMER_CC_CHANNEL1, 
+                          period_ticks + 1, false);
+
+    err_code = nrfx_ppi_channel_alloc(&m_ppi_sample);
+    APP_ERROR_CHECK(err_code);
+    err_code = nrfx_ppi_channel_alloc(&m_ppi_isfet_on);
+    APP_ERROR_CHECK(err_code);
+    err_code = nrfx_ppi_channel_alloc(&m_ppi_arm);
+    APP_ERROR_CHECK(err_code);
+    err_code = nrfx_ppi_group_alloc(&m_ppi_sample_group);
+    APP_ERROR_CHECK(err_code);
+
+    // CC0: sample all channels and restart the period
+    err_code = nrfx_ppi_channel_assign(m_ppi_sample,
+        nrf_drv_timer_compare_event_address_get(&m_sequencer_timer, NRF_TIMER_CC_CHANNEL0),
+        nrf_drv_saadc_sample_task_get());
+    APP_ERROR_CHECK(err_code);
+    err_code = nrfx_ppi_channel_fork_assign(m_ppi_sample,
+        nrf_drv_timer_task_address_get(&m_sequencer_timer, NRF_TIMER_TASK_CLEAR));
+    APP_ERROR_CHECK(err_code);
+    err_code = nrfx_ppi_channel_include_in_group(m_ppi_sample, m_ppi_sample_group);
+    APP_ERROR_CHECK(err_code);
+
+    // CC2: settling done, turn on sampling and restart the period
+    err_code = nrfx_ppi_channel_assign(m_ppi_arm,
+        nrf_drv_timer_compare_event_address_get(&m_sequencer_timer, NRF_TIMER_CC_CHANNEL2),
+        nrfx_ppi_task_addr_group_enable_get(m_ppi_sample_group));
+    APP_ERROR_CHECK(err_code);
+    err_code = nrfx_ppi_channel_fork_assign(m_ppi_arm,
+        nrf_drv_timer_task_address_get(&m_sequencer_timer, NRF_TIMER_TASK_CLEAR));
+    APP_ERROR_CHECK(err_code);
+
+    m_sequencer_ready = true;
+}
+
+/* Starts the timer, sampling begins settle_ms after the ISFET enable is
+ * raised. The enable pin must already be a GPIOTE task pin, see
+ * enable_isfet_circuit_task_pin(). CC1 is assigned here because the GPIOTE
+ * channel of the pin can change between readings
+ */
+void saadc_sequencer_start(uint32_t settle_ms)
+{
+    ret_code_t err_code;
+    uint32_t   period_ticks;
+
+    if (!m_sequencer_ready) {
+        saadc_sequencer_init();
+    }
+    period_ticks = nrf_drv_timer_us_to_ticks(&m_sequencer_timer, SAADC_SAMPLE_PERIOD_US);
+    nrf_drv_timer_compare(&m_sequencer_timer, NRF_TIMER_CC_CHANNEL2, period_ticks + 1 + 
+                          nrf_drv_timer_ms_to_ticks(&m_sequencer_timer, settle_ms), false);
+
+    err_code = nrfx_ppi_channel_assign(m_ppi_isfet_on,
+        nrf_drv_timer_compare_event_address_get(&m_sequencer_timer, NRF_TIMER_CC_CHANNEL1),
+        nrfx_gpiote_set_task_addr_get(ENABLE_ISFET_PIN));
+    APP_ERROR_CHECK(err_code);
+    err_code = nrfx_ppi_channel_enable(m_ppi_isfet_on);
+    APP_ERROR_CHECK(err_code);
+    err_code = nrfx_ppi_channel_enable(m_ppi_arm);
+    APP_ERROR_CHECK(err_code);
+
+    nrf_drv_timer_clear(&m_sequencer_timer);
+    nrf_drv_timer_enable(&m_sequencer_timer);
+}
+
+/* Stops the timer and disconnects all sequencer PPI channels. The ISFET
+ * enable pin is released by disable_isfet_circuit()
+ */
+void saadc_sequencer_stop(void)
+{
+    ret_code_t err_code;
+
+    nrf_drv_timer_disable(&m_sequencer_timer);
+    err_code = nrfx_ppi_group_disable(m_ppi_sample_group);
+    APP_ERROR_CHECK(err_code);
+    err_code = nrfx_ppi_channel_disable(m_ppi_arm);
+    APP_ERROR_CHECK(err_code);
+    err_code = nrfx_ppi_channel_disable(m_ppi_isfet_on);
+    APP_ERROR_CHECK(err_code);
+}
+
+/* Queues the next buffer, sized for the scans that are still outstanding
+ */
+void saadc_scan_queue_buffer(nrf_saadc_value_t * p_buffer)
+{
+    ret_code_t err_code;
+    uint16_t   scans = m_scans_total - m_scans_armed;
+
+    if (scans > SAADC_SCANS_PER_BUFFER)
+        scans = SAADC_SCANS_PER_BUFFER;
+    err_code = nrf_drv_saadc_buffer_convert(p_buffer, scans * m_scan_active_cnt);
+    APP_ERROR_CHECK(err_code);
+    m_scans_armed += scans;
+}
+
+/* True once the regular profile's minimum was taken and every channel is
+ * stable enough to stop
+ */
+bool saadc_scan_converged(void)
+{
+    saadc_acq_profile_t const * p_profile = &m_saadc_profiles[REGULAR_SAADC_PROFILE];
+
+    if (m_scans_done < p_profile->min_samples)
+        return false;
+    for (int i = 0; i < m_scan_active_cnt; i++) {
+        if (!saadc_filter_converged(&m_scan_filter[m_scan_active[i]], 
+                                    p_profile->target_se_uv))
+            return false;
+    }
+    return true;
+}
+
+/* Only hands the full buffer to the measurement state machine, it is
+ * processed and re-queued from the scheduler while the other buffer fills
+ */
+void saadc_scan_callback(nrf_drv_saadc_evt_t const * p_event)
+{
+    if (p_event->type == NRF_DRV_SAADC_EVT_CALIBRATEDONE) {
+        // SAADC anomaly 86: without a STOP after calibration the next START
+        // can write one sample to RAM, shifting the channel order of the scan
+        nrf_saadc_task_trigger(NRF_SAADC_TASK_STOP);
+        while (!nrf_saadc_event_check(NRF_SAADC_EVENT_STOPPED)) {}
+        nrf_saadc_event_clear(NRF_SAADC_EVENT_STOPPED);
+        meas_evt_post(MEAS_EVT_CALIBRATE_DONE, NULL, 0);
+        return;
+    }
+    if (p_event->type != NRF_DRV_SAADC_EVT_DONE)
+        return;
+
+    meas_evt_post(MEAS_EVT_SCAN_DONE, p_event->data.done.p_buffer, 
+                  p_event->data.done.size);
+}
+
+/* Processes one full scan buffer, returns true when the reading is complete
+ * and the AVG_* values are updated
+ */
+bool saadc_scan_process(nrf_saadc_value_t * p_buffer, uint16_t size)
+{
+    // Feed each channel's estimator, see m_saadc_channel_filter. Results of
+    // a scan are stored in channel order
+    for (int i = 0; i < size; i++) {
+        saadc_filter_add(&m_scan_filter[m_scan_active[i % m_scan_active_cnt]], 
+                         p_buffer[i]);
+    }
+    m_scans_done += size / m_scan_active_cnt;
+
+    if (m_scans_done < m_scans_total && !saadc_scan_converged()) {
+        // Only re-queue the buffer if more scans are still needed, so the 
+        // driver returns to idle on the final DONE event
+        if (m_scans_armed < m_scans_total) {
+            saadc_scan_queue_buffer(p_buffer);
+        }
+        return false;
+    }
+
+    // Any scans still running into the other buffer are dropped when the
+    // SAADC is uninitialized
+    saadc_sequencer_stop();
+    // Channels that were not scanned keep their cached value and age
+    for (int ch = 0; ch < SAADC_SCAN_CHANNELS; ch++) {
+        if (CHANNEL_AGE[ch] < UINT8_MAX)
+            CHANNEL_AGE[ch]++;
+    }
+    for (int i = 0; i < m_scan_active_cnt; i++) {
+        uint8_t ch = m_scan_active[i];
+        *m_scan_result[ch] = saadc_filter_result(&m_scan_filter[ch]);
+        CHANNEL_AGE[ch]    = 0;
+        if (m_scan_filter[ch].valid < m_scans_done) {
+            NRF_LOG_INFO("negative saadc codes, channel %d: %d of %d valid", ch,
+                         m_scan_filter[ch].valid, m_scans_done);
+        }
+    }
+    AVG_SAMPLE_CNT = m_scans_done;
+    log_saadc_profile_duration(REGULAR_SAADC_PROFILE, m_scans_done, m_scan_start_ticks);
+    return true;
+}
+
+/* Initializes the SAADC with the channels due this cycle, see
+ * m_saadc_channel_rate. The pH channel is always due. Low power mode is
+ * turned off because it makes the driver trigger START from
+ * nrfx_saadc_sample(), while here SAMPLE comes from PPI
+ */
+void saadc_scan_init(void)
+{
+    ret_code_t err_code;
+    saadc_acq_profile_t const * p_profile = &m_saadc_profiles[REGULAR_SAADC_PROFILE];
+    nrf_drv_saadc_config_t saadc_config   = NRF_DRV_SAADC_DEFAULT_CONFIG;
+
+    saadc_config.oversample     = p_profile->oversample;
+    saadc_config.low_power_mode = false;
+    err_code = nrf_drv_saadc_init(&saadc_config, saadc_scan_callback);
+    APP_ERROR_CHECK(err_code);
+
+    m_scan_active_cnt = 0;
+    for (int ch = 0; ch < SAADC_SCAN_CHANNELS; ch++) {
+        nrf_saadc_channel_config_t channel_config = 
+                NRF_SAADC_CUSTOM_CHANNEL_CONFIG_SE(m_saadc_channel_rate[ch].input, *p_profile);
+        if (ch != SAADC_SCAN_PH_CH && m_meas_cycle > 0 &&
+            (m_meas_cycle % m_saadc_channel_rate[ch].decimation) != 0)
+            continue;
+        err_code = nrf_drv_saadc_channel_init(ch, &channel_config);
+        APP_ERROR_CHECK(err_code);
+        m_scan_active[m_scan_active_cnt++] = ch;
+    }
+    m_meas_cycle++;
+}
+
+/* Queues both scan buffers and starts the hardware sequence. The ISFET has
+ * already settled during the warm-up, so sampling starts right away
+ */
+void saadc_scan_start(void)
+{
+    for (int i = 0; i < SAADC_SCAN_CHANNELS; i++) {
+        saadc_filter_reset(&m_scan_filter[i], m_saadc_channel_filter[i]);
+    }
+    m_scans_done       = 0;
+    m_scans_armed      = 0;
+    m_scans_total      = m_saadc_profiles[REGULAR_SAADC_PROFILE].max_samples;
+    m_scan_start_ticks = app_timer_cnt_get();
+
+    for (int i = 0; i < 2 && m_scans_armed < m_scans_total; i++) {
+        saadc_scan_queue_buffer(m_scan_buffer[i]);
+    }
+    saadc_sequencer_start(0);
+}
+
+
+/*
+ * ISFET warm-up. Instead of a fixed delay after enabling the ISFET, a probe
+ * sample of the pH channel is taken every ISFET_WARMUP_PROBE_MS. The sensor
+ * counts as settled once ISFET_WARMUP_STABLE_PROBES consecutive probes each
+ * moved less than ISFET_WARMUP_SLOPE_MV from the previous one. The old fixed
+ * delay is kept as a ceiling. The regular protocol sleeps between probes on
+ * an app_timer. Calibration runs from the NUS handler, where that timer
+ * cannot fire, so it waits between probes but still ends as soon as the
+ * sensor is stable.
+ */
+static uint32_t m_warmup_last_mv;
+static uint8_t  m_warmup_stable;
+static uint16_t m_warmup_elapsed_ms;
+
+void isfet_warmup_reset(void)
+{
+    m_warmup_last_mv    = UINT32_MAX;
+    m_warmup_stable     = 0;
+    m_warmup_elapsed_ms = 0;
+}
+
+/* Takes one probe of the pH channel, returns true once the ISFET is settled
+ * or max_ms has passed
+ */
+bool isfet_warmup_probe(uint16_t max_ms)
+{
+    ret_code_t        err_code;
+    nrf_saadc_value_t probe;
+    uint32_t          probe_mv;
+
+    err_code = nrfx_saadc_sample_convert(SAADC_SCAN_PH_CH, &probe);
+    APP_ERROR_CHECK(err_code);
+    probe_mv = (probe < 0) ? 0 : saadc_result_to_mv(probe);
+
+    if (m_warmup_last_mv != UINT32_MAX &&
+        abs((int32_t)probe_mv - (int32_t)m_warmup_last_mv) < ISFET_WARMUP_SLOPE_MV)
+        m_warmup_stable++;
+    else
+        m_warmup_stable = 0;
+    m_warmup_last_mv     = probe_mv;
+    m_warmup_elapsed_ms += ISFET_WARMUP_PROBE_MS;
+
+    if (m_warmup_stable >= ISFET_WARMUP_STABLE_PROBES || m_warmup_elapsed_ms >= max_ms) {
+        NRF_LOG_INFO("ISFET warm-up %d ms (%s)", m_warmup_elapsed_ms,
+                     (m_warmup_stable >= ISFET_WARMUP_STABLE_PROBES) ? "settled" : "timeout");
+        return true;
+    }
+    return false;
+}
+
+void isfet_warmup_timer_handler(void * p_context)
+{
+    meas_evt_post(MEAS_EVT_WARMUP_TICK, NULL, 0);
+}
+
+/* Raises the ISFET enable and starts probing, the regular scan begins once
+ * a probe finds the sensor settled
+ */
+void isfet_warmup_start(void)
+{
+    ret_code_t err_code;
+
+    enable_isfet_circuit_task_pin();
+    nrfx_gpiote_set_task_trigger(ENABLE_ISFET_PIN);
+    isfet_warmup_reset();
+    err_code = app_timer_start(m_warmup_timer, APP_TIMER_TICKS(ISFET_WARMUP_PROBE_MS), NULL);
+    APP_ERROR_CHECK(err_code);
+}
+
+/* Calibration variant, the SAADC must already be set up by saadc_init()
+ */
+void isfet_warmup_blocking(uint16_t max_ms)
+{
+    isfet_warmup_reset();
+    do {
+        nrf_delay_ms(ISFET_WARMUP_PROBE_MS);
+    } while (!isfet_warmup_probe(max_ms));
+}
+
+
+/*
+ * SAADC offset calibration. The offset drifts with die temperature, so it is
+ * recalibrated at boot, every SAADC_CAL_INTERVAL_CYCLES measurement cycles,
+ * and when the thermistor reading moved more than SAADC_CAL_TEMP_DELTA_C
+ * since the last calibration. SAADC_CALIBRATED is cleared when one is due,
+ * and the calibration runs at the start of the next warm-up, while the SAADC
+ * is powered anyway and the ISFET is settling. Warm-up probes are skipped
+ * until it finishes.
+ */
+static bool     m_saadc_calibrating      = false;
+static uint16_t m_cycles_since_cal       = 0;
+static float    m_cal_temp               = 0;
+static bool     m_cal_temp_valid         = false;
+
+/* Starts an offset calibration if one is due, called from the warm-up with
+ * the scan channels set up and the driver idle
+ */
+void saadc_calibration_start_if_due(void)
+{
+    ret_code_t err_code;
+
+    if (SAADC_CALIBRATED)
+        return;
+    err_code = nrfx_saadc_calibrate_offset();
+    APP_ERROR_CHECK(err_code);
+    m_saadc_calibrating = true;
+}
+
+void saadc_calibration_done(void)
+{
+    m_saadc_calibrating = false;
+    SAADC_CALIBRATED    = true;
+    m_cycles_since_cal  = 0;
+    m_cal_temp_valid    = false;
+    NRF_LOG_INFO("SAADC offset calibrated");
+}
+
+/* Called with each finished reading, marks a calibration as due. The first
+ * reading after a calibration sets the reference temperature
+ */
+void saadc_calibration_check(void)
+{
+    float temp = calculate_celsius_from_mv(AVG_TEMP_VAL);
+
+    m_cycles_since_cal++;
+    if (!m_cal_temp_valid) {
+        m_cal_temp       = temp;
+        m_cal_temp_valid = true;
+    }
+    if (m_cycles_since_cal >= SAADC_CAL_INTERVAL_CYCLES ||
+        fabsf(temp - m_cal_temp) > SAADC_CAL_TEMP_DELTA_C) {
+        SAADC_CALIBRATED = false;
+    }
+}
+
+
+/*
+ * Measurement state machine for the regular protocol:
+ *
+ *   IDLE --START--> WARMUP --settled--> SAMPLE --reading done--> PUBLISH --> IDLE
+ *
+ * Timer and SAADC interrupts only post an event through app_scheduler, every
+ * transition runs from the main loop. Phases therefore never nest, stack use
+ * is bounded and advertising / NUS sends no longer run in interrupt context.
+ * Events that do not match the current state are dropped, which also covers
+ * a START while a cycle is running and a late DONE from the spare scan
+ * buffer. Each full scan buffer must be handled before the other one fills,
+ * i.e. within SAADC_SCANS_PER_BUFFER sample periods.
+ *
+ * meas_abort() ends a cycle from any state, events posted before it are
+ * recognised by their epoch and dropped. It runs from the main loop only,
+ * interrupt handlers post MEAS_EVT_ABORT through meas_stop() instead. An
+ * event that does not fit in the scheduler queue is counted and dropped, a
+ * lost warm-up tick is simply retried by the next one, a lost abort is
+ * carried out and any other loss restarts the cycle from the main loop, see
+ * meas_evt_lost_check().
+ */
+static meas_state_t  m_meas_state = MEAS_STATE_IDLE;
+static uint32_t      m_meas_state_ticks;
+static uint8_t       m_meas_epoch       = 0;
+static uint16_t      m_meas_evt_dropped = 0;      // events the scheduler queue had no room for
+static volatile bool m_meas_evt_lost    = false;  // a dropped event stalled the cycle
+static volatile bool m_meas_abort_lost  = false;  // a dropped MEAS_EVT_ABORT
+
+void meas_state_enter(meas_state_t state)
+{
+    uint32_t ticks = app_timer_cnt_diff_compute(app_timer_cnt_get(), m_meas_state_ticks);
+
+    NRF_LOG_INFO("meas state %d -> %d after %d ms", m_meas_state, state,
+                 ticks_to_time(ticks, 1000));
+    m_meas_state       = state;
+    m_meas_state_ticks = app_timer_cnt_get();
+}
+
+/* Stops the warm-up probes and the sequencer and returns to IDLE. The SAADC
+ * itself is released by meas_release(), which calls this
+ */
+void meas_abort(void)
+{
+    ret_code_t err_code;
+
+    err_code = app_timer_stop(m_warmup_timer);
+    APP_ERROR_CHECK(err_code);
+    if (m_sequencer_ready)
+        saadc_sequencer_stop();
+    m_saadc_calibrating = false;
+    m_meas_evt_lost     = false;
+    m_meas_epoch++;
+    if (m_meas_state != MEAS_STATE_IDLE)
+        meas_state_enter(MEAS_STATE_IDLE);
+}
+
+void meas_evt_handler(void * p_event_data, uint16_t event_size)
+{
+    ret_code_t         err_code;
+    meas_evt_t const * p_evt = (meas_evt_t const *)p_event_data;
+
+    if (p_evt->type == MEAS_EVT_ABORT) {
+        meas_release();
+        return;
+    }
+    if (p_evt->epoch != m_meas_epoch) {
+        NRF_LOG_INFO("meas event %d from an aborted cycle dropped", p_evt->type);
+        return;
+    }
+    switch (m_meas_state)
+    {
+        case MEAS_STATE_IDLE:
+            if (p_evt->type != MEAS_EVT_START)
+                break;
+            meas_state_enter(MEAS_STATE_WARMUP);
+            saadc_scan_init();
+            saadc_calibration_start_if_due();
+            read_saadc_for_regular_protocol();
+            return;
+
+        case MEAS_STATE_WARMUP:
+            if (p_evt->type == MEAS_EVT_CALIBRATE_DONE) {
+                saadc_calibration_done();
+                return;
+            }
+            if (p_evt->type != MEAS_EVT_WARMUP_TICK)
+                break;
+            if (m_saadc_calibrating)
+                return;
+            if (isfet_warmup_probe(ISFET_SETTLE_MS)) {
+                err_code = app_timer_stop(m_warmup_timer);
+                APP_ERROR_CHECK(err_code);
+                meas_state_enter(MEAS_STATE_SAMPLE);
+                saadc_scan_start();
+            }
+            return;
+
+        case MEAS_STATE_SAMPLE:
+            if (p_evt->type != MEAS_EVT_SCAN_DONE)
+                break;
+            if (saadc_scan_process(p_evt->p_buffer, p_evt->size)) {
+                saadc_calibration_check();
+                meas_state_enter(MEAS_STATE_PUBLISH);
+                // Ends in disable_pH_voltage_reading(), which returns to IDLE
+                process_regular_protocol_readings();
+                if (m_meas_state != MEAS_STATE_IDLE)
+                    meas_state_enter(MEAS_STATE_IDLE);
+            }
+            return;
+
+        default:
+            break;
+    }
+    NRF_LOG_INFO("meas event %d dropped in state %d", p_evt->type, m_meas_state);
+}
+
+void meas_evt_post(meas_evt_type_t type, nrf_saadc_value_t * p_buffer, uint16_t size)
+{
+    ret_code_t err_code;
+    meas_evt_t evt = {
+        .type     = type,
+        .epoch    = m_meas_epoch,
+        .size     = size,
+        .p_buffer = p_buffer
+    };
+
+    err_code = app_sched_event_put(&evt, sizeof(evt), meas_evt_handler);
+    if (err_code != NRF_SUCCESS) {
+        m_meas_evt_dropped++;
+        if (type == MEAS_EVT_ABORT)
+            m_meas_abort_lost = true;
+        else if (type != MEAS_EVT_WARMUP_TICK)
+            m_meas_evt_lost = true;
+        NRF_LOG_WARNING("meas event %d not queued (0x%x), %d dropped", 
+                        type, err_code, m_meas_evt_dropped);
+    }
+}
+
+/* Ends the measurement from interrupt context. The cycle is aborted and the
+ * SAADC released once the main loop runs the event, see meas_release()
+ */
+void meas_stop(void)
+{
+    meas_evt_post(MEAS_EVT_ABORT, NULL, 0);
+}
+
+/* Called from the main loop. Carries out a lost abort, or restarts the
+ * cycle if meas_evt_post() lost an event the state machine waits for
+ */
+void meas_evt_lost_check(void)
+{
+    if (m_meas_abort_lost) {
+        NRF_LOG_WARNING("meas abort lost in state %d, releasing SAADC", m_meas_state);
+        m_meas_abort_lost = false;
+        meas_release();
+        return;
+    }
+    if (!m_meas_evt_lost)
+        return;
+    NRF_LOG_WARNING("meas event lost in state %d, restarting cycle", m_meas_state);
+    disable_pH_voltage_reading();
+    if (CLIENT_PROTO_FLAG && !CAL_MODE)
+        enable_pH_voltage_reading();
+}
+
+
+/* This function initializes and enables SAADC sampling. Calibration reads 
+ * one channel at a time with blocking conversions, the regular protocol 
+ * starts a measurement cycle that runs from the scheduler
  */
 void enable_pH_voltage_reading(void)
 {
-    saadc_init();
-    if (!CAL_MODE) 
-        read_saadc_for_regular_protocol();
+    if (CAL_MODE) {
+        saadc_init();
+    }
+    else {
+        meas_evt_post(MEAS_EVT_START, NULL, 0);
+    }
 }
 
 void restart_pH_interval_timer(void)
@@ -1989,19 +4866,27 @@ void restart_pH_interval_timer(void)
 }
 
 
-/* Function unitializes and disables SAADC sampling, restarts timer
+/* Aborts the cycle, uninitializes the SAADC and disables the ISFET. Runs
+ * from the main loop, see meas_stop()
  */
-void disable_pH_voltage_reading(void)
+void meas_release(void)
 {
     NRF_LOG_INFO("\n*** Disabling pH voltage reading ***\n\n");
     NRF_LOG_FLUSH();
+    meas_abort();
     nrfx_saadc_uninit();
     NVIC_ClearPendingIRQ(SAADC_IRQn);
     while(nrfx_saadc_is_busy()) {}
 
     // *** DISABLE BIASING CIRCUITRY ***
     disable_isfet_circuit();
+}
 
+/* Function unitializes and disables SAADC sampling, restarts timer
+ */
+void disable_pH_voltage_reading(void)
+{
+    meas_release();
     if (!CAL_MODE && DEMO_PROTO_FLAG) {
       // Restart timer
       restart_pH_interval_timer();
@@ -2015,11 +4900,8 @@ void single_shot_timer_handler()
     err_code = app_timer_stop(m_timer_id);
     APP_ERROR_CHECK(err_code);
 
-    // Delay to ensure appropriate timing 
-    enable_isfet_circuit();       
-    // Slight delay for ISFET to achieve optimal ISFET reading
-    nrf_delay_ms(200);              
-    // Begin SAADC initialization/start
+    // Begin SAADC initialization/start, the ISFET is enabled and given
+    // time to settle by the hardware sequencer
 
     /* * * * * * * * * * * * * * *
      *  UNCOMMENT TO SEND DATA
@@ -2049,14 +4931,20 @@ void disconn_delay_timer_handler()
         init_and_start_app_timer();
       }
       else {
-        nrfx_gpiote_out_clear(CHIP_POWER_PIN);
-        nrfx_gpiote_out_uninit(CHIP_POWER_PIN);
-        nrfx_gpiote_uninit();
+        chip_power_off();
       }
     }
 }
 
 
+/**@brief Function for initializing the event scheduler.
+ */
+static void scheduler_init(void)
+{
+    APP_SCHED_INIT(SCHED_MAX_EVENT_DATA_SIZE, SCHED_QUEUE_SIZE);
+}
+
+
 /**@brief Function for initializing the timer module.
  */
 void timers_init(void)
@@ -2069,11 +4957,25 @@ void timers_init(void)
                                 single_shot_timer_handler);
     APP_ERROR_CHECK(err_code);
 
+    err_code = app_timer_create(&m_warmup_timer,
+                                APP_TIMER_MODE_REPEATED,
+                                isfet_warmup_timer_handler);
+    APP_ERROR_CHECK(err_code);
+
     err_code = app_timer_create(&m_timer_disconn_delay,
                                 APP_TIMER_MODE_SINGLE_SHOT,
                                 disconn_delay_timer_handler);
     APP_ERROR_CHECK(err_code);
 
+    // Keeps the RTC running, which uptime_seconds() is based on
+    err_code = app_timer_create(&m_uptime_timer,
+                                APP_TIMER_MODE_REPEATED,
+                                uptime_timer_handler);
+    APP_ERROR_CHECK(err_code);
+    m_uptime_base_ticks = app_timer_cnt_get();
+    err_code = app_timer_start(m_uptime_timer, 
+                               APP_TIMER_TICKS(UPTIME_TIMER_PERIOD_S * 1000), NULL);
+    APP_ERROR_CHECK(err_code);
 }
 
 void send_data_and_restart_timer()
@@ -2082,26 +4984,16 @@ void send_data_and_restart_timer()
     
     // Send data normally if there is no buffered data
     if (TOTAL_DATA_IN_BUFFERS == 0){
-        // Create packet
-        create_bluetooth_packet(AVG_PH_VAL, AVG_BATT_VAL, 
-                                AVG_TEMP_VAL, NULL, total_packet);
-        // Prefix appropriate array index
-        add_index_to_total_packet(total_packet, total_packet_with_index);
+        // Create packet in the format of this connection
+        uint8_t  packet[NUS_TX_ITEM_MAX_LEN];
+        uint16_t packet_len = start_record_packet(packet);
+        packet_len = add_record_to_packet(get_packet_index(),
+                                          AVG_PH_VAL, AVG_BATT_VAL, AVG_TEMP_VAL, 
+                                          NULL, meas_flags(), 
+                                          packet, packet_len);
 
         // Send data
-        do
-          {
-             err_code = ble_nus_data_send(&m_nus, total_packet_with_index, 
-                                          &total_size_w_index, m_conn_handle);
-             NRF_LOG_INFO("error code: %u", err_code);
-             if ((err_code != NRF_ERROR_INVALID_STATE) &&
-                 (err_code != NRF_ERROR_RESOURCES) &&
-                 (err_code != NRF_ERROR_NOT_FOUND))
-             {
-                
-                    APP_ERROR_CHECK(err_code);              
-             }
-          } while (err_code == NRF_ERROR_RESOURCES);
+        (void)nus_tx_enqueue(packet, packet_len);
           
           if (DISCONN_DELAY) {
               // Delay before disconnecting from central
@@ -2119,8 +5011,7 @@ void send_data_and_restart_timer()
     // Add most recent data to buffer, then send all data in buffer
     else {
         add_data_to_buffers();
-        create_and_send_buffer_primer_packet();
-        SEND_BUFFERED_DATA = true;
+        start_buffered_data_upload();
     }
 
     
@@ -2138,9 +5029,16 @@ void gatt_evt_handler(nrf_ble_gatt_t * p_gatt, nrf_ble_gatt_evt_t const * p_evt)
     {
         m_ble_nus_max_data_len = p_evt->params.att_mtu_effective - OPCODE_LENGTH 
                                                                 - HANDLE_LENGTH;
+        m_link_stats.att_mtu = p_evt->params.att_mtu_effective;
         NRF_LOG_INFO("Data len is set to 0x%X(%d)", m_ble_nus_max_data_len, 
                                                     m_ble_nus_max_data_len);
     }
+    if ((m_conn_handle == p_evt->conn_handle) && 
+        (p_evt->evt_id == NRF_BLE_GATT_EVT_DATA_LENGTH_UPDATED))
+    {
+        m_link_stats.data_length = p_evt->params.data_length;
+        NRF_LOG_INFO("Link layer data length is %d", m_link_stats.data_length);
+    }
     NRF_LOG_DEBUG("ATT MTU exchange completed. central 0x%x peripheral 0x%x",
                   p_gatt->att_mtu_desired_central,
                   p_gatt->att_mtu_desired_periph);  
@@ -2280,6 +5178,11 @@ static void fds_write(float value, uint16_t FILE_ID, uint16_t REC_KEY)
       STAYON_STORED = (float)STAYON_FLAG;
       record.data.p_data = &STAYON_STORED;
     }
+
+    else if(FILE_ID == BROADCAST_FILE_ID && REC_KEY == BROADCAST_REC_KEY) {
+      NRF_LOG_WARNING("Writing BROADCAST to flash...");
+      record.data.p_data = &BROADCAST_STORED;
+    }
     
     ret_code_t ret = fds_record_write(&record_desc, &record);
     if (ret != FDS_SUCCESS){
@@ -2326,6 +5229,10 @@ static void fds_update(float value, uint16_t FILE_ID, uint16_t REC_KEY)
       record.data.p_data = &STAYON_STORED;
       fds_record_find(CURR_STAYON_FILE_ID, CURR_STAYON_REC_KEY, &record_desc, &ftok);
     }
+    else if(FILE_ID == BROADCAST_FILE_ID && REC_KEY == BROADCAST_REC_KEY) {
+      record.data.p_data = &BROADCAST_STORED;
+      fds_record_find(BROADCAST_FILE_ID, BROADCAST_REC_KEY, &record_desc, &ftok);
+    }
                     
     ret_code_t ret = fds_record_update(&record_desc, &record);
     if (ret != FDS_SUCCESS){
@@ -2386,7 +5293,7 @@ float fds_read(uint16_t FILE_ID, uint16_t REC_KEY)
     fds_record_desc_t  record_desc;
     fds_find_token_t    ftok ={0};   //Important, make sure to zero init the ftok token
     float *p_data;
-    float data;
+    float data = 0.0;
     uint32_t err_code;
     
     NRF_LOG_INFO("Start flash search...");
@@ -2486,6 +5393,8 @@ static void check_calibration_state(void)
       NRF_LOG_INFO("RVAL: " PACKET_FLOAT_MARKER " \n", LOG_PACKET_FLOAT(RVAL_CALIBRATION,1));
 
     }
+    // fds_read will return 0 if broadcasting was never turned on
+    BROADCAST_FLAG = float_comp(fds_read(BROADCAST_FILE_ID, BROADCAST_REC_KEY), 1.0);
 }
 
 /* If calibration has already been performed then update existing records with new 
@@ -2548,16 +5457,27 @@ void check_protocol_state(void)
       STAYON_FLAG = false;
 }
 
-void send_next_packet_in_buffer()
+/* Resets buffers, variables, and disconnects once every buffered record
+ * has been sent
+ */
+void check_buffered_data_upload_done(void)
 {
      uint32_t err_code;
-     send_buffered_data();
-     PACK_CTR++;
-     HVN_TX_EVT_COMPLETE = false;
-     // Reset buffers, variables, and disconnect when finished 
-     if (PACK_CTR == TOTAL_DATA_IN_BUFFERS) {
-         reset_data_buffers();
+     if (SEND_BUFFERED_DATA && PACK_CTR == TOTAL_DATA_IN_BUFFERS && m_tx_in_flight == 0) {
+         uint32_t ticks = app_timer_cnt_diff_compute(app_timer_cnt_get(), m_upload_start_ticks);
+         m_link_stats.upload_records = m_upload_records_sent;
+         m_link_stats.upload_ms      = ticks_to_time(ticks, 1000);
+         NRF_LOG_INFO("buffered upload on %d M PHY, %d byte payloads", 
+                      m_link_stats.tx_phy, m_link_stats.data_length);
+         NRF_LOG_INFO("buffered upload: %d records in %d ms, %d records/s", 
+                      m_link_stats.upload_records, m_link_stats.upload_ms,
+                      (m_link_stats.upload_ms > 0) ?
+                      m_upload_records_sent * 1000 / m_link_stats.upload_ms : 0);
+         // Without ACKs, sent readings are freed as before
+         if (!m_hist_ack_mode)
+             reset_data_buffers();
          SEND_BUFFERED_DATA = false;
+         conn_profile_update();
          if (DISCONN_DELAY) {
             // Delay before disconnecting from central
             err_code = app_timer_start(m_timer_disconn_delay, 
@@ -2590,6 +5510,7 @@ int main(void)
 
     log_init();
     power_management_init();
+    scheduler_init();
 
     // Initialize fds and check for calibration values, protocol state
     fds_init_helper();
@@ -2606,13 +5527,12 @@ int main(void)
     conn_params_init();
     peer_manager_init();
 
-    // Init long-term data storage buffers
+    // Init long-term data storage buffers, restore them from flash
     init_data_buffers();
+    hist_log_init();
     
     if (CLIENT_PROTO_FLAG) {
       // Start intermittent data reading <> advertising protocol
-      enable_isfet_circuit();
-      nrf_delay_ms(200);
       enable_pH_voltage_reading();
     }
     else if (DEMO_PROTO_FLAG) {
@@ -2622,14 +5542,9 @@ int main(void)
     // Enter main loop for power management
     while (true)
     {
+        app_sched_execute();
+        meas_evt_lost_check();
         idle_state_handle();
-        // If data has been buffered then send accordingly, 
-        // waiting for BLE_GATTS_EVT_HVN_TX_COMPLETE in 
-        // between packets so the tx buffer is not filled
-        if (SEND_BUFFERED_DATA) {
-            while(HVN_TX_EVT_COMPLETE == false) { break; }
-            send_next_packet_in_buffer();
-        }
     } 
 }
 
@@ -4444,9 +4444,9 @@
 
 // <e> TIMER_ENABLED - nrf_drv_timer - TIMER periperal driver - legacy layer
 //==========================================================
-//#ifndef TIMER_ENABLED
-//#define TIMER_ENABLED 1
-//#endif
+#ifndef TIMER_ENABLED
+#define TIMER_ENABLED 1
+#endif
 // <o> TIMER_DEFAULT_CONFIG_FREQUENCY  - Timer frequency if in Timer mode
 
 // <0=> 16 MHz
@@ -4503,7 +4503,7 @@
 // <q> TIMER0_ENABLED  - Enable TIMER0 instance
 
 #ifndef TIMER0_ENABLED
-#define TIMER0_ENABLED 1
+#define TIMER0_ENABLED 0
 #endif
 
 // <q> TIMER1_ENABLED  - Enable TIMER1 instance
@@ -0,0 +1,68 @@
+/* Fakes of the SDK and SoftDevice used by the host tests, see sdk_fakes.c.
+ * All of them are weak, a test can replace any of them with its own
+ */
+#ifndef FAKES_H
+#define FAKES_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdk_stub.h"
+
+/* app_scheduler: events are copied into a FIFO of fake_sched_capacity
+ * entries and run by app_sched_execute()
+ */
+#define FAKE_SCHED_MAX          32
+#define FAKE_SCHED_DATA_MAX     32
+extern uint16_t fake_sched_capacity;
+uint16_t fake_sched_pending(void);
+
+/* app_timer: the counter is set by the test, timers only remember whether
+ * they run
+ */
+extern uint32_t fake_timer_ticks;
+bool fake_timer_running(app_timer_id_t id);
+
+/* ble_nus_data_send() takes one of fake_nus_credits per notification and
+ * keeps a copy of the last FAKE_NUS_LOG ones in fake_nus_log
+ */
+#define FAKE_NUS_LOG            256
+#define FAKE_NUS_MAX_LEN        256
+typedef struct
+{
+    uint16_t len;
+    uint8_t  data[FAKE_NUS_MAX_LEN];
+} fake_nus_packet_t;
+extern uint32_t          fake_nus_credits;
+extern fake_nus_packet_t fake_nus_log[FAKE_NUS_LOG];
+extern uint32_t          fake_nus_sent;
+
+/* nrfx_saadc_sample_convert() returns fake_saadc_code */
+extern int16_t fake_saadc_code;
+
+/* fstorage backed by fake_flash, which covers FAKE_FLASH_START up to the
+ * end of the nRF52810 flash. Operations are queued like the SoftDevice
+ * backend does and only run, in order, from fake_flash_run(). Each one can
+ * be made to fail, and fake_flash_on_op sees every operation that ran.
+ * fake_flash_on_queue can run those queued earlier each time another one
+ * is queued, as if their events interrupted the caller
+ */
+#define FAKE_FLASH_START        0x2B000
+#define FAKE_FLASH_END          0x30000
+#define FAKE_FLASH_QUEUE        16
+typedef struct
+{
+    bool             erase;
+    uint32_t         addr;
+    uint32_t         len;
+    uint8_t const *  p_data;     // written bytes, NULL for an erase
+    ret_code_t       result;
+} fake_flash_op_t;
+extern uint8_t  fake_flash[FAKE_FLASH_END - FAKE_FLASH_START];
+extern uint32_t fake_flash_fail;           // operations still to fail
+extern void  (* fake_flash_on_op)(fake_flash_op_t const * p_op);
+extern void  (* fake_flash_on_queue)(void);  // before an operation is queued
+void     fake_flash_erase_all(void);
+uint32_t fake_flash_pending(void);
+void     fake_flash_run(void);
+
+#endif
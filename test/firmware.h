@@ -0,0 +1,11 @@
+/* Builds the firmware into a test, so the test can reach its static
+ * functions and state. main() becomes firmware_main()
+ */
+#ifndef FIRMWARE_H
+#define FIRMWARE_H
+
+#define main firmware_main
+#include "../main.c"
+#undef main
+
+#endif
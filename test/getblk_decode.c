@@ -0,0 +1,131 @@
+/* Reference decoder of the "GETBLK" transfer, see getblk_decode.h
+ */
+#include <stdio.h>
+#include <string.h>
+#include "getblk_decode.h"
+
+#define BLK_TAG_DATA            0xDA7A0000
+#define BLK_TAG_MASK            0xFFFF0000
+#define BLK_MAX_COUNT           32
+#define BLK_FLAG_BITS           3
+#define BLK_CODE_CLASSES        5
+
+static uint8_t const code_bits[BLK_CODE_CLASSES] = {2, 4, 6, 12, 32};
+
+static uint32_t word_le(uint8_t const * p)
+{
+    return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Reads bits bits, least significant first. Returns false past end
+static bool bits_get(uint8_t const * p_in, uint32_t * p_pos, uint32_t end, uint8_t bits,
+                     uint32_t * p_value)
+{
+    uint32_t value = 0;
+
+    for (uint8_t i = 0; i < bits; i++, (*p_pos)++) {
+        if (*p_pos >= end)
+            return false;
+        if (p_in[*p_pos >> 3] & (1 << (*p_pos & 7)))
+            value |= 1UL << i;
+    }
+    *p_value = value;
+    return true;
+}
+
+// Reads one code: a prefix of up to 5 ones ended by a zero, then z
+static bool code_get(uint8_t const * p_in, uint32_t * p_pos, uint32_t end, uint32_t * p_z)
+{
+    uint32_t bit = 1;
+    uint8_t  ones = 0;
+
+    while (ones < BLK_CODE_CLASSES) {
+        if (!bits_get(p_in, p_pos, end, 1, &bit))
+            return false;
+        if (!bit)
+            break;
+        ones++;
+    }
+    if (ones == 0) {
+        *p_z = 0;
+        return true;
+    }
+    return bits_get(p_in, p_pos, end, code_bits[ones - 1], p_z);
+}
+
+static int32_t unzigzag(uint32_t value)
+{
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+void getblk_start(getblk_session_t * p_session)
+{
+    memset(p_session, 0, sizeof(*p_session));
+}
+
+static int decode_block(getblk_session_t * p_session, uint8_t const * p_data, uint16_t len,
+                        getblk_reading_t * p_out, uint32_t max)
+{
+    uint32_t        header, seq, count, payload_len;
+    int32_t         field[4] = {0, 0, 0, 0};
+    uint32_t        pos = 0;
+    int             n = 0;
+
+    if (len < 8)
+        return GETBLK_ERROR;
+    header      = word_le(p_data);
+    seq         = word_le(p_data + 4);
+    count       = header & 0xFF;
+    payload_len = (header >> 8) & 0xFF;
+    if ((header & BLK_TAG_MASK) != BLK_TAG_DATA || count == 0 || count > BLK_MAX_COUNT ||
+        len != 8 + ((payload_len + 3) & ~3u))
+        return GETBLK_ERROR;
+
+    for (uint32_t i = 0; i < count; i++, seq++) {
+        for (int f = 0; f < 4; f++) {
+            uint32_t z;
+
+            if (!code_get(p_data + 8, &pos, payload_len * 8, &z))
+                return GETBLK_ERROR;
+            field[f] += unzigzag(z);
+        }
+        if (seq < p_session->first_seq)
+            continue;
+        if ((uint32_t)n == max)
+            return GETBLK_ERROR;
+        p_out[n].seq     = seq;
+        p_out[n].ph_mv   = (uint16_t)field[0];
+        p_out[n].temp_mv = (uint16_t)field[1];
+        p_out[n].batt_mv = (uint16_t)field[2];
+        p_out[n].dt      = (uint8_t)(field[3] >> BLK_FLAG_BITS);
+        p_out[n].flags   = (uint8_t)(field[3] & ((1 << BLK_FLAG_BITS) - 1));
+        n++;
+    }
+    // Only the padding of the last byte may be left
+    return ((pos + 7) / 8 == payload_len) ? n : GETBLK_ERROR;
+}
+
+int getblk_decode(getblk_session_t * p_session, uint8_t const * p_data, uint16_t len,
+                  getblk_reading_t * p_out, uint32_t max)
+{
+    char line[48];
+
+    if (p_session->done)
+        return GETBLK_ERROR;
+    if (!p_session->started) {
+        if (len >= sizeof(line) || len < 4 || memcmp(p_data, "BLK,", 4) != 0)
+            return GETBLK_ERROR;
+        memcpy(line, p_data, len);
+        line[len] = '\0';
+        if (sscanf(line, "BLK,%u,%u,%u", &p_session->first_seq, &p_session->first_index,
+                   &p_session->end_seq) != 3)
+            return GETBLK_ERROR;
+        p_session->started = true;
+        return 0;
+    }
+    if (len == 7 && memcmp(p_data, "BLKEND\n", 7) == 0) {
+        p_session->done = true;
+        return 0;
+    }
+    return decode_block(p_session, p_data, len, p_out, max);
+}
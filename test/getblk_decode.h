@@ -0,0 +1,48 @@
+/* Reference decoder of the "GETBLK" transfer, for centrals and host tools.
+ * It does not use the firmware, only the format documented with the
+ * History log and check_for_block_request() in main.c:
+ *
+ *   "BLK,<first seq>,<first index>,<end seq>\n"
+ *   one notification per stored block, without its last word
+ *   "BLKEND\n"
+ *
+ * Feed every notification of the transfer to getblk_decode() in order.
+ * Readings below <first seq> were freed on the device and are dropped
+ */
+#ifndef GETBLK_DECODE_H
+#define GETBLK_DECODE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define GETBLK_ERROR            (-1)
+
+typedef struct
+{
+    uint32_t seq;               // log sequence number
+    uint16_t ph_mv;
+    uint16_t temp_mv;
+    uint16_t batt_mv;
+    uint8_t  dt;                // time delta in units of 10 s
+    uint8_t  flags;             // bit 0 temperature, bit 1 battery reused, bit 2 early
+} getblk_reading_t;
+
+typedef struct
+{
+    bool     started;           // "BLK" reply seen
+    bool     done;              // "BLKEND" seen
+    uint32_t first_seq;
+    uint32_t first_index;       // packet index of first_seq, for ACK_nnn
+    uint32_t end_seq;           // readings from here on are not in a block
+} getblk_session_t;
+
+void getblk_start(getblk_session_t * p_session);
+
+/* Decodes one notification. Returns the number of readings stored in
+ * p_out (at most max), or GETBLK_ERROR if the packet is malformed or not
+ * expected at this point of the transfer
+ */
+int getblk_decode(getblk_session_t * p_session, uint8_t const * p_data, uint16_t len,
+                  getblk_reading_t * p_out, uint32_t max);
+
+#endif
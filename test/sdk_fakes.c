@@ -0,0 +1,405 @@
+/* Weak fakes of every SDK and SoftDevice function main.c calls, for the
+ * host tests. Most do nothing and report success. The scheduler, the NUS
+ * notifications, nrf_queue and fstorage behave like the real ones closely
+ * enough to run the firmware code on top of them, see fakes.h
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fakes.h"
+
+#define FAKE __attribute__((weak))
+
+nrf_fstorage_api_t nrf_fstorage_sd;
+
+FAKE void app_error_handler(uint32_t error_code, uint32_t line_num, const uint8_t * p_file_name)
+{
+    fprintf(stderr, "%s:%u: APP_ERROR_CHECK failed with 0x%x\n", 
+            (char const *)p_file_name, line_num, error_code);
+    abort();
+}
+
+FAKE void stub_log(const char * p_fmt, ...)
+{
+    va_list args;
+
+    if (getenv("TEST_LOG") == NULL)
+        return;
+    va_start(args, p_fmt);
+    vprintf(p_fmt, args);
+    va_end(args);
+    printf("\n");
+}
+
+/* app_scheduler */
+typedef struct
+{
+    app_sched_event_handler_t handler;
+    uint16_t                  size;
+    uint8_t                   data[FAKE_SCHED_DATA_MAX];
+} fake_sched_evt_t;
+
+uint16_t                fake_sched_capacity = FAKE_SCHED_MAX;
+static fake_sched_evt_t m_sched[FAKE_SCHED_MAX];
+static uint16_t         m_sched_head = 0;
+static uint16_t         m_sched_cnt  = 0;
+
+uint16_t fake_sched_pending(void)
+{
+    return m_sched_cnt;
+}
+
+FAKE uint32_t app_sched_event_put(void const * p_data, uint16_t size, app_sched_event_handler_t handler)
+{
+    fake_sched_evt_t * p_evt;
+
+    if (m_sched_cnt >= fake_sched_capacity || m_sched_cnt >= FAKE_SCHED_MAX)
+        return NRF_ERROR_NO_MEM;
+    if (size > FAKE_SCHED_DATA_MAX)
+        return NRF_ERROR_INVALID_LENGTH;
+    p_evt = &m_sched[(m_sched_head + m_sched_cnt++) % FAKE_SCHED_MAX];
+    p_evt->handler = handler;
+    p_evt->size    = size;
+    if (size > 0)
+        memcpy(p_evt->data, p_data, size);
+    return NRF_SUCCESS;
+}
+
+FAKE void app_sched_execute(void)
+{
+    while (m_sched_cnt > 0) {
+        fake_sched_evt_t evt = m_sched[m_sched_head];
+
+        m_sched_head = (m_sched_head + 1) % FAKE_SCHED_MAX;
+        m_sched_cnt--;
+        evt.handler(evt.size > 0 ? evt.data : NULL, evt.size);
+    }
+}
+
+/* app_timer */
+#define FAKE_TIMERS 16
+
+uint32_t              fake_timer_ticks = 0;
+static app_timer_id_t m_timer_id[FAKE_TIMERS];
+static bool           m_timer_running[FAKE_TIMERS];
+
+static bool * fake_timer_slot(app_timer_id_t id)
+{
+    for (int i = 0; i < FAKE_TIMERS; i++) {
+        if (m_timer_id[i] == id || m_timer_id[i] == NULL) {
+            m_timer_id[i] = id;
+            return &m_timer_running[i];
+        }
+    }
+    abort();
+}
+
+bool fake_timer_running(app_timer_id_t id)
+{
+    return *fake_timer_slot(id);
+}
+
+FAKE ret_code_t app_timer_start(app_timer_id_t id, uint32_t ticks, void * p_context)
+{
+    *fake_timer_slot(id) = true;
+    return NRF_SUCCESS;
+}
+
+FAKE ret_code_t app_timer_stop(app_timer_id_t id)
+{
+    *fake_timer_slot(id) = false;
+    return NRF_SUCCESS;
+}
+
+FAKE uint32_t app_timer_cnt_get(void)
+{
+    return fake_timer_ticks;
+}
+
+FAKE uint32_t app_timer_cnt_diff_compute(uint32_t to, uint32_t from)
+{
+    return (to - from) & APP_TIMER_MAX_CNT_VAL;
+}
+
+/* Notifications */
+uint32_t          fake_nus_credits = UINT32_MAX;
+fake_nus_packet_t fake_nus_log[FAKE_NUS_LOG];
+uint32_t          fake_nus_sent    = 0;
+
+FAKE uint32_t ble_nus_data_send(ble_nus_t * p_nus, uint8_t * p_data, uint16_t * p_length, uint16_t conn_handle)
+{
+    fake_nus_packet_t * p_packet = &fake_nus_log[fake_nus_sent % FAKE_NUS_LOG];
+
+    if (fake_nus_credits == 0)
+        return NRF_ERROR_RESOURCES;
+    if (*p_length > FAKE_NUS_MAX_LEN)
+        return NRF_ERROR_INVALID_PARAM;
+    fake_nus_credits--;
+    p_packet->len = *p_length;
+    memcpy(p_packet->data, p_data, *p_length);
+    fake_nus_sent++;
+    return NRF_SUCCESS;
+}
+
+/* SAADC */
+int16_t fake_saadc_code = 0;
+
+FAKE ret_code_t nrfx_saadc_sample_convert(uint8_t channel, nrf_saadc_value_t * p_value)
+{
+    *p_value = fake_saadc_code;
+    return NRF_SUCCESS;
+}
+
+FAKE bool nrf_saadc_event_check(nrf_saadc_event_t event)
+{
+    return true;
+}
+
+/* nrf_queue, FIFO of size elements in size + 1 slots */
+FAKE ret_code_t nrf_queue_push(nrf_queue_t const * p_queue, void const * p_element)
+{
+    nrf_queue_cb_t * p_cb   = p_queue->p_cb;
+    size_t           next   = (p_cb->back + 1) % (p_queue->size + 1);
+
+    if (next == p_cb->front)
+        return NRF_ERROR_NO_MEM;
+    memcpy((uint8_t *)p_queue->p_buffer + p_cb->back * p_queue->element_size, 
+           p_element, p_queue->element_size);
+    p_cb->back = next;
+    return NRF_SUCCESS;
+}
+
+FAKE ret_code_t nrf_queue_peek(nrf_queue_t const * p_queue, void * p_element)
+{
+    nrf_queue_cb_t * p_cb = p_queue->p_cb;
+
+    if (p_cb->front == p_cb->back)
+        return NRF_ERROR_NOT_FOUND;
+    memcpy(p_element, (uint8_t *)p_queue->p_buffer + p_cb->front * p_queue->element_size, 
+           p_queue->element_size);
+    return NRF_SUCCESS;
+}
+
+FAKE ret_code_t nrf_queue_pop(nrf_queue_t const * p_queue, void * p_element)
+{
+    ret_code_t err_code = nrf_queue_peek(p_queue, p_element);
+
+    if (err_code == NRF_SUCCESS)
+        p_queue->p_cb->front = (p_queue->p_cb->front + 1) % (p_queue->size + 1);
+    return err_code;
+}
+
+FAKE bool nrf_queue_is_empty(nrf_queue_t const * p_queue)
+{
+    return p_queue->p_cb->front == p_queue->p_cb->back;
+}
+
+FAKE void nrf_queue_reset(nrf_queue_t const * p_queue)
+{
+    p_queue->p_cb->front = 0;
+    p_queue->p_cb->back  = 0;
+}
+
+/* fstorage */
+typedef struct
+{
+    nrf_fstorage_t const * p_fs;
+    nrf_fstorage_evt_t     evt;
+} fake_flash_req_t;
+
+uint8_t  fake_flash[FAKE_FLASH_END - FAKE_FLASH_START];
+uint32_t fake_flash_fail = 0;
+void  (* fake_flash_on_op)(fake_flash_op_t const * p_op) = NULL;
+void  (* fake_flash_on_queue)(void) = NULL;
+
+static fake_flash_req_t m_flash_req[FAKE_FLASH_QUEUE];
+static uint32_t         m_flash_head = 0;
+static uint32_t         m_flash_cnt  = 0;
+
+void fake_flash_erase_all(void)
+{
+    memset(fake_flash, 0xFF, sizeof(fake_flash));
+}
+
+// Flash starts out erased
+__attribute__((constructor)) static void fake_flash_init(void)
+{
+    fake_flash_erase_all();
+}
+
+uint32_t fake_flash_pending(void)
+{
+    return m_flash_cnt;
+}
+
+static ret_code_t fake_flash_queue(nrf_fstorage_t const * p_fs, nrf_fstorage_evt_id_t id, 
+                                   uint32_t addr, void const * p_src, uint32_t len, void * p_param)
+{
+    fake_flash_req_t * p_req;
+
+    if (fake_flash_on_queue != NULL)
+        fake_flash_on_queue();
+    if (addr < FAKE_FLASH_START || addr + len > FAKE_FLASH_END || (addr & 3) || (len & 3))
+        return NRF_ERROR_INVALID_PARAM;
+    if (m_flash_cnt >= FAKE_FLASH_QUEUE)
+        return NRF_ERROR_NO_MEM;
+    p_req = &m_flash_req[(m_flash_head + m_flash_cnt++) % FAKE_FLASH_QUEUE];
+    p_req->p_fs        = p_fs;
+    p_req->evt.id      = id;
+    p_req->evt.result  = NRF_SUCCESS;
+    p_req->evt.addr    = addr;
+    p_req->evt.p_src   = p_src;
+    p_req->evt.len     = len;
+    p_req->evt.p_param = p_param;
+    return NRF_SUCCESS;
+}
+
+// Runs the queued operations, and those queued by their handlers, in order
+void fake_flash_run(void)
+{
+    uint32_t ops = 0;
+
+    while (m_flash_cnt > 0) {
+        fake_flash_req_t req = m_flash_req[m_flash_head];
+        fake_flash_op_t  op;
+
+        m_flash_head = (m_flash_head + 1) % FAKE_FLASH_QUEUE;
+        m_flash_cnt--;
+        if (++ops > 100000) {
+            fprintf(stderr, "fake_flash_run: operations never stop\n");
+            abort();
+        }
+        op.erase  = (req.evt.id == NRF_FSTORAGE_EVT_ERASE_RESULT);
+        op.addr   = req.evt.addr;
+        op.len    = req.evt.len;
+        op.p_data = op.erase ? NULL : req.evt.p_src;
+        op.result = NRF_SUCCESS;
+        if (fake_flash_fail > 0) {
+            fake_flash_fail--;
+            op.result = NRF_ERROR_INTERNAL;
+        }
+        else if (op.erase)
+            memset(&fake_flash[op.addr - FAKE_FLASH_START], 0xFF, op.len);
+        else {
+            // Programming can only clear bits
+            for (uint32_t i = 0; i < op.len; i++)
+                fake_flash[op.addr - FAKE_FLASH_START + i] &= op.p_data[i];
+        }
+        if (fake_flash_on_op != NULL)
+            fake_flash_on_op(&op);
+        req.evt.result = op.result;
+        req.p_fs->evt_handler(&req.evt);
+    }
+}
+
+FAKE ret_code_t nrf_fstorage_init(nrf_fstorage_t * p_fs, nrf_fstorage_api_t * p_api, void * p_param)
+{
+    return NRF_SUCCESS;
+}
+
+FAKE ret_code_t nrf_fstorage_read(nrf_fstorage_t const * p_fs, uint32_t addr, void * p_dest, uint32_t len)
+{
+    if (addr < FAKE_FLASH_START || addr + len > FAKE_FLASH_END)
+        return NRF_ERROR_INVALID_PARAM;
+    memcpy(p_dest, &fake_flash[addr - FAKE_FLASH_START], len);
+    return NRF_SUCCESS;
+}
+
+FAKE ret_code_t nrf_fstorage_write(nrf_fstorage_t const * p_fs, uint32_t addr, void const * p_src, 
+                                   uint32_t len, void * p_param)
+{
+    return fake_flash_queue(p_fs, NRF_FSTORAGE_EVT_WRITE_RESULT, addr, p_src, len, p_param);
+}
+
+FAKE ret_code_t nrf_fstorage_erase(nrf_fstorage_t const * p_fs, uint32_t page_addr, uint32_t len, 
+                                   void * p_param)
+{
+    return fake_flash_queue(p_fs, NRF_FSTORAGE_EVT_ERASE_RESULT, page_addr, NULL, len * 4096, p_param);
+}
+
+/* Everything else succeeds and does nothing */
+FAKE ret_code_t app_timer_create(app_timer_id_t const * a0, app_timer_mode_t a1, app_timer_timeout_handler_t a2) { return 0; }
+FAKE ret_code_t app_timer_init(void) { return 0; }
+FAKE ret_code_t ble_advertising_advdata_update(ble_advertising_t * a0, ble_advdata_t const * a1, ble_advdata_t const * a2) { return 0; }
+FAKE void ble_advertising_conn_cfg_tag_set(ble_advertising_t * a0, uint8_t a1) { }
+FAKE uint32_t ble_advertising_init(ble_advertising_t * a0, ble_advertising_init_t const * a1) { return 0; }
+FAKE uint32_t ble_advertising_start(ble_advertising_t * a0, ble_adv_mode_t a1) { return 0; }
+FAKE uint32_t ble_conn_params_change_conn_params(uint16_t a0, ble_gap_conn_params_t * a1) { return 0; }
+FAKE uint32_t ble_conn_params_init(ble_conn_params_init_t const * a0) { return 0; }
+FAKE uint32_t ble_nus_init(ble_nus_t * a0, ble_nus_init_t const * a1) { return 0; }
+FAKE ret_code_t fds_gc(void) { return 0; }
+FAKE ret_code_t fds_init(void) { return 0; }
+FAKE ret_code_t fds_record_close(fds_record_desc_t * a0) { return 0; }
+FAKE ret_code_t fds_record_delete(fds_record_desc_t * a0) { return 0; }
+FAKE ret_code_t fds_record_find(uint16_t a0, uint16_t a1, fds_record_desc_t * a2, fds_find_token_t * a3) { return 0; }
+FAKE ret_code_t fds_record_open(fds_record_desc_t * a0, fds_flash_record_t * a1) { return 0; }
+FAKE ret_code_t fds_record_update(fds_record_desc_t * a0, fds_record_t const * a1) { return 0; }
+FAKE ret_code_t fds_record_write(fds_record_desc_t * a0, fds_record_t const * a1) { return 0; }
+FAKE ret_code_t fds_register(fds_cb_t a0) { return 0; }
+FAKE ret_code_t fds_stat(fds_stat_t * a0) { return 0; }
+FAKE ret_code_t nrf_ble_gatt_att_mtu_periph_set(nrf_ble_gatt_t * a0, uint16_t a1) { return 0; }
+FAKE ret_code_t nrf_ble_gatt_init(nrf_ble_gatt_t * a0, nrf_ble_gatt_evt_handler_t a1) { return 0; }
+FAKE ret_code_t nrf_ble_qwr_conn_handle_assign(nrf_ble_qwr_t * a0, uint16_t a1) { return 0; }
+FAKE ret_code_t nrf_ble_qwr_init(nrf_ble_qwr_t * a0, nrf_ble_qwr_init_t const * a1) { return 0; }
+FAKE void nrf_delay_ms(uint32_t a0) { }
+FAKE ret_code_t nrf_drv_gpiote_init(void) { return 0; }
+FAKE bool nrf_drv_gpiote_is_init(void) { return false; }
+FAKE ret_code_t nrf_drv_gpiote_out_init(uint32_t a0, nrf_drv_gpiote_out_config_t const * a1) { return 0; }
+FAKE void nrf_drv_gpiote_out_set(uint32_t a0) { }
+FAKE ret_code_t nrf_drv_rng_init(void * a0) { return 0; }
+FAKE ret_code_t nrf_drv_rng_rand(uint8_t * a0, uint8_t a1) { return 0; }
+FAKE ret_code_t nrf_drv_saadc_buffer_convert(nrf_saadc_value_t * a0, uint16_t a1) { return 0; }
+FAKE ret_code_t nrf_drv_saadc_channel_init(uint8_t a0, nrf_saadc_channel_config_t const * a1) { return 0; }
+FAKE ret_code_t nrf_drv_saadc_init(nrf_drv_saadc_config_t const * a0, nrfx_saadc_event_handler_t a1) { return 0; }
+FAKE uint32_t nrf_drv_saadc_sample_task_get(void) { return 0; }
+FAKE void nrf_drv_timer_clear(nrf_drv_timer_t const * a0) { }
+FAKE void nrf_drv_timer_compare(nrf_drv_timer_t const * a0, nrf_timer_cc_channel_t a1, uint32_t a2, bool a3) { }
+FAKE uint32_t nrf_drv_timer_compare_event_address_get(nrf_drv_timer_t const * a0, uint32_t a1) { return 0; }
+FAKE void nrf_drv_timer_disable(nrf_drv_timer_t const * a0) { }
+FAKE void nrf_drv_timer_enable(nrf_drv_timer_t const * a0) { }
+FAKE ret_code_t nrf_drv_timer_init(nrf_drv_timer_t const * a0, nrf_drv_timer_config_t const * a1, nrfx_timer_event_handler_t a2) { return 0; }
+FAKE uint32_t nrf_drv_timer_ms_to_ticks(nrf_drv_timer_t const * a0, uint32_t a1) { return 0; }
+FAKE uint32_t nrf_drv_timer_task_address_get(nrf_drv_timer_t const * a0, nrf_timer_task_t a1) { return 0; }
+FAKE uint32_t nrf_drv_timer_us_to_ticks(nrf_drv_timer_t const * a0, uint32_t a1) { return 0; }
+FAKE ret_code_t nrf_pwr_mgmt_init(void) { return 0; }
+FAKE void nrf_pwr_mgmt_run(void) { }
+FAKE void nrf_saadc_event_clear(nrf_saadc_event_t a0) { }
+FAKE void nrf_saadc_task_trigger(nrf_saadc_task_t a0) { }
+FAKE ret_code_t nrf_sdh_ble_default_cfg_set(uint8_t a0, uint32_t * a1) { return 0; }
+FAKE ret_code_t nrf_sdh_ble_enable(uint32_t * a0) { return 0; }
+FAKE ret_code_t nrf_sdh_enable_request(void) { return 0; }
+FAKE void nrfx_gpiote_clr_task_trigger(uint32_t a0) { }
+FAKE void nrfx_gpiote_out_clear(uint32_t a0) { }
+FAKE void nrfx_gpiote_out_task_disable(uint32_t a0) { }
+FAKE void nrfx_gpiote_out_task_enable(uint32_t a0) { }
+FAKE void nrfx_gpiote_out_uninit(uint32_t a0) { }
+FAKE uint32_t nrfx_gpiote_set_task_addr_get(uint32_t a0) { return 0; }
+FAKE void nrfx_gpiote_set_task_trigger(uint32_t a0) { }
+FAKE void nrfx_gpiote_uninit(void) { }
+FAKE ret_code_t nrfx_ppi_channel_alloc(nrf_ppi_channel_t * a0) { return 0; }
+FAKE ret_code_t nrfx_ppi_channel_assign(nrf_ppi_channel_t a0, uint32_t a1, uint32_t a2) { return 0; }
+FAKE ret_code_t nrfx_ppi_channel_disable(nrf_ppi_channel_t a0) { return 0; }
+FAKE ret_code_t nrfx_ppi_channel_enable(nrf_ppi_channel_t a0) { return 0; }
+FAKE ret_code_t nrfx_ppi_channel_fork_assign(nrf_ppi_channel_t a0, uint32_t a1) { return 0; }
+FAKE ret_code_t nrfx_ppi_channel_include_in_group(nrf_ppi_channel_t a0, nrf_ppi_channel_group_t a1) { return 0; }
+FAKE ret_code_t nrfx_ppi_group_alloc(nrf_ppi_channel_group_t * a0) { return 0; }
+FAKE ret_code_t nrfx_ppi_group_disable(nrf_ppi_channel_group_t a0) { return 0; }
+FAKE uint32_t nrfx_ppi_task_addr_group_enable_get(nrf_ppi_channel_group_t a0) { return 0; }
+FAKE ret_code_t nrfx_saadc_calibrate_offset(void) { return 0; }
+FAKE bool nrfx_saadc_is_busy(void) { return false; }
+FAKE void nrfx_saadc_uninit(void) { }
+FAKE void pm_conn_sec_config_reply(uint16_t a0, pm_conn_sec_config_t * a1) { }
+FAKE void pm_handler_flash_clean(pm_evt_t const * a0) { }
+FAKE void pm_handler_on_pm_evt(pm_evt_t const * a0) { }
+FAKE ret_code_t pm_init(void) { return 0; }
+FAKE ret_code_t pm_peers_delete(void) { return 0; }
+FAKE ret_code_t pm_register(void (* a0)(pm_evt_t const*)) { return 0; }
+FAKE ret_code_t pm_sec_params_set(ble_gap_sec_params_t * a0) { return 0; }
+FAKE uint32_t sd_ble_cfg_set(uint32_t a0, ble_cfg_t const * a1, uint32_t a2) { return 0; }
+FAKE uint32_t sd_ble_gap_adv_stop(uint8_t a0) { return 0; }
+FAKE uint32_t sd_ble_gap_device_name_set(ble_gap_conn_sec_mode_t const * a0, uint8_t const * a1, uint16_t a2) { return 0; }
+FAKE uint32_t sd_ble_gap_disconnect(uint16_t a0, uint8_t a1) { return 0; }
+FAKE uint32_t sd_ble_gap_phy_update(uint16_t a0, ble_gap_phys_t const * a1) { return 0; }
+FAKE uint32_t sd_ble_gap_ppcp_set(ble_gap_conn_params_t const * a0) { return 0; }
+FAKE uint32_t sd_ble_gap_tx_power_set(uint8_t a0, uint16_t a1, int8_t a2) { return 0; }
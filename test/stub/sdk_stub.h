@@ -0,0 +1,407 @@
+/* Host stand-ins for the nRF5 SDK 15.2 and S112 declarations main.c uses.
+ * Only the types, constants and prototypes are declared here, the functions
+ * are faked in ../sdk_fakes.c. Every SDK header main.c includes is a one
+ * line file in this directory that includes this one
+ */
+#ifndef SDK_STUB_H
+#define SDK_STUB_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "sdk_config.h"
+
+typedef uint32_t ret_code_t;
+#define NRF_SUCCESS 0
+#define NRF_ERROR_BASE_NUM 0
+#define NRF_ERROR_INTERNAL 3
+#define NRF_ERROR_NO_MEM 4
+#define NRF_ERROR_NOT_FOUND 5
+#define NRF_ERROR_NOT_SUPPORTED 6
+#define NRF_ERROR_INVALID_PARAM 7
+#define NRF_ERROR_INVALID_STATE 8
+#define NRF_ERROR_INVALID_LENGTH 9
+#define NRF_ERROR_BUSY 17
+#define NRF_ERROR_RESOURCES 19
+#define BLE_ERROR_GATTS_SYS_ATTR_MISSING 0x3401
+
+#define APP_ERROR_CHECK(x) do { uint32_t _e = (x); if (_e != NRF_SUCCESS) app_error_handler(_e, __LINE__, (const uint8_t*)__FILE__); } while (0)
+#define APP_ERROR_HANDLER(x) app_error_handler((x), __LINE__, (const uint8_t*)__FILE__)
+void app_error_handler(uint32_t, uint32_t, const uint8_t*);
+#define UNUSED_RETURN_VALUE(x) (void)(x)
+#define UNUSED_PARAMETER(x) (void)(x)
+#define UNUSED_VARIABLE(x) (void)(x)
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define ARRAY_SIZE(a) (sizeof(a)/sizeof((a)[0]))
+#define STATIC_ASSERT(x) _Static_assert(x, #x)
+#define CRITICAL_REGION_ENTER() {
+#define CRITICAL_REGION_EXIT() }
+#define NVIC_ClearPendingIRQ(x) (void)(x)
+#define SAADC_IRQn 7
+#define MSEC_TO_UNITS(t, u) (((t) * 1000) / (u))
+#define UNIT_0_625_MS 625
+#define UNIT_1_25_MS 1250
+#define UNIT_10_MS 10000
+#define ROUNDED_DIV(a,b) (((a) + ((b)/2)) / (b))
+#define CEIL_DIV(a,b) (((a) + (b) - 1) / (b))
+static inline uint8_t uint16_encode(uint16_t v, uint8_t *p){p[0]=v;p[1]=v>>8;return 2;}
+static inline uint8_t uint32_encode(uint32_t v, uint8_t *p){p[0]=v;p[1]=v>>8;p[2]=v>>16;p[3]=v>>24;return 4;}
+static inline uint16_t uint16_decode(const uint8_t *p){return p[0]|(p[1]<<8);}
+void __WFE(void); void __SEV(void);
+
+/* log */
+void stub_log(const char *, ...);
+#define NRF_LOG_INFO(...) stub_log(__VA_ARGS__)
+#define NRF_LOG_DEBUG(...) stub_log(__VA_ARGS__)
+#define NRF_LOG_WARNING(...) stub_log(__VA_ARGS__)
+#define NRF_LOG_ERROR(...) stub_log(__VA_ARGS__)
+#define NRF_LOG_HEXDUMP_DEBUG(p, l) stub_log("", p, l)
+#define NRF_LOG_FLUSH() stub_log("")
+#define NRF_LOG_PROCESS() 0
+#define NRF_LOG_INIT(x) 0
+#define NRF_LOG_DEFAULT_BACKENDS_INIT() stub_log("")
+#define NRF_LOG_FLOAT_MARKER "%s%d.%02d"
+#define NRF_LOG_FLOAT(v) "", (int)(v), (int)(v)
+ret_code_t nrf_pwr_mgmt_init(void);
+void nrf_pwr_mgmt_run(void);
+void nrf_delay_ms(uint32_t); void nrf_delay_us(uint32_t);
+
+/* ble common */
+#define BLE_CONN_HANDLE_INVALID 0xFFFF
+#define BLE_GATT_ATT_MTU_DEFAULT 23
+#define BLE_GATT_HANDLE_INVALID 0
+#define OPCODE_LENGTH 1
+#define BLE_NUS_MAX_DATA_LEN (NRF_SDH_BLE_GATT_MAX_MTU_SIZE - 3)
+#define HANDLE_LENGTH 2
+#define BLE_UUID_TYPE_VENDOR_BEGIN 2
+#define BLE_UUID_NUS_SERVICE 1
+#define BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION 0x13
+#define BLE_HCI_CONNECTION_TIMEOUT 0x08
+#define BLE_HCI_CONN_INTERVAL_UNACCEPTABLE 0x3B
+#define BLE_HCI_STATUS_CODE_SUCCESS 0
+#define BLE_HCI_UNSUPPORTED_REMOTE_FEATURE 0x1A
+typedef struct { uint16_t uuid; uint8_t type; } ble_uuid_t;
+typedef struct { uint16_t min_conn_interval, max_conn_interval, slave_latency, conn_sup_timeout; } ble_gap_conn_params_t;
+typedef struct { uint8_t sm:4, lv:4; } ble_gap_conn_sec_mode_t;
+#define BLE_GAP_CONN_SEC_MODE_SET_OPEN(p) do{(p)->sm=1;(p)->lv=1;}while(0)
+typedef struct { uint8_t tx_phys, rx_phys; } ble_gap_phys_t;
+#define BLE_GAP_PHY_AUTO 0
+#define BLE_GAP_PHY_1MBPS 1
+#define BLE_GAP_PHY_2MBPS 2
+typedef struct { uint16_t max_tx_octets, max_rx_octets, max_tx_time_us, max_rx_time_us; } ble_gap_data_length_params_t;
+typedef struct { uint16_t tx_payload_limited_octets, rx_payload_limited_octets, tx_rx_time_limited_us; } ble_gap_data_length_limitation_t;
+#define BLE_GAP_DATA_LENGTH_AUTO 0
+typedef struct { uint8_t enc:1, id:1, sign:1, link:1; } ble_gap_sec_kdist_t;
+typedef struct { uint8_t bond, mitm, lesc, keypress, io_caps, oob, min_key_size, max_key_size; ble_gap_sec_kdist_t kdist_own, kdist_peer; } ble_gap_sec_params_t;
+#define BLE_GAP_IO_CAPS_NONE 3
+#define BLE_GAP_TX_POWER_ROLE_ADV 1
+#define BLE_GAP_TX_POWER_ROLE_CONN 2
+#define BLE_GAP_ADV_FLAGS_LE_ONLY_LIMITED_DISC_MODE 5
+#define BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE 6
+#define BLE_GAP_ADV_SET_DATA_SIZE_MAX 31
+
+enum {
+    BLE_GAP_EVT_CONNECTED = 0x10, BLE_GAP_EVT_DISCONNECTED, BLE_GAP_EVT_CONN_PARAM_UPDATE,
+    BLE_GAP_EVT_SEC_PARAMS_REQUEST, BLE_GAP_EVT_AUTH_STATUS = 0x19, BLE_GAP_EVT_TIMEOUT = 0x1B,
+    BLE_GAP_EVT_PHY_UPDATE_REQUEST = 0x21, BLE_GAP_EVT_PHY_UPDATE, BLE_GAP_EVT_DATA_LENGTH_UPDATE_REQUEST,
+    BLE_GAP_EVT_DATA_LENGTH_UPDATE, BLE_GAP_EVT_ADV_SET_TERMINATED = 0x26,
+    BLE_GATTC_EVT_TIMEOUT = 0x3A, BLE_GATTS_EVT_TIMEOUT = 0x56, BLE_GATTS_EVT_HVN_TX_COMPLETE = 0x57
+};
+typedef struct {
+    struct { uint16_t evt_id, evt_len; } header;
+    union {
+        struct {
+            uint16_t conn_handle;
+            union {
+                struct { uint8_t reason; } disconnected;
+                struct { ble_gap_conn_params_t conn_params; } connected;
+                struct { ble_gap_conn_params_t conn_params; } conn_param_update;
+                struct { uint8_t auth_status, error_src, bonded; struct { uint8_t lv1:1,lv2:1,lv3:1,lv4:1; } sm1_levels; ble_gap_sec_kdist_t kdist_own, kdist_peer; } auth_status;
+                struct { ble_gap_phys_t peer_preferred_phys; } phy_update_request;
+                struct { uint8_t status, tx_phy, rx_phy; } phy_update;
+                struct { ble_gap_data_length_params_t peer_params; } data_length_update_request;
+                struct { ble_gap_data_length_params_t effective_params; } data_length_update;
+            } params;
+        } gap_evt;
+        struct { uint16_t conn_handle; } gattc_evt;
+        struct { uint16_t conn_handle; union { struct { uint8_t count; } hvn_tx_complete; } params; } gatts_evt;
+    } evt;
+} ble_evt_t;
+
+uint32_t sd_ble_gap_device_name_set(ble_gap_conn_sec_mode_t const*, uint8_t const*, uint16_t);
+uint32_t sd_ble_gap_ppcp_set(ble_gap_conn_params_t const*);
+uint32_t sd_ble_gap_disconnect(uint16_t, uint8_t);
+uint32_t sd_ble_gap_tx_power_set(uint8_t, uint16_t, int8_t);
+uint32_t sd_ble_gap_phy_update(uint16_t, ble_gap_phys_t const*);
+uint32_t sd_ble_gap_data_length_update(uint16_t, ble_gap_data_length_params_t const*, ble_gap_data_length_limitation_t*);
+uint32_t sd_ble_gap_adv_stop(uint8_t);
+uint32_t sd_ble_gap_conn_param_update(uint16_t, ble_gap_conn_params_t const*);
+
+/* sdh */
+ret_code_t nrf_sdh_enable_request(void);
+ret_code_t nrf_sdh_ble_default_cfg_set(uint8_t, uint32_t*);
+ret_code_t nrf_sdh_ble_enable(uint32_t*);
+#define NRF_SDH_BLE_OBSERVER(n, prio, h, ctx) static void (*const n)(ble_evt_t const*, void*) = h
+typedef void (*nrf_sdh_soc_evt_handler_t)(uint32_t, void*);
+#define NRF_SDH_SOC_OBSERVER(n, prio, h, ctx) static nrf_sdh_soc_evt_handler_t const n = h
+
+/* qwr */
+typedef struct { int x; } nrf_ble_qwr_t;
+typedef struct { void (*error_handler)(uint32_t); } nrf_ble_qwr_init_t;
+#define NRF_BLE_QWR_DEF(n) static nrf_ble_qwr_t n
+ret_code_t nrf_ble_qwr_init(nrf_ble_qwr_t*, nrf_ble_qwr_init_t const*);
+ret_code_t nrf_ble_qwr_conn_handle_assign(nrf_ble_qwr_t*, uint16_t);
+
+/* gatt */
+typedef struct { uint16_t att_mtu_desired_periph, att_mtu_desired_central; uint8_t data_length; } nrf_ble_gatt_t;
+typedef enum { NRF_BLE_GATT_EVT_ATT_MTU_UPDATED, NRF_BLE_GATT_EVT_DATA_LENGTH_UPDATED } nrf_ble_gatt_evt_id_t;
+typedef struct { nrf_ble_gatt_evt_id_t evt_id; uint16_t conn_handle; union { uint16_t att_mtu_effective; uint8_t data_length; } params; } nrf_ble_gatt_evt_t;
+typedef void (*nrf_ble_gatt_evt_handler_t)(nrf_ble_gatt_t*, nrf_ble_gatt_evt_t const*);
+#define NRF_BLE_GATT_DEF(n) static nrf_ble_gatt_t n
+ret_code_t nrf_ble_gatt_init(nrf_ble_gatt_t*, nrf_ble_gatt_evt_handler_t);
+ret_code_t nrf_ble_gatt_att_mtu_periph_set(nrf_ble_gatt_t*, uint16_t);
+ret_code_t nrf_ble_gatt_data_length_set(nrf_ble_gatt_t*, uint16_t, uint8_t);
+uint16_t nrf_ble_gatt_eff_mtu_get(nrf_ble_gatt_t const*, uint16_t);
+
+/* nus */
+typedef enum { BLE_NUS_EVT_RX_DATA, BLE_NUS_EVT_TX_RDY, BLE_NUS_EVT_COMM_STARTED, BLE_NUS_EVT_COMM_STOPPED } ble_nus_evt_type_t;
+typedef struct { ble_nus_evt_type_t type; uint16_t conn_handle; union { struct { uint8_t const *p_data; uint16_t length; } rx_data; } params; } ble_nus_evt_t;
+typedef void (*ble_nus_data_handler_t)(ble_nus_evt_t*);
+typedef struct { ble_nus_data_handler_t data_handler; } ble_nus_init_t;
+typedef struct { int x; } ble_nus_t;
+#define BLE_NUS_DEF(n, c) static ble_nus_t n
+uint32_t ble_nus_init(ble_nus_t*, ble_nus_init_t const*);
+uint32_t ble_nus_data_send(ble_nus_t*, uint8_t*, uint16_t*, uint16_t);
+
+/* advertising */
+typedef enum { BLE_ADVDATA_NO_NAME, BLE_ADVDATA_SHORT_NAME, BLE_ADVDATA_FULL_NAME } ble_advdata_name_type_t;
+typedef struct { uint16_t size; uint8_t *p_data; } uint8_array_t;
+typedef struct { uint16_t company_identifier; uint8_array_t data; } ble_advdata_manuf_data_t;
+typedef struct { uint16_t uuid_cnt; ble_uuid_t *p_uuids; } ble_advdata_uuid_list_t;
+typedef struct {
+    ble_advdata_name_type_t name_type; uint8_t short_name_len; bool include_appearance; uint8_t flags;
+    int8_t *p_tx_power_level; ble_advdata_uuid_list_t uuids_more_available, uuids_complete, uuids_solicited;
+    ble_advdata_manuf_data_t *p_manuf_specific_data;
+} ble_advdata_t;
+typedef enum { BLE_ADV_MODE_IDLE, BLE_ADV_MODE_DIRECTED_HIGH_DUTY, BLE_ADV_MODE_DIRECTED, BLE_ADV_MODE_FAST, BLE_ADV_MODE_SLOW } ble_adv_mode_t;
+typedef enum { BLE_ADV_EVT_IDLE, BLE_ADV_EVT_DIRECTED_HIGH_DUTY, BLE_ADV_EVT_DIRECTED, BLE_ADV_EVT_FAST, BLE_ADV_EVT_SLOW } ble_adv_evt_t;
+typedef struct { bool ble_adv_on_disconnect_disabled, ble_adv_whitelist_enabled, ble_adv_directed_high_duty_enabled, ble_adv_directed_enabled, ble_adv_fast_enabled, ble_adv_slow_enabled; uint32_t ble_adv_directed_interval, ble_adv_directed_timeout, ble_adv_fast_interval, ble_adv_fast_timeout, ble_adv_slow_interval, ble_adv_slow_timeout; bool ble_adv_extended_enabled; uint32_t ble_adv_secondary_phy, ble_adv_primary_phy; } ble_adv_modes_config_t;
+typedef struct { ble_advdata_t advdata, srdata; ble_adv_modes_config_t config; void (*evt_handler)(ble_adv_evt_t); void (*error_handler)(uint32_t); } ble_advertising_init_t;
+typedef struct { uint8_t adv_handle; bool initialized; ble_adv_mode_t adv_mode_current; } ble_advertising_t;
+#define BLE_ADVERTISING_DEF(n) static ble_advertising_t n
+uint32_t ble_advertising_init(ble_advertising_t*, ble_advertising_init_t const*);
+uint32_t ble_advertising_start(ble_advertising_t*, ble_adv_mode_t);
+void ble_advertising_conn_cfg_tag_set(ble_advertising_t*, uint8_t);
+ret_code_t ble_advertising_advdata_update(ble_advertising_t*, ble_advdata_t const*, ble_advdata_t const*);
+
+/* conn params */
+typedef enum { BLE_CONN_PARAMS_EVT_FAILED, BLE_CONN_PARAMS_EVT_SUCCEEDED } ble_conn_params_evt_type_t;
+typedef struct { ble_conn_params_evt_type_t evt_type; } ble_conn_params_evt_t;
+typedef struct { ble_gap_conn_params_t *p_conn_params; uint32_t first_conn_params_update_delay, next_conn_params_update_delay; uint8_t max_conn_params_update_count; uint16_t start_on_notify_cccd_handle; bool disconnect_on_fail; void (*evt_handler)(ble_conn_params_evt_t*); void (*error_handler)(uint32_t); } ble_conn_params_init_t;
+uint32_t ble_conn_params_init(ble_conn_params_init_t const*);
+uint32_t ble_conn_params_change_conn_params(uint16_t, ble_gap_conn_params_t*);
+
+/* peer manager */
+typedef enum { PM_EVT_BONDED_PEER_CONNECTED, PM_EVT_CONN_SEC_START, PM_EVT_CONN_SEC_SUCCEEDED, PM_EVT_CONN_SEC_FAILED, PM_EVT_CONN_SEC_CONFIG_REQ, PM_EVT_PEERS_DELETE_SUCCEEDED } pm_evt_id_t;
+typedef struct { pm_evt_id_t evt_id; uint16_t conn_handle; } pm_evt_t;
+typedef struct { bool allow_repairing; } pm_conn_sec_config_t;
+void pm_handler_on_pm_evt(pm_evt_t const*); void pm_handler_flash_clean(pm_evt_t const*);
+void pm_conn_sec_config_reply(uint16_t, pm_conn_sec_config_t*);
+ret_code_t pm_init(void); ret_code_t pm_sec_params_set(ble_gap_sec_params_t*);
+ret_code_t pm_register(void (*)(pm_evt_t const*)); ret_code_t pm_peers_delete(void);
+
+/* app timer / scheduler */
+typedef void (*app_timer_timeout_handler_t)(void*);
+typedef uint32_t* app_timer_id_t;
+typedef enum { APP_TIMER_MODE_SINGLE_SHOT, APP_TIMER_MODE_REPEATED } app_timer_mode_t;
+#define APP_TIMER_DEF(id) static uint32_t id##_data; static app_timer_id_t const id = &id##_data
+#define APP_TIMER_CLOCK_FREQ 32768
+#define APP_TIMER_TICKS(ms) ((uint32_t)(((ms) * (uint64_t)APP_TIMER_CLOCK_FREQ + 500 * (APP_TIMER_CONFIG_RTC_FREQUENCY + 1)) / \
+                                        (1000 * (APP_TIMER_CONFIG_RTC_FREQUENCY + 1))))
+#define APP_TIMER_MAX_CNT_VAL 0xFFFFFF
+#define APP_TIMER_SCHED_EVENT_DATA_SIZE 8
+ret_code_t app_timer_init(void);
+ret_code_t app_timer_create(app_timer_id_t const*, app_timer_mode_t, app_timer_timeout_handler_t);
+ret_code_t app_timer_start(app_timer_id_t, uint32_t, void*);
+ret_code_t app_timer_stop(app_timer_id_t);
+uint32_t app_timer_cnt_get(void);
+uint32_t app_timer_cnt_diff_compute(uint32_t, uint32_t);
+typedef void (*app_sched_event_handler_t)(void*, uint16_t);
+#define APP_SCHED_INIT(sz, q) do { (void)(sz); (void)(q); } while (0)
+uint32_t app_sched_event_put(void const*, uint16_t, app_sched_event_handler_t);
+void app_sched_execute(void);
+
+/* saadc */
+typedef int16_t nrf_saadc_value_t;
+typedef enum { NRF_SAADC_INPUT_DISABLED, NRF_SAADC_INPUT_AIN0, NRF_SAADC_INPUT_AIN1, NRF_SAADC_INPUT_AIN2, NRF_SAADC_INPUT_AIN3, NRF_SAADC_INPUT_VDD = 9 } nrf_saadc_input_t;
+typedef enum { NRF_SAADC_RESISTOR_DISABLED } nrf_saadc_resistor_t;
+typedef enum { NRF_SAADC_GAIN1_6, NRF_SAADC_GAIN1_5 } nrf_saadc_gain_t;
+typedef enum { NRF_SAADC_REFERENCE_INTERNAL } nrf_saadc_reference_t;
+typedef enum { NRF_SAADC_ACQTIME_3US, NRF_SAADC_ACQTIME_5US, NRF_SAADC_ACQTIME_10US, NRF_SAADC_ACQTIME_15US, NRF_SAADC_ACQTIME_20US, NRF_SAADC_ACQTIME_40US } nrf_saadc_acqtime_t;
+typedef enum { NRF_SAADC_MODE_SINGLE_ENDED } nrf_saadc_mode_t;
+typedef enum { NRF_SAADC_BURST_DISABLED, NRF_SAADC_BURST_ENABLED } nrf_saadc_burst_t;
+typedef enum { NRF_SAADC_RESOLUTION_8BIT, NRF_SAADC_RESOLUTION_10BIT, NRF_SAADC_RESOLUTION_12BIT, NRF_SAADC_RESOLUTION_14BIT } nrf_saadc_resolution_t;
+typedef enum { NRF_SAADC_OVERSAMPLE_DISABLED, NRF_SAADC_OVERSAMPLE_2X, NRF_SAADC_OVERSAMPLE_4X, NRF_SAADC_OVERSAMPLE_8X, NRF_SAADC_OVERSAMPLE_16X, NRF_SAADC_OVERSAMPLE_32X, NRF_SAADC_OVERSAMPLE_64X, NRF_SAADC_OVERSAMPLE_128X, NRF_SAADC_OVERSAMPLE_256X } nrf_saadc_oversample_t;
+typedef struct { nrf_saadc_resistor_t resistor_p, resistor_n; nrf_saadc_gain_t gain; nrf_saadc_reference_t reference; nrf_saadc_acqtime_t acq_time; nrf_saadc_mode_t mode; nrf_saadc_burst_t burst; nrf_saadc_input_t pin_p, pin_n; } nrf_saadc_channel_config_t;
+typedef struct { nrf_saadc_resolution_t resolution; nrf_saadc_oversample_t oversample; uint8_t interrupt_priority; bool low_power_mode; } nrfx_saadc_config_t;
+typedef nrfx_saadc_config_t nrf_drv_saadc_config_t;
+#define NRFX_SAADC_DEFAULT_CONFIG { NRF_SAADC_RESOLUTION_12BIT, NRF_SAADC_OVERSAMPLE_DISABLED, 6, true }
+#define NRF_DRV_SAADC_DEFAULT_CONFIG NRFX_SAADC_DEFAULT_CONFIG
+typedef enum { NRFX_SAADC_EVT_DONE, NRFX_SAADC_EVT_LIMIT, NRFX_SAADC_EVT_CALIBRATEDONE } nrfx_saadc_evt_type_t;
+#define NRF_DRV_SAADC_EVT_DONE NRFX_SAADC_EVT_DONE
+#define NRF_DRV_SAADC_EVT_CALIBRATEDONE NRFX_SAADC_EVT_CALIBRATEDONE
+typedef struct { nrfx_saadc_evt_type_t type; union { struct { nrf_saadc_value_t *p_buffer; uint16_t size; } done; } data; } nrfx_saadc_evt_t;
+typedef nrfx_saadc_evt_t nrf_drv_saadc_evt_t;
+typedef void (*nrfx_saadc_event_handler_t)(nrfx_saadc_evt_t const*);
+ret_code_t nrf_drv_saadc_init(nrf_drv_saadc_config_t const*, nrfx_saadc_event_handler_t);
+ret_code_t nrfx_saadc_init(nrfx_saadc_config_t const*, nrfx_saadc_event_handler_t);
+ret_code_t nrf_drv_saadc_channel_init(uint8_t, nrf_saadc_channel_config_t const*);
+ret_code_t nrfx_saadc_channel_init(uint8_t, nrf_saadc_channel_config_t const*);
+ret_code_t nrfx_saadc_sample_convert(uint8_t, nrf_saadc_value_t*);
+ret_code_t nrfx_saadc_buffer_convert(nrf_saadc_value_t*, uint16_t);
+ret_code_t nrf_drv_saadc_buffer_convert(nrf_saadc_value_t*, uint16_t);
+ret_code_t nrfx_saadc_sample(void);
+ret_code_t nrfx_saadc_calibrate_offset(void);
+void nrfx_saadc_uninit(void);
+bool nrfx_saadc_is_busy(void);
+uint32_t nrfx_saadc_sample_task_get(void);
+uint32_t nrf_drv_saadc_sample_task_get(void);
+void nrfx_saadc_abort(void);
+typedef enum { NRF_SAADC_EVENT_STARTED = 0, NRF_SAADC_EVENT_END = 4, NRF_SAADC_EVENT_STOPPED = 0x114 } nrf_saadc_event_t;
+typedef enum { NRF_SAADC_TASK_START = 0, NRF_SAADC_TASK_SAMPLE = 4, NRF_SAADC_TASK_STOP = 8 } nrf_saadc_task_t;
+void nrf_saadc_task_trigger(nrf_saadc_task_t); bool nrf_saadc_event_check(nrf_saadc_event_t); void nrf_saadc_event_clear(nrf_saadc_event_t);
+uint32_t nrf_saadc_event_address_get(nrf_saadc_event_t);
+uint32_t nrf_saadc_task_address_get(nrf_saadc_task_t);
+
+/* gpiote */
+typedef struct { int action; int init_state; bool task_pin; } nrfx_gpiote_out_config_t;
+typedef nrfx_gpiote_out_config_t nrf_drv_gpiote_out_config_t;
+#define NRFX_GPIOTE_CONFIG_OUT_SIMPLE(s) { 0, (s), false }
+#define NRFX_GPIOTE_CONFIG_OUT_TASK_TOGGLE(s) { 3, (s), true }
+#define NRFX_GPIOTE_CONFIG_OUT_TASK_HIGH { 1, 0, true }
+#define NRFX_GPIOTE_CONFIG_OUT_TASK_LOW { 2, 1, true }
+bool nrf_drv_gpiote_is_init(void); ret_code_t nrf_drv_gpiote_init(void);
+ret_code_t nrf_drv_gpiote_out_init(uint32_t, nrf_drv_gpiote_out_config_t const*);
+void nrf_drv_gpiote_out_set(uint32_t); void nrf_drv_gpiote_out_clear(uint32_t);
+ret_code_t nrfx_gpiote_out_init(uint32_t, nrfx_gpiote_out_config_t const*);
+void nrfx_gpiote_out_set(uint32_t); void nrfx_gpiote_out_clear(uint32_t);
+void nrfx_gpiote_out_uninit(uint32_t); void nrfx_gpiote_uninit(void);
+bool nrfx_gpiote_is_init(void);
+uint32_t nrfx_gpiote_set_task_addr_get(uint32_t); uint32_t nrfx_gpiote_clr_task_addr_get(uint32_t);
+uint32_t nrfx_gpiote_out_task_addr_get(uint32_t);
+void nrfx_gpiote_clr_task_trigger(uint32_t); void nrfx_gpiote_set_task_trigger(uint32_t);
+void nrfx_gpiote_out_task_enable(uint32_t); void nrfx_gpiote_out_task_disable(uint32_t);
+
+/* ppi / timer / rtc */
+typedef enum { NRF_PPI_CHANNEL0 } nrf_ppi_channel_t;
+ret_code_t nrfx_ppi_channel_alloc(nrf_ppi_channel_t*);
+ret_code_t nrfx_ppi_channel_free(nrf_ppi_channel_t);
+ret_code_t nrfx_ppi_channel_assign(nrf_ppi_channel_t, uint32_t, uint32_t);
+ret_code_t nrfx_ppi_channel_fork_assign(nrf_ppi_channel_t, uint32_t);
+ret_code_t nrfx_ppi_channel_enable(nrf_ppi_channel_t);
+ret_code_t nrfx_ppi_channel_disable(nrf_ppi_channel_t);
+typedef ret_code_t (*ppi_fn)(void);
+ret_code_t nrf_drv_ppi_init(void);
+typedef enum { NRF_PPI_CHANNEL_GROUP0 } nrf_ppi_channel_group_t;
+ret_code_t nrfx_ppi_group_alloc(nrf_ppi_channel_group_t*);
+ret_code_t nrfx_ppi_group_free(nrf_ppi_channel_group_t);
+ret_code_t nrfx_ppi_channel_include_in_group(nrf_ppi_channel_t, nrf_ppi_channel_group_t);
+ret_code_t nrfx_ppi_group_enable(nrf_ppi_channel_group_t);
+ret_code_t nrfx_ppi_group_disable(nrf_ppi_channel_group_t);
+uint32_t nrfx_ppi_task_addr_group_enable_get(nrf_ppi_channel_group_t);
+uint32_t nrfx_ppi_task_addr_group_disable_get(nrf_ppi_channel_group_t);
+typedef struct { void *p_reg; uint8_t instance_id; uint8_t cc_channel_count; } nrfx_timer_t;
+typedef nrfx_timer_t nrf_drv_timer_t;
+#define NRFX_TIMER_INSTANCE(id) { 0, id, 4 }
+#define NRF_DRV_TIMER_INSTANCE(id) NRFX_TIMER_INSTANCE(id)
+typedef enum { NRF_TIMER_FREQ_16MHz, NRF_TIMER_FREQ_8MHz, NRF_TIMER_FREQ_4MHz, NRF_TIMER_FREQ_2MHz, NRF_TIMER_FREQ_1MHz, NRF_TIMER_FREQ_500kHz, NRF_TIMER_FREQ_250kHz, NRF_TIMER_FREQ_125kHz, NRF_TIMER_FREQ_62500Hz, NRF_TIMER_FREQ_31250Hz } nrf_timer_frequency_t;
+typedef enum { NRF_TIMER_MODE_TIMER } nrf_timer_mode_t;
+typedef enum { NRF_TIMER_BIT_WIDTH_16, NRF_TIMER_BIT_WIDTH_8, NRF_TIMER_BIT_WIDTH_24, NRF_TIMER_BIT_WIDTH_32 } nrf_timer_bit_width_t;
+typedef struct { nrf_timer_frequency_t frequency; nrf_timer_mode_t mode; nrf_timer_bit_width_t bit_width; uint8_t interrupt_priority; void *p_context; } nrfx_timer_config_t;
+typedef nrfx_timer_config_t nrf_drv_timer_config_t;
+#define NRFX_TIMER_DEFAULT_CONFIG { NRF_TIMER_FREQ_16MHz, NRF_TIMER_MODE_TIMER, NRF_TIMER_BIT_WIDTH_16, 6, NULL }
+#define NRF_DRV_TIMER_DEFAULT_CONFIG NRFX_TIMER_DEFAULT_CONFIG
+typedef enum { NRF_TIMER_CC_CHANNEL0, NRF_TIMER_CC_CHANNEL1, NRF_TIMER_CC_CHANNEL2, NRF_TIMER_CC_CHANNEL3 } nrf_timer_cc_channel_t;
+typedef enum { NRF_TIMER_EVENT_COMPARE0 = 0x140, NRF_TIMER_EVENT_COMPARE1 = 0x144, NRF_TIMER_EVENT_COMPARE2 = 0x148 } nrf_timer_event_t;
+typedef enum { NRF_TIMER_TASK_START, NRF_TIMER_TASK_STOP, NRF_TIMER_TASK_CLEAR = 0x0C } nrf_timer_task_t;
+typedef enum { NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK = 1, NRF_TIMER_SHORT_COMPARE1_CLEAR_MASK = 2, NRF_TIMER_SHORT_COMPARE2_CLEAR_MASK = 4, NRF_TIMER_SHORT_COMPARE0_STOP_MASK = 0x100, NRF_TIMER_SHORT_COMPARE1_STOP_MASK = 0x200, NRF_TIMER_SHORT_COMPARE2_STOP_MASK = 0x400 } nrf_timer_short_mask_t;
+typedef void (*nrfx_timer_event_handler_t)(nrf_timer_event_t, void*);
+ret_code_t nrf_drv_timer_init(nrf_drv_timer_t const*, nrf_drv_timer_config_t const*, nrfx_timer_event_handler_t);
+void nrf_drv_timer_uninit(nrf_drv_timer_t const*);
+void nrf_drv_timer_enable(nrf_drv_timer_t const*); void nrf_drv_timer_disable(nrf_drv_timer_t const*);
+void nrf_drv_timer_clear(nrf_drv_timer_t const*);
+uint32_t nrf_drv_timer_ms_to_ticks(nrf_drv_timer_t const*, uint32_t);
+uint32_t nrf_drv_timer_us_to_ticks(nrf_drv_timer_t const*, uint32_t);
+void nrf_drv_timer_compare(nrf_drv_timer_t const*, nrf_timer_cc_channel_t, uint32_t, bool);
+void nrf_drv_timer_extended_compare(nrf_drv_timer_t const*, nrf_timer_cc_channel_t, uint32_t, nrf_timer_short_mask_t, bool);
+uint32_t nrf_drv_timer_compare_event_address_get(nrf_drv_timer_t const*, uint32_t);
+uint32_t nrf_drv_timer_task_address_get(nrf_drv_timer_t const*, nrf_timer_task_t);
+uint32_t nrf_drv_timer_event_address_get(nrf_drv_timer_t const*, nrf_timer_event_t);
+
+/* rng */
+ret_code_t nrf_drv_rng_init(void*); ret_code_t nrf_drv_rng_rand(uint8_t*, uint8_t);
+
+/* queue */
+typedef enum { NRF_QUEUE_MODE_OVERFLOW, NRF_QUEUE_MODE_NO_OVERFLOW } nrf_queue_mode_t;
+typedef struct { size_t front, back; } nrf_queue_cb_t;
+typedef struct { nrf_queue_cb_t *p_cb; void *p_buffer; size_t size; size_t element_size; nrf_queue_mode_t mode; } nrf_queue_t;
+#define NRF_QUEUE_DEF(type, name, sz, md) static type name##_buf[(sz)+1]; static nrf_queue_cb_t name##_cb; \
+    static const nrf_queue_t name = { &name##_cb, name##_buf, (sz), sizeof(type), (md) }
+ret_code_t nrf_queue_push(nrf_queue_t const*, void const*);
+ret_code_t nrf_queue_pop(nrf_queue_t const*, void*);
+ret_code_t nrf_queue_peek(nrf_queue_t const*, void*);
+bool nrf_queue_is_empty(nrf_queue_t const*); bool nrf_queue_is_full(nrf_queue_t const*);
+size_t nrf_queue_utilization_get(nrf_queue_t const*);
+void nrf_queue_reset(nrf_queue_t const*);
+
+/* fds / fstorage */
+typedef struct { uint16_t file_id, record_key, length_words; uint32_t record_id; } fds_header_t;
+typedef struct { uint16_t file_id, key; struct { void const *p_data; uint32_t length_words; } data; } fds_record_t;
+typedef struct { uint32_t record_id; uint32_t const *p_record; uint16_t gc_run_count; bool record_is_open; } fds_record_desc_t;
+typedef struct { uint32_t const *p_addr; uint16_t page; } fds_find_token_t;
+typedef struct { fds_header_t const *p_header; void const *p_data; } fds_flash_record_t;
+typedef enum { FDS_EVT_INIT, FDS_EVT_WRITE, FDS_EVT_UPDATE, FDS_EVT_DEL_RECORD, FDS_EVT_DEL_FILE, FDS_EVT_GC } fds_evt_id_t;
+typedef struct { fds_evt_id_t id; ret_code_t result; union { struct { uint32_t record_id; uint16_t file_id, record_key; bool is_record_updated; } write; struct { uint32_t record_id; uint16_t file_id, record_key; } del; }; } fds_evt_t;
+typedef struct { uint16_t pages_available, open_records, valid_records, dirty_records, words_reserved; uint32_t words_used, largest_contig, freeable_words; bool corruption; } fds_stat_t;
+#define FDS_SUCCESS 0
+#define FDS_ERR_NO_SPACE_IN_FLASH 0x860D
+#define FDS_ERR_NOT_FOUND 0x8606
+typedef void (*fds_cb_t)(fds_evt_t const*);
+ret_code_t fds_register(fds_cb_t); ret_code_t fds_init(void);
+ret_code_t fds_record_write(fds_record_desc_t*, fds_record_t const*);
+ret_code_t fds_record_update(fds_record_desc_t*, fds_record_t const*);
+ret_code_t fds_record_find(uint16_t, uint16_t, fds_record_desc_t*, fds_find_token_t*);
+ret_code_t fds_record_find_in_file(uint16_t, fds_record_desc_t*, fds_find_token_t*);
+ret_code_t fds_record_find_by_key(uint16_t, fds_record_desc_t*, fds_find_token_t*);
+ret_code_t fds_record_open(fds_record_desc_t*, fds_flash_record_t*);
+ret_code_t fds_record_close(fds_record_desc_t*);
+ret_code_t fds_record_delete(fds_record_desc_t*);
+ret_code_t fds_file_delete(uint16_t);
+ret_code_t fds_gc(void); ret_code_t fds_stat(fds_stat_t*);
+typedef enum { NRF_FSTORAGE_EVT_READ_RESULT, NRF_FSTORAGE_EVT_WRITE_RESULT, NRF_FSTORAGE_EVT_ERASE_RESULT } nrf_fstorage_evt_id_t;
+typedef struct { nrf_fstorage_evt_id_t id; ret_code_t result; uint32_t addr; void const *p_src; uint32_t len; void *p_param; } nrf_fstorage_evt_t;
+typedef void (*nrf_fstorage_evt_handler_t)(nrf_fstorage_evt_t*);
+typedef struct { int x; } nrf_fstorage_api_t;
+typedef struct { uint32_t erase_unit, program_unit; bool rmap, wmap; } nrf_fstorage_info_t;
+typedef struct { nrf_fstorage_api_t const *p_api; nrf_fstorage_info_t const *p_flash_info; nrf_fstorage_evt_handler_t evt_handler; uint32_t start_addr, end_addr; } nrf_fstorage_t;
+#define NRF_FSTORAGE_DEF(x) x
+extern nrf_fstorage_api_t nrf_fstorage_sd;
+ret_code_t nrf_fstorage_init(nrf_fstorage_t*, nrf_fstorage_api_t*, void*);
+ret_code_t nrf_fstorage_read(nrf_fstorage_t const*, uint32_t, void*, uint32_t);
+ret_code_t nrf_fstorage_write(nrf_fstorage_t const*, uint32_t, void const*, uint32_t, void*);
+ret_code_t nrf_fstorage_erase(nrf_fstorage_t const*, uint32_t, uint32_t, void*);
+bool nrf_fstorage_is_busy(nrf_fstorage_t const*);
+uint8_t const *nrf_fstorage_rmap(nrf_fstorage_t const*, uint32_t);
+
+/* main.c passes NULL for unused float arguments, which the toolchains it
+ * is built with accept because their NULL is a plain 0
+ */
+#undef NULL
+#define NULL 0
+
+/* ble cfg */
+typedef struct { struct { uint8_t conn_cfg_tag; union { struct { uint8_t hvn_tx_queue_size; } gatts_conn_cfg; } params; } conn_cfg; } ble_cfg_t;
+#define BLE_CONN_CFG_GATTS 0x24
+uint32_t sd_ble_cfg_set(uint32_t, ble_cfg_t const *, uint32_t);
+#endif
@@ -0,0 +1,39 @@
+/* Minimal checks for the host tests. A failed check is reported and the
+ * test goes on, test_report() turns the failures into the exit status
+ */
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+static int test_checks   = 0;
+static int test_failures = 0;
+
+#define CHECK(cond)                                                             \
+    do {                                                                        \
+        test_checks++;                                                          \
+        if (!(cond)) {                                                          \
+            test_failures++;                                                    \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        }                                                                       \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                                          \
+    do {                                                                        \
+        long long _a = (long long)(a);                                          \
+        long long _b = (long long)(b);                                          \
+        test_checks++;                                                          \
+        if (_a != _b) {                                                         \
+            test_failures++;                                                    \
+            fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n",   \
+                    __FILE__, __LINE__, #a, #b, _a, _b);                        \
+        }                                                                       \
+    } while (0)
+
+static inline int test_report(char const * p_name)
+{
+    printf("%s: %d checks, %d failed\n", p_name, test_checks, test_failures);
+    return test_failures ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,126 @@
+/* user-015: connection parameter profiles. Buffered readings alone keep the
+ * link on IDLE, BULK is asked for while an upload, a GET range, ARCH or
+ * GETBLK transfer runs and left once it ends. A refused profile is not
+ * asked for again until the mode changes
+ */
+#include "firmware.h"
+#include "fakes.h"
+#include "test.h"
+
+#define READINGS        200
+
+static int m_requests = 0;
+static int m_profile  = -1;     // last profile requested
+
+uint32_t ble_conn_params_change_conn_params(uint16_t conn_handle, ble_gap_conn_params_t * p_params)
+{
+    m_requests++;
+    m_profile = (int)(p_params - m_conn_profiles);
+    return NRF_SUCCESS;
+}
+
+// Buffers READINGS readings, in log blocks for GETBLK, and connects
+static void connect(void)
+{
+    fake_flash_erase_all();
+    init_data_buffers();
+    hist_log_init();
+    for (uint32_t i = 0; i < READINGS; i++) {
+        hist_reading_t reading = {.ph_mv = 1500 + i % 50, .temp_mv = 700, .batt_mv = 2000};
+
+        hist_append(&reading);
+        hist_log_flush(false);
+        fake_flash_run();
+    }
+    nus_tx_reset();
+    m_conn_handle          = 0;
+    m_conn_profile         = CONN_PROFILE_NONE;
+    m_ble_nus_max_data_len = 244;
+    conn_profile_update();
+}
+
+static void command(char * p_cmd)
+{
+    char * p = p_cmd;
+
+    check_for_range_request(&p);
+    check_for_archive_request(&p);
+    check_for_block_request(&p);
+}
+
+/* Runs connection events until nothing is in flight. Returns whether BULK
+ * was the profile while the transfer ran
+ */
+static bool run_transfer(void)
+{
+    bool bulk = (m_profile == CONN_PROFILE_BULK);
+
+    for (int events = 0; m_tx_in_flight > 0 && events < 10 * READINGS; events++) {
+        // The last packets may still be in flight after the transfer ended
+        if (hist_range_pending() || m_arch_next < m_arch_end || m_blk_pass < 3)
+            bulk = bulk && (m_profile == CONN_PROFILE_BULK);
+        nus_tx_complete(m_tx_in_flight);
+    }
+    return bulk;
+}
+
+static void test_transfers(void)
+{
+    connect();
+    CHECK_EQ(m_profile, CONN_PROFILE_IDLE);
+
+    command("GET_0_199");
+    CHECK(run_transfer());
+    CHECK(!hist_range_pending());
+    CHECK_EQ(m_profile, CONN_PROFILE_IDLE);
+
+    HIST_ARCHIVE_CNT = HIST_ARCHIVE_SIZE;
+    command("ARCH");
+    CHECK(run_transfer());
+    CHECK_EQ(m_arch_next, m_arch_end);
+    CHECK_EQ(m_profile, CONN_PROFILE_IDLE);
+    HIST_ARCHIVE_CNT = 0;
+
+    command("GETBLK");
+    CHECK(run_transfer());
+    CHECK_EQ(m_blk_pass, 3);
+    CHECK_EQ(m_profile, CONN_PROFILE_IDLE);
+
+    start_buffered_data_upload();
+    CHECK_EQ(m_profile, CONN_PROFILE_BULK);
+    while (SEND_BUFFERED_DATA && m_tx_in_flight > 0) {
+        nus_tx_complete(m_tx_in_flight);
+        check_buffered_data_upload_done();
+    }
+    CHECK(!SEND_BUFFERED_DATA);
+    CHECK_EQ(m_profile, CONN_PROFILE_IDLE);
+}
+
+static void test_refused(void)
+{
+    ble_conn_params_evt_t evt = {.evt_type = BLE_CONN_PARAMS_EVT_FAILED};
+    int                   requests;
+
+    connect();
+    HIST_ARCHIVE_CNT = HIST_ARCHIVE_SIZE;
+    command("ARCH");
+    CHECK_EQ(m_profile, CONN_PROFILE_BULK);
+    on_conn_params_evt(&evt);
+    requests = m_requests;
+    // More packets of the same transfer do not ask again
+    nus_tx_complete(m_tx_in_flight);
+    CHECK_EQ(m_requests, requests);
+    run_transfer();
+    HIST_ARCHIVE_CNT = 0;
+    // The next mode does
+    CHECK_EQ(m_requests, requests + 1);
+    CHECK_EQ(m_profile, CONN_PROFILE_IDLE);
+}
+
+int main(void)
+{
+    DEMO_PROTO_FLAG = false;
+    test_transfers();
+    test_refused();
+    return test_report("test_conn_profile");
+}
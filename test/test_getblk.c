@@ -0,0 +1,195 @@
+/* user-025: the history log block codec. Checks the bit packed codes and
+ * zig-zag, then writes every trace of corpus/traces.csv through the log,
+ * fetches it with "GETBLK", decodes it with the reference decoder and
+ * compares, and reports bytes per reading against the record formats
+ */
+#include <limits.h>
+#include "firmware.h"
+#include "fakes.h"
+#include "test.h"
+#include "getblk_decode.h"
+
+#define CORPUS          "corpus/traces.csv"
+#define TRACE_MAX       DATA_BUFF_SIZE
+
+typedef struct
+{
+    char           name[32];
+    uint32_t       count;
+    hist_reading_t reading[TRACE_MAX];
+} trace_t;
+
+static void test_codec(void)
+{
+    static uint32_t const values[] = {0, 1, 3, 4, 15, 16, 63, 64, 4095, 4096, 65535, UINT32_MAX};
+    static uint8_t const  lens[]   = {1, 4, 4, 7, 7, 10, 10, 17, 17, 37, 37, 37};
+    static int32_t const  deltas[] = {0, 1, -1, 2, -2, 63, -64, 4095, -4095, INT32_MAX, INT32_MIN};
+    uint8_t  buf[64] = {0};
+    uint32_t pos = 0, end;
+
+    // Back to back, as in a block
+    for (int i = 0; i < ARRAY_SIZE(values); i++) {
+        CHECK_EQ(hist_code_len(values[i]), lens[i]);
+        hist_code_put(buf, &pos, values[i]);
+    }
+    end = pos;
+    pos = 0;
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+        CHECK_EQ(hist_code_get(buf, &pos, end), values[i]);
+    CHECK_EQ(pos, end);
+    // Prefixes as documented: z = 0 is a single 0 bit, 5 takes 110 0101
+    memset(buf, 0, sizeof(buf));
+    pos = 0;
+    hist_code_put(buf, &pos, 0);
+    hist_code_put(buf, &pos, 5);
+    CHECK_EQ(pos, 8);
+    CHECK_EQ(buf[0], 0x56);
+    // A code cut short reads 0 bits past the end
+    pos = 1;
+    CHECK_EQ(hist_code_get(buf, &pos, 5), 1);
+
+    CHECK_EQ(hist_zigzag(0), 0);
+    CHECK_EQ(hist_zigzag(-1), 1);
+    CHECK_EQ(hist_zigzag(1), 2);
+    CHECK_EQ(hist_zigzag(-2), 3);
+    for (int i = 0; i < ARRAY_SIZE(deltas); i++)
+        CHECK_EQ(hist_unzigzag(hist_zigzag(deltas[i])), deltas[i]);
+}
+
+// Reads the traces of the corpus, returns how many
+static uint32_t load_corpus(trace_t * p_traces, uint32_t max)
+{
+    FILE *   f = fopen(CORPUS, "r");
+    char     line[128], name[32];
+    unsigned ph, temp, batt, dt, flags;
+    uint32_t n = 0;
+
+    if (f == NULL) {
+        CHECK(!"corpus missing");
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%31[^,],%u,%u,%u,%u,%u", name, &ph, &temp, &batt, &dt, &flags) != 6)
+            continue;
+        if (n == 0 || strcmp(p_traces[n - 1].name, name) != 0) {
+            if (n == max)
+                break;
+            strcpy(p_traces[n].name, name);
+            p_traces[n++].count = 0;
+        }
+        if (p_traces[n - 1].count < TRACE_MAX) {
+            hist_reading_t * p = &p_traces[n - 1].reading[p_traces[n - 1].count++];
+
+            p->ph_mv   = ph;
+            p->temp_mv = temp;
+            p->batt_mv = batt;
+            p->dt      = dt;
+            p->flags   = flags;
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+static void conn_event(void)
+{
+    nus_tx_complete(m_tx_in_flight);
+    while (fake_flash_pending() > 0)
+        fake_flash_run();
+}
+
+/* Logs the trace, fetches it with GETBLK and checks every reading. Adds the
+ * block bytes sent to *p_bytes
+ */
+static void round_trip(trace_t const * p_trace, uint32_t * p_bytes)
+{
+    static getblk_reading_t decoded[TRACE_MAX];
+    getblk_session_t        session;
+    uint32_t                start = HIST_LOG_SEQ;
+    uint32_t                n = 0, mismatches = 0;
+    char                    cmd[] = "GETBLK";
+    char *                  p_cmd = cmd;
+
+    for (uint32_t i = 0; i < p_trace->count; i++) {
+        hist_append(&p_trace->reading[i]);
+        hist_log_flush(false);
+        conn_event();
+    }
+    // Seal the tail block by block, as before a power off
+    for (int i = 0; i < 10 && m_log_written < HIST_LOG_SEQ + TOTAL_DATA_IN_BUFFERS; i++) {
+        hist_log_flush(true);
+        conn_event();
+    }
+
+    fake_nus_sent = 0;
+    check_for_block_request(&p_cmd);
+    for (int i = 0; i < 100 && (m_blk_pass != 3 || m_tx_in_flight > 0); i++)
+        conn_event();
+    CHECK(fake_nus_sent <= FAKE_NUS_LOG);
+
+    getblk_start(&session);
+    for (uint32_t p = 0; p < fake_nus_sent; p++) {
+        int cnt = getblk_decode(&session, fake_nus_log[p].data, fake_nus_log[p].len,
+                                &decoded[n], TRACE_MAX - n);
+        CHECK(cnt != GETBLK_ERROR);
+        if (cnt == GETBLK_ERROR)
+            return;
+        if (cnt > 0)
+            *p_bytes += fake_nus_log[p].len;
+        n += cnt;
+    }
+    CHECK(session.done);
+    CHECK_EQ(session.first_seq, start);
+    CHECK_EQ(session.end_seq, start + p_trace->count);
+    CHECK_EQ(session.first_index, HIST_FIRST_SEQ % 1000);
+    CHECK_EQ(n, p_trace->count);
+    for (uint32_t i = 0; i < n; i++) {
+        hist_reading_t const * p = &p_trace->reading[decoded[i].seq - start];
+
+        mismatches += decoded[i].seq != start + i ||
+                      decoded[i].ph_mv != p->ph_mv || decoded[i].temp_mv != p->temp_mv ||
+                      decoded[i].batt_mv != p->batt_mv || decoded[i].dt != p->dt ||
+                      decoded[i].flags != p->flags;
+    }
+    CHECK_EQ(mismatches, 0);
+
+    // The central got everything, the next trace follows in the log
+    free_data_buffers(TOTAL_DATA_IN_BUFFERS);
+}
+
+int main(void)
+{
+    static trace_t traces[8];
+    uint32_t       count, total = 0, total_bytes = 0;
+
+    test_codec();
+
+    count = load_corpus(traces, ARRAY_SIZE(traces));
+    CHECK(count >= 4);
+    m_conn_handle          = 0;
+    m_ble_nus_max_data_len = 244;
+    hist_log_init();
+    init_data_buffers();
+
+    printf("trace           readings  bytes/reading  vs ASCII  vs binary\n");
+    for (uint32_t t = 0; t < count; t++) {
+        uint32_t bytes = 0;
+        double   per_reading;
+
+        round_trip(&traces[t], &bytes);
+        per_reading = (double)bytes / traces[t].count;
+        printf("%-15s %8u  %13.2f  %7.1fx  %8.1fx\n", traces[t].name, traces[t].count,
+               per_reading, total_size_w_index / per_reading, BIN_RECORD_LEN / per_reading);
+        // Measured 1.5 (client) to 2.8 (noisy) bytes per reading
+        CHECK(10 * bytes <= 30 * traces[t].count);
+        total       += traces[t].count;
+        total_bytes += bytes;
+    }
+    // Measured 2.1 bytes per reading, 11x less than ASCII and 3.8x less
+    // than binary records
+    CHECK(10 * total_bytes <= 22 * total);
+    CHECK(total_size_w_index * total >= 10 * total_bytes);
+    printf("corpus          %8u  %13.2f  %7.1fx  %8.1fx\n", total, (double)total_bytes / total,
+           (double)total_size_w_index * total / total_bytes, (double)BIN_RECORD_LEN * total / total_bytes);
+    return test_report("test_getblk");
+}
@@ -0,0 +1,255 @@
+/* user-024: power loss in the history log. A writer logs readings, with
+ * power offs and, in the second scenario, frees by the central and flash
+ * faults, or with operations completing while the next one is being
+ * queued, and records every flash operation. The flash is then rebuilt up
+ * to each operation, and once more with that operation cut short, and
+ * hist_log_init() restores it in a fresh copy of the firmware. Checks that
+ * restored readings are the ones written at their sequence, that no block
+ * whose write completed is lost, and that readings missing from the
+ * buffers are counted in the archive
+ */
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "firmware.h"
+#include "fakes.h"
+#include "test.h"
+
+#define READINGS        1600
+#define MAX_OPS         2000
+#define MAX_OP_LEN      512
+
+typedef struct
+{
+    bool     erase;
+    uint32_t addr;
+    uint32_t len;
+    uint32_t result;
+    uint32_t freed;             // readings below it freed by the central
+    uint8_t  data[MAX_OP_LEN];
+} replay_op_t;
+
+typedef struct
+{
+    uint32_t    count;
+    replay_op_t op[MAX_OPS];
+} replay_log_t;
+
+static replay_log_t * m_log;          // shared with the writer
+static uint32_t       m_freed = 0;    // writer: freed by the central
+static uint32_t       m_rng   = 2024;
+
+static uint32_t rnd(uint32_t n)
+{
+    m_rng = m_rng * 1664525u + 1013904223u;
+    return (m_rng >> 8) % n;
+}
+
+static hist_reading_t reading_of(uint32_t seq)
+{
+    hist_reading_t reading = {
+        .ph_mv   = 1400 + (seq * 37) % 300,
+        .temp_mv = 650 + (seq * 11) % 100,
+        .batt_mv = 1800 + seq % 50,
+        .dt      = 1 + seq % 3,
+        .flags   = seq % 8,
+    };
+    return reading;
+}
+
+static void record_op(fake_flash_op_t const * p_op)
+{
+    replay_op_t * p = &m_log->op[m_log->count];
+
+    if (m_log->count == MAX_OPS || (p_op->len > MAX_OP_LEN && !p_op->erase)) {
+        fprintf(stderr, "replay log too small\n");
+        exit(2);
+    }
+    p->erase  = p_op->erase;
+    p->addr   = p_op->addr;
+    p->len    = p_op->len;
+    p->result = p_op->result;
+    p->freed  = m_freed;
+    if (!p_op->erase)
+        memcpy(p->data, p_op->p_data, p_op->len);
+    m_log->count++;
+}
+
+// The completions interrupt hist_log_flush() as it queues the next write
+static void run_flash_now(void)
+{
+    static bool running = false;
+
+    if (running)
+        return;
+    running = true;
+    fake_flash_run();
+    running = false;
+}
+
+static void run_flash(bool faults)
+{
+    if (faults && rnd(8) == 0)
+        fake_flash_fail = 1 + rnd(HIST_LOG_RETRIES);
+    fake_flash_run();
+    fake_flash_fail = 0;
+}
+
+// Logs READINGS readings in a child, so this process stays pristine
+static void write_log(bool frees, bool faults, bool nested)
+{
+    pid_t pid = (fflush(stdout), fork());
+    int   status;
+
+    if (pid == 0) {
+        fake_flash_on_op = record_op;
+        hist_log_init();
+        if (nested)
+            fake_flash_on_queue = run_flash_now;
+        init_data_buffers();
+        for (uint32_t seq = 0; seq < READINGS; seq++) {
+            hist_reading_t reading = reading_of(seq);
+
+            hist_append(&reading);
+            hist_log_flush(false);
+            if (rnd(3) == 0)
+                run_flash(faults);
+            if (frees && rnd(25) == 0 && TOTAL_DATA_IN_BUFFERS > 1) {
+                free_data_buffers(1 + rnd(TOTAL_DATA_IN_BUFFERS - 1));
+                m_freed = HIST_LOG_SEQ;
+            }
+            if (rnd(60) == 0) {
+                // The writer keeps its RAM, only the flash matters here
+                chip_power_off();
+                run_flash(faults);
+            }
+        }
+        chip_power_off();
+        run_flash(false);
+        exit(0);
+    }
+    waitpid(pid, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static void apply_op(replay_op_t const * p, uint32_t cut)
+{
+    uint8_t * p_flash = &fake_flash[p->addr - FAKE_FLASH_START];
+
+    if (p->result != NRF_SUCCESS)
+        return;
+    if (p->erase)
+        memset(p_flash, 0xFF, MIN(cut, p->len));
+    else {
+        for (uint32_t i = 0; i < MIN(cut, p->len); i++)
+            p_flash[i] &= p->data[i];
+        // The byte being programmed when the power went
+        if (cut < p->len)
+            p_flash[cut] &= p->data[cut] | (uint8_t)rnd(256);
+    }
+}
+
+// End of the readings in data blocks written before operation k
+static uint32_t durable_end(uint32_t k)
+{
+    uint32_t end = 0;
+
+    for (uint32_t j = 0; j < k; j++) {
+        replay_op_t const * p = &m_log->op[j];
+        uint32_t            word0, seq;
+
+        if (p->erase || p->result != NRF_SUCCESS)
+            continue;
+        memcpy(&word0, p->data, 4);
+        memcpy(&seq, p->data + 4, 4);
+        if ((word0 & 0xFFFF0000) == HIST_LOG_TAG_DATA)
+            end = MAX(end, seq + (word0 & 0xFF));
+    }
+    return end;
+}
+
+/* Restores the flash as it was when operation k was cut after cut bytes,
+ * in a child. Returns its exit status, 0 if every check passed
+ */
+static int replay(uint32_t k, uint32_t cut, bool frees)
+{
+    pid_t pid = (fflush(stdout), fork());
+    int   status;
+
+    if (pid == 0) {
+        uint32_t archived = 0, mismatch = 0;
+        uint32_t end;
+        uint32_t freed = (k < m_log->count) ? m_log->op[k].freed : 
+                                              m_log->op[m_log->count - 1].freed;
+
+        test_failures = 0;
+        for (uint32_t j = 0; j < k; j++)
+            apply_op(&m_log->op[j], UINT32_MAX);
+        if (k < m_log->count)
+            apply_op(&m_log->op[k], cut);
+        init_data_buffers();
+        hist_log_init();
+
+        for (uint32_t pos = 0; pos < TOTAL_DATA_IN_BUFFERS; pos++) {
+            hist_reading_t reading, expected = reading_of(HIST_LOG_SEQ + pos);
+
+            hist_read(hist_slot(pos), &reading);
+            if (reading.ph_mv != expected.ph_mv || reading.temp_mv != expected.temp_mv ||
+                reading.batt_mv != expected.batt_mv || reading.flags != expected.flags)
+                mismatch++;
+        }
+        CHECK_EQ(mismatch, 0);
+        for (int i = 0; i < HIST_ARCHIVE_CNT; i++)
+            archived += hist_archive[i].count;
+        end = HIST_LOG_SEQ + TOTAL_DATA_IN_BUFFERS;
+        CHECK(end >= durable_end(k));
+        // Readings freed before they were logged are acknowledged without
+        // a data block, only restored readings must have been written
+        CHECK(TOTAL_DATA_IN_BUFFERS == 0 || end <= durable_end(MIN(k + 1, m_log->count)));
+        if (!frees)
+            CHECK_EQ(archived, HIST_LOG_SEQ);
+        else if (HIST_LOG_SEQ > freed)
+            CHECK(archived >= HIST_LOG_SEQ - freed);
+        if (test_failures)
+            fprintf(stderr, "  after %u operations, cut at %u: %u readings from %u, %u archived\n",
+                    k, cut, TOTAL_DATA_IN_BUFFERS, HIST_LOG_SEQ, archived);
+        exit(test_failures ? 1 : 0);
+    }
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void test_scenario(char const * p_name, bool frees, bool faults, bool nested)
+{
+    uint32_t failed = 0, replays = 0, erases = 0, gave_up = 0;
+
+    m_log->count = 0;
+    write_log(frees, faults, nested);
+    CHECK(m_log->count > 0);
+    for (uint32_t k = 0; k <= m_log->count; k++) {
+        failed += (replay(k, 0, frees) != 0);
+        replays++;
+        if (k < m_log->count) {
+            failed += (replay(k, rnd(m_log->op[k].len), frees) != 0);
+            replays++;
+            erases  += m_log->op[k].erase && m_log->op[k].result == NRF_SUCCESS;
+            gave_up += m_log->op[k].result != NRF_SUCCESS;
+        }
+    }
+    CHECK(erases >= 2);
+    CHECK_EQ(failed, 0);
+    printf("%s: %u flash operations, %u page erases, %u attempts failed, %u replays\n",
+           p_name, m_log->count, erases, gave_up, replays);
+}
+
+int main(void)
+{
+    m_log = mmap(NULL, sizeof(replay_log_t), PROT_READ | PROT_WRITE, 
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    CHECK(m_log != MAP_FAILED);
+    test_scenario("no frees", false, false, false);
+    test_scenario("frees and faults", true, true, false);
+    test_scenario("nested completions", true, false, true);
+    return test_report("test_hist_log_replay");
+}
@@ -0,0 +1,180 @@
+/* user-021: the history ring. Checks the bit packing of every field in
+ * every slot, 0 mV readings, wrap-around of appends and frees with the
+ * time deltas, and archiving when the ring is full
+ */
+#include "firmware.h"
+#include "fakes.h"
+#include "test.h"
+
+static uint32_t m_rng = 99;
+
+static uint32_t rnd(uint32_t n)
+{
+    m_rng = m_rng * 1664525u + 1013904223u;
+    return (m_rng >> 8) % n;
+}
+
+static hist_reading_t reading_of(uint32_t seq)
+{
+    hist_reading_t reading = {
+        .ph_mv   = (seq * 13) % 4096,
+        .temp_mv = (seq * 7 + 1) % 4096,
+        .batt_mv = (seq * 3 + 2) % 4096,
+        .dt      = seq % 256,
+        .flags   = seq % 8,
+    };
+    return reading;
+}
+
+static bool reading_equal(hist_reading_t const * a, hist_reading_t const * b)
+{
+    return a->ph_mv == b->ph_mv && a->temp_mv == b->temp_mv && a->batt_mv == b->batt_mv &&
+           a->dt == b->dt && a->flags == b->flags;
+}
+
+static void test_field_packing(void)
+{
+    hist_reading_t reading, expected;
+    uint32_t       bad = 0;
+
+    init_data_buffers();
+    for (uint32_t slot = 0; slot < DATA_BUFF_SIZE; slot++) {
+        reading = reading_of(slot);
+        hist_write(slot, &reading);
+    }
+    // Rewriting one slot leaves its neighbours alone
+    for (uint32_t n = 0; n < 2000; n++) {
+        uint32_t slot = rnd(DATA_BUFF_SIZE);
+
+        reading = reading_of(slot + DATA_BUFF_SIZE * (1 + rnd(5)));
+        hist_write(slot, &reading);
+        hist_read(slot, &expected);
+        bad += !reading_equal(&reading, &expected);
+        for (int d = -1; d <= 1; d += 2) {
+            uint32_t other = (slot + d + DATA_BUFF_SIZE) % DATA_BUFF_SIZE;
+            hist_reading_t before;
+
+            hist_read(other, &before);
+            hist_field_set(other, HIST_PH_SHIFT, HIST_MV_BITS, before.ph_mv);
+            hist_read(other, &expected);
+            bad += !reading_equal(&before, &expected);
+        }
+    }
+    CHECK_EQ(bad, 0);
+
+    // Values too large for a field saturate
+    hist_field_set(5, HIST_TEMP_SHIFT, HIST_MV_BITS, 5000);
+    CHECK_EQ(hist_field_get(5, HIST_TEMP_SHIFT, HIST_MV_BITS), 4095);
+    hist_field_set(5, HIST_DT_SHIFT, HIST_DT_BITS, 1000);
+    CHECK_EQ(hist_field_get(5, HIST_DT_SHIFT, HIST_DT_BITS), 255);
+    hist_field_set(5, HIST_FLAG_SHIFT, HIST_FLAG_BITS, 15);
+    CHECK_EQ(hist_field_get(5, HIST_FLAG_SHIFT, HIST_FLAG_BITS), 7);
+
+    // The last field of the last slot stays inside hist_store
+    CHECK((DATA_BUFF_SIZE * HIST_RECORD_BITS - 1) / 8 + 2 < sizeof(hist_store));
+}
+
+// 0 mV is a reading like any other, it no longer ends the buffers
+static void test_zero_mv(void)
+{
+    hist_reading_t zero = {0}, reading;
+
+    init_data_buffers();
+    HIST_FIRST_SEQ = 0;
+    for (int i = 0; i < 10; i++)
+        hist_append(&zero);
+    CHECK_EQ(TOTAL_DATA_IN_BUFFERS, 10);
+    free_data_buffers(3);
+    CHECK_EQ(TOTAL_DATA_IN_BUFFERS, 7);
+    CHECK_EQ(HIST_FIRST_SEQ, 3);
+    reading = reading_of(1);
+    hist_append(&reading);
+    hist_read(hist_slot(7), &zero);
+    CHECK(reading_equal(&zero, &reading));
+    hist_read(hist_slot(6), &reading);
+    CHECK_EQ(reading.ph_mv + reading.temp_mv + reading.batt_mv, 0);
+}
+
+// The ring against a plain array of sequence numbers
+static void test_wrap_around(void)
+{
+    uint32_t first = 0, next = 0, span_ok = 0, order_ok = 0;
+
+    init_data_buffers();
+    HIST_FIRST_SEQ = 0;
+    HIST_LOG_SEQ   = 0;
+    for (int round = 0; round < 200; round++) {
+        uint32_t add  = rnd(DATA_BUFF_SIZE - TOTAL_DATA_IN_BUFFERS + 1);
+        uint32_t span = 0;
+
+        for (uint32_t i = 0; i < add; i++, next++) {
+            hist_reading_t reading = reading_of(next);
+            hist_append(&reading);
+        }
+        if (TOTAL_DATA_IN_BUFFERS > 0) {
+            uint32_t cnt = rnd(TOTAL_DATA_IN_BUFFERS) + 1;
+
+            if (cnt < TOTAL_DATA_IN_BUFFERS) {
+                free_data_buffers(cnt);
+                first += cnt;
+            }
+        }
+        CHECK_EQ(TOTAL_DATA_IN_BUFFERS, next - first);
+        CHECK_EQ(HIST_LOG_SEQ, first);
+        CHECK(HIST_HEAD < DATA_BUFF_SIZE);
+        order_ok++;
+        for (uint32_t pos = 0; pos < TOTAL_DATA_IN_BUFFERS; pos++) {
+            hist_reading_t reading, expected = reading_of(first + pos);
+
+            hist_read(hist_slot(pos), &reading);
+            if (!reading_equal(&reading, &expected)) {
+                order_ok--;
+                break;
+            }
+            if (pos > 0)
+                span += expected.dt * HIST_DT_UNIT_S;
+        }
+        span_ok += (HIST_SPAN == span);
+    }
+    CHECK_EQ(order_ok, 200);
+    CHECK_EQ(span_ok, 200);
+    CHECK(next > 4 * DATA_BUFF_SIZE);
+
+    // Reset empties the ring without touching the slots
+    reset_data_buffers();
+    CHECK_EQ(TOTAL_DATA_IN_BUFFERS, 0);
+    CHECK_EQ(HIST_HEAD, 0);
+    CHECK_EQ(HIST_SPAN, 0);
+    CHECK_EQ(HIST_LOG_SEQ, next);
+}
+
+// A full ring moves its oldest reading to the archive
+static void test_full_ring(void)
+{
+    uint32_t archived = 0;
+    hist_reading_t reading, expected;
+
+    init_data_buffers();
+    HIST_ARCHIVE_CNT = 0;
+    for (uint32_t i = 0; i < DATA_BUFF_SIZE + 100; i++) {
+        reading = reading_of(i);
+        hist_append(&reading);
+    }
+    CHECK_EQ(TOTAL_DATA_IN_BUFFERS, DATA_BUFF_SIZE);
+    for (int i = 0; i < HIST_ARCHIVE_CNT; i++)
+        archived += hist_archive[i].count;
+    CHECK_EQ(archived, 100);
+    CHECK_EQ(hist_archive[0].ph_min, reading_of(0).ph_mv);
+    hist_read(hist_slot(0), &reading);
+    expected = reading_of(100);
+    CHECK(reading_equal(&reading, &expected));
+}
+
+int main(void)
+{
+    test_field_packing();
+    test_zero_mv();
+    test_wrap_around();
+    test_full_ring();
+    return test_report("test_hist_ring");
+}
@@ -0,0 +1,227 @@
+/* user-008: the measurement state machine. Interrupts are simulated by
+ * posting their events (warm-up timer, SAADC DONE and CALIBRATEDONE) and
+ * the main loop by app_sched_execute(). Steps full cycles, aborts from
+ * every state, aborts posted from interrupt context, events from an
+ * aborted cycle and a full scheduler queue
+ */
+#include "firmware.h"
+#include "fakes.h"
+#include "test.h"
+
+#define PH_CODE         2048
+#define MAX_QUEUED      4
+
+static nrf_saadc_value_t * m_queued[MAX_QUEUED];
+static uint16_t            m_queued_size[MAX_QUEUED];
+static int                 m_queued_cnt = 0;
+
+ret_code_t nrf_drv_saadc_buffer_convert(nrf_saadc_value_t * p_buffer, uint16_t size)
+{
+    if (m_queued_cnt == MAX_QUEUED)
+        return NRF_ERROR_BUSY;
+    m_queued[m_queued_cnt]        = p_buffer;
+    m_queued_size[m_queued_cnt++] = size;
+    return NRF_SUCCESS;
+}
+
+static void main_loop(void)
+{
+    app_sched_execute();
+    meas_evt_lost_check();
+    app_sched_execute();
+}
+
+static void saadc_calibrate_done_irq(void)
+{
+    nrf_drv_saadc_evt_t evt = {.type = NRF_DRV_SAADC_EVT_CALIBRATEDONE};
+    saadc_scan_callback(&evt);
+}
+
+// Fills the oldest queued buffer with PH_CODE and reports it DONE
+static bool saadc_done_irq(void)
+{
+    nrf_drv_saadc_evt_t evt = {.type = NRF_DRV_SAADC_EVT_DONE};
+
+    if (m_queued_cnt == 0)
+        return false;
+    evt.data.done.p_buffer = m_queued[0];
+    evt.data.done.size     = m_queued_size[0];
+    for (int i = 0; i < evt.data.done.size; i++)
+        evt.data.done.p_buffer[i] = PH_CODE;
+    m_queued_cnt--;
+    memmove(&m_queued[0], &m_queued[1], m_queued_cnt * sizeof(m_queued[0]));
+    memmove(&m_queued_size[0], &m_queued_size[1], m_queued_cnt * sizeof(m_queued_size[0]));
+    saadc_scan_callback(&evt);
+    return true;
+}
+
+// Starts a cycle and steps it into WARMUP, through an offset calibration
+static void step_to_warmup(void)
+{
+    m_queued_cnt = 0;
+    enable_pH_voltage_reading();
+    CHECK_EQ(m_meas_state, MEAS_STATE_IDLE);
+    main_loop();
+    CHECK_EQ(m_meas_state, MEAS_STATE_WARMUP);
+    CHECK(fake_timer_running(m_warmup_timer));
+    if (m_saadc_calibrating) {
+        // Probes wait for the calibration
+        isfet_warmup_timer_handler(NULL);
+        main_loop();
+        CHECK_EQ(m_warmup_elapsed_ms, 0);
+        saadc_calibrate_done_irq();
+        main_loop();
+        CHECK(!m_saadc_calibrating);
+        CHECK(SAADC_CALIBRATED);
+    }
+}
+
+// Warm-up ticks until the ISFET counts as settled
+static void step_to_sample(void)
+{
+    fake_saadc_code = PH_CODE;
+    for (int i = 0; i <= ISFET_WARMUP_STABLE_PROBES; i++) {
+        CHECK_EQ(m_meas_state, MEAS_STATE_WARMUP);
+        isfet_warmup_timer_handler(NULL);
+        main_loop();
+    }
+    CHECK_EQ(m_meas_state, MEAS_STATE_SAMPLE);
+    CHECK(!fake_timer_running(m_warmup_timer));
+    CHECK_EQ(m_queued_cnt, 2);
+}
+
+static void test_full_cycle(void)
+{
+    AVG_PH_VAL = 0;
+    step_to_warmup();
+    step_to_sample();
+    for (int i = 0; i < 100 && m_meas_state == MEAS_STATE_SAMPLE; i++) {
+        CHECK(saadc_done_irq());
+        main_loop();
+    }
+    CHECK_EQ(m_meas_state, MEAS_STATE_IDLE);
+    CHECK_EQ(AVG_PH_VAL, saadc_result_to_mv(PH_CODE));
+    CHECK_EQ(fake_sched_pending(), 0);
+}
+
+// A START while a cycle runs is dropped
+static void test_start_while_running(void)
+{
+    step_to_warmup();
+    meas_evt_post(MEAS_EVT_START, NULL, 0);
+    main_loop();
+    CHECK_EQ(m_meas_state, MEAS_STATE_WARMUP);
+    disable_pH_voltage_reading();
+    CHECK_EQ(m_meas_state, MEAS_STATE_IDLE);
+}
+
+/* A disconnect in WARMUP or SAMPLE returns to IDLE at once, and events
+ * posted before it are dropped when they run
+ */
+static void test_abort(void)
+{
+    uint8_t epoch;
+
+    step_to_warmup();
+    isfet_warmup_timer_handler(NULL);
+    epoch = m_meas_epoch;
+    disable_pH_voltage_reading();
+    CHECK_EQ(m_meas_state, MEAS_STATE_IDLE);
+    CHECK(!fake_timer_running(m_warmup_timer));
+    CHECK(m_meas_epoch != epoch);
+    CHECK_EQ(fake_sched_pending(), 1);
+    main_loop();
+    CHECK_EQ(m_meas_state, MEAS_STATE_IDLE);
+    CHECK_EQ(m_warmup_elapsed_ms, 0);
+
+    AVG_PH_VAL = 12345;
+    step_to_warmup();
+    step_to_sample();
+    CHECK(saadc_done_irq());
+    disable_pH_voltage_reading();
+    main_loop();
+    CHECK_EQ(m_meas_state, MEAS_STATE_IDLE);
+    CHECK_EQ(AVG_PH_VAL, 12345);
+
+    // A new cycle after the abort runs normally
+    test_full_cycle();
+}
+
+/* A disconnect or STARTCAL in interrupt context only posts the abort, the
+ * state machine leaves SAMPLE from the main loop. A scan buffer that fills
+ * meanwhile is dropped with the aborted cycle
+ */
+static void test_stop(void)
+{
+    step_to_warmup();
+    step_to_sample();
+    meas_stop();
+    CHECK_EQ(m_meas_state, MEAS_STATE_SAMPLE);
+    CHECK(saadc_done_irq());
+    CHECK_EQ(fake_sched_pending(), 2);
+    main_loop();
+    CHECK_EQ(m_meas_state, MEAS_STATE_IDLE);
+    CHECK(!fake_timer_running(m_warmup_timer));
+    CHECK_EQ(fake_sched_pending(), 0);
+
+    // An abort that does not fit in the queue is carried out by the main loop
+    step_to_warmup();
+    fake_sched_capacity = 0;
+    meas_stop();
+    fake_sched_capacity = FAKE_SCHED_MAX;
+    CHECK(m_meas_abort_lost);
+    CHECK_EQ(m_meas_state, MEAS_STATE_WARMUP);
+    main_loop();
+    CHECK(!m_meas_abort_lost);
+    CHECK_EQ(m_meas_state, MEAS_STATE_IDLE);
+    CHECK(!fake_timer_running(m_warmup_timer));
+
+    test_full_cycle();
+}
+
+/* A full scheduler queue: a lost warm-up tick is retried by the next one,
+ * a lost scan buffer restarts the cycle from the main loop
+ */
+static void test_queue_full(void)
+{
+    uint16_t dropped = m_meas_evt_dropped;
+
+    step_to_warmup();
+    fake_sched_capacity = 0;
+    isfet_warmup_timer_handler(NULL);
+    CHECK_EQ(m_meas_evt_dropped, dropped + 1);
+    CHECK(!m_meas_evt_lost);
+    fake_sched_capacity = FAKE_SCHED_MAX;
+    step_to_sample();
+
+    fake_sched_capacity = 0;
+    CHECK(saadc_done_irq());
+    fake_sched_capacity = FAKE_SCHED_MAX;
+    CHECK_EQ(m_meas_evt_dropped, dropped + 2);
+    CHECK(m_meas_evt_lost);
+    CHECK_EQ(m_meas_state, MEAS_STATE_SAMPLE);
+
+    // The main loop aborts the cycle and starts a new one
+    m_queued_cnt = 0;
+    main_loop();
+    CHECK(!m_meas_evt_lost);
+    CHECK_EQ(m_meas_state, MEAS_STATE_WARMUP);
+    step_to_sample();
+    for (int i = 0; i < 100 && m_meas_state == MEAS_STATE_SAMPLE; i++) {
+        CHECK(saadc_done_irq());
+        main_loop();
+    }
+    CHECK_EQ(m_meas_state, MEAS_STATE_IDLE);
+}
+
+int main(void)
+{
+    CLIENT_PROTO_FLAG = true;
+    CAL_MODE          = false;
+    test_full_cycle();
+    test_start_while_running();
+    test_abort();
+    test_stop();
+    test_queue_full();
+    return test_report("test_meas_state");
+}
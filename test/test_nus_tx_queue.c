@@ -0,0 +1,149 @@
+/* user-013: the notification TX queue. A SoftDevice stand-in refuses
+ * notifications with NRF_ERROR_RESOURCES on a fixed schedule and the
+ * central completes packets every few steps. Checks that packets arrive
+ * once and in order, that a full queue drops with NRF_ERROR_NO_MEM instead
+ * of waiting, and that no call retries the SoftDevice in a loop
+ */
+#include <stdlib.h>
+#include "firmware.h"
+#include "fakes.h"
+#include "test.h"
+
+#define LIVE_PACKETS    240
+#define READINGS        120
+
+static uint32_t m_calls    = 0;     // ble_nus_data_send() calls
+static uint32_t m_schedule = 0;     // refuse when bit (m_calls % 32) is set
+static uint32_t m_rng      = 4242;
+
+static uint32_t rnd(uint32_t n)
+{
+    m_rng = m_rng * 1664525u + 1013904223u;
+    return (m_rng >> 8) % n;
+}
+
+uint32_t ble_nus_data_send(ble_nus_t * p_nus, uint8_t * p_data, uint16_t * p_length, uint16_t conn_handle)
+{
+    fake_nus_packet_t * p_packet;
+
+    if (m_schedule & (1u << (m_calls++ % 32)))
+        return NRF_ERROR_RESOURCES;
+    p_packet = &fake_nus_log[fake_nus_sent++ % FAKE_NUS_LOG];
+    p_packet->len = *p_length;
+    memcpy(p_packet->data, p_data, *p_length);
+    return NRF_SUCCESS;
+}
+
+static void connect(void)
+{
+    init_data_buffers();
+    nus_tx_reset();
+    m_conn_handle          = 0;
+    m_ble_nus_max_data_len = 244;
+    BINARY_FORMAT          = false;
+    fake_nus_sent          = 0;
+    m_calls                = 0;
+}
+
+// Completes what is in flight, as BLE_GATTS_EVT_HVN_TX_COMPLETE would
+static void conn_event(void)
+{
+    nus_tx_complete(m_tx_in_flight);
+}
+
+static void test_live_packets(void)
+{
+    uint32_t accepted = 0, dropped = 0, next = 0;
+    char     packet[16];
+
+    connect();
+    m_schedule = 0x24912491;
+    for (uint32_t i = 0; i < LIVE_PACKETS; i++) {
+        uint32_t calls = m_calls;
+        int      len   = sprintf(packet, "L%04u\n", i);
+
+        if (nus_tx_enqueue((uint8_t *)packet, len) == NRF_SUCCESS)
+            accepted++;
+        else
+            dropped++;
+        // Never more attempts than buffers, even when refused
+        CHECK(m_calls - calls <= NUS_HVN_TX_QUEUE_SIZE + 1);
+        CHECK(m_tx_in_flight <= NUS_HVN_TX_QUEUE_SIZE);
+        if (rnd(3) == 0)
+            conn_event();
+    }
+    for (int i = 0; i < 20; i++)
+        conn_event();
+    CHECK_EQ(fake_nus_sent, accepted);
+    CHECK(dropped > 0);
+    CHECK(nrf_queue_is_empty(&m_nus_tx_queue));
+    CHECK_EQ(m_tx_in_flight, 0);
+
+    // What was accepted arrives in order, dropped packets leave gaps only
+    CHECK(fake_nus_sent <= FAKE_NUS_LOG);
+    for (uint32_t n = 0; n < fake_nus_sent; n++) {
+        uint32_t index = atoi((char *)&fake_nus_log[n].data[1]);
+
+        CHECK(index >= next);
+        next = index + 1;
+    }
+    printf("live packets: %u accepted, %u dropped, %u SoftDevice calls\n",
+           accepted, dropped, m_calls);
+}
+
+/* Live packets during a buffered upload: both arrive complete and in
+ * order, the live ones ahead of the batches waiting for a buffer
+ */
+static void test_upload_with_live_packets(void)
+{
+    uint32_t next_record = 0, next_live = 0, live = 0;
+    char     packet[16];
+
+    connect();
+    for (uint32_t i = 0; i < READINGS; i++) {
+        hist_reading_t reading = {.ph_mv = 1000 + i, .temp_mv = 700, .batt_mv = 2000};
+
+        hist_write(hist_slot(i), &reading);
+        TOTAL_DATA_IN_BUFFERS++;
+    }
+    m_schedule = 0x00410041;
+    start_buffered_data_upload();
+    for (int step = 0; step < 1000 && SEND_BUFFERED_DATA; step++) {
+        if (step % 2 == 0 && live < 20) {
+            int len = sprintf(packet, "L%04u\n", live);
+
+            CHECK_EQ(nus_tx_enqueue((uint8_t *)packet, len), NRF_SUCCESS);
+            live++;
+        }
+        conn_event();
+        check_buffered_data_upload_done();
+    }
+    CHECK(!SEND_BUFFERED_DATA);
+    CHECK(fake_nus_sent <= FAKE_NUS_LOG);
+    CHECK(memcmp(fake_nus_log[0].data, "TOTAL_", 6) == 0);
+    for (uint32_t n = 1; n < fake_nus_sent; n++) {
+        fake_nus_packet_t const * p = &fake_nus_log[n];
+
+        if (p->data[0] == 'L') {
+            CHECK_EQ(atoi((char *)&p->data[1]), next_live);
+            next_live++;
+            continue;
+        }
+        for (int r = 0; r < p->len / total_size_w_index; r++, next_record++) {
+            uint8_t const * p_rec = &p->data[r * total_size_w_index];
+
+            CHECK_EQ((p_rec[0] - '0') * 100 + (p_rec[1] - '0') * 10 + (p_rec[2] - '0'),
+                     next_record);
+        }
+    }
+    CHECK_EQ(next_live, live);
+    CHECK_EQ(next_record, READINGS);
+    CHECK_EQ(m_upload_records_sent, READINGS);
+}
+
+int main(void)
+{
+    test_live_packets();
+    test_upload_with_live_packets();
+    return test_report("test_nus_tx_queue");
+}
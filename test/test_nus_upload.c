@@ -0,0 +1,130 @@
+/* user-011: the buffered record upload. A simulated central takes every
+ * packet in flight each connection event. Checks that records are packed
+ * up to the negotiated payload, all of them arrive once and in order, and
+ * compares the notifications and connection events needed with one record
+ * per notification
+ */
+#include "firmware.h"
+#include "fakes.h"
+#include "test.h"
+
+#define READINGS        200
+#define CONN_INTERVAL_MS 15
+
+static uint16_t ph_of(uint32_t i)
+{
+    return 1000 + (i * 7) % 900;
+}
+
+static void buffer_readings(uint32_t count)
+{
+    init_data_buffers();
+    HIST_FIRST_SEQ = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        hist_reading_t reading = {.ph_mv = ph_of(i), .temp_mv = 700, .batt_mv = 2000};
+
+        hist_write(hist_slot(i), &reading);
+        TOTAL_DATA_IN_BUFFERS++;
+    }
+}
+
+static uint32_t digits(uint8_t const * p, int n)
+{
+    uint32_t value = 0;
+
+    while (n-- > 0)
+        value = value * 10 + (*p++ - '0');
+    return value;
+}
+
+/* Uploads READINGS readings with the given payload length and format and
+ * checks every record. Returns the connection events it took
+ */
+static uint32_t upload(uint16_t max_data_len, bool binary, uint32_t * p_notifications)
+{
+    uint32_t events = 0, next = 0;
+
+    buffer_readings(READINGS);
+    nus_tx_reset();
+    m_conn_handle          = 0;
+    m_ble_nus_max_data_len = max_data_len;
+    BINARY_FORMAT          = binary;
+    fake_nus_sent          = 0;
+    fake_timer_ticks       = 0;
+
+    start_buffered_data_upload();
+    while (SEND_BUFFERED_DATA && events < 10 * READINGS) {
+        // Every packet in flight goes out in this connection event
+        fake_timer_ticks += APP_TIMER_TICKS(CONN_INTERVAL_MS);
+        nus_tx_complete(m_tx_in_flight);
+        check_buffered_data_upload_done();
+        events++;
+    }
+    CHECK(!SEND_BUFFERED_DATA);
+    CHECK(fake_nus_sent <= FAKE_NUS_LOG);
+    // Within the rounding of the interval to whole 1024 Hz ticks
+    CHECK(m_link_stats.upload_ms * 100 >= events * CONN_INTERVAL_MS * 95);
+    CHECK(m_link_stats.upload_ms * 100 <= events * CONN_INTERVAL_MS * 105);
+
+    // The primer goes first
+    CHECK(memcmp(fake_nus_log[0].data, "TOTAL_200\n", 10) == 0);
+    for (uint32_t n = 1; n < fake_nus_sent; n++) {
+        fake_nus_packet_t const * p = &fake_nus_log[n];
+
+        CHECK(p->len <= MAX(max_data_len, record_size()));
+        if (binary) {
+            CHECK_EQ(p->data[0], BIN_FORMAT_VERSION);
+            CHECK_EQ(p->len, BIN_HEADER_LEN + p->data[2] * BIN_RECORD_LEN);
+            for (int r = 0; r < p->data[2]; r++, next++) {
+                uint64_t packed = 0;
+
+                for (int b = BIN_RECORD_LEN - 1; b >= 0; b--)
+                    packed = (packed << 8) | p->data[BIN_HEADER_LEN + r * BIN_RECORD_LEN + b];
+                CHECK_EQ(packed & 0xFFFF, next);
+                CHECK_EQ((packed >> 16) & 0xFFF, ph_of(next));
+            }
+        }
+        else {
+            CHECK_EQ(p->len % total_size_w_index, 0);
+            for (int r = 0; r < p->len / total_size_w_index; r++, next++) {
+                uint8_t const * p_rec = &p->data[r * total_size_w_index];
+
+                CHECK_EQ(digits(p_rec, 3), next % 1000);
+                CHECK_EQ(p_rec[3], ',');
+                CHECK_EQ(digits(&p_rec[19], 4), ph_of(next));
+                CHECK_EQ(p_rec[23], '\n');
+            }
+        }
+    }
+    CHECK_EQ(next, READINGS);
+    CHECK_EQ(m_upload_records_sent, READINGS);
+    *p_notifications = fake_nus_sent - 1;
+    return events;
+}
+
+static void report(char const * name, uint16_t max_data_len, bool binary)
+{
+    uint32_t notifications;
+    uint32_t events = upload(max_data_len, binary, &notifications);
+
+    printf("%-22s %4u notifications %4u events %6u records/s\n", name, notifications,
+           events, READINGS * 1000 / (events * CONN_INTERVAL_MS));
+}
+
+int main(void)
+{
+    uint32_t single, packed;
+
+    // One record per notification, as before the change
+    upload(total_size_w_index, false, &single);
+    CHECK_EQ(single, READINGS);
+    // 247 byte MTU: ten ASCII records per notification
+    upload(244, false, &packed);
+    CHECK_EQ(packed, (READINGS + 9) / 10);
+
+    report("ASCII, one per packet", total_size_w_index, false);
+    report("ASCII, 244 byte ATT",   244, false);
+    report("binary, 20 byte ATT",   20,  true);
+    report("binary, 244 byte ATT",  244, true);
+    return test_report("test_nus_upload");
+}
@@ -0,0 +1,161 @@
+/* user-005: the SAADC sample filter. Checks the median of blocks against
+ * spikes, the MEAN mode against the old average, partial blocks and the
+ * standard error test, and reports error and cost on a spiky signal
+ */
+#include <math.h>
+#include <time.h>
+#include "firmware.h"
+#include "fakes.h"
+#include "test.h"
+
+#define SIGNAL_CODE     2000
+#define NOISE_CODES     3
+#define SPIKE_CODES     900
+#define SPIKE_PERCENT   5
+#define SAMPLES         36
+#define TRIALS          2000
+
+static uint32_t m_rng = 777;
+
+static uint32_t rnd(uint32_t n)
+{
+    m_rng = m_rng * 1664525u + 1013904223u;
+    return (m_rng >> 8) % n;
+}
+
+static nrf_saadc_value_t spiky_code(void)
+{
+    int code = SIGNAL_CODE + (int)rnd(2 * NOISE_CODES + 1) - NOISE_CODES;
+
+    if (rnd(100) < SPIKE_PERCENT)
+        code += (rnd(2) ? SPIKE_CODES : -SPIKE_CODES);
+    return code;
+}
+
+static void test_median_of_3(void)
+{
+    static uint16_t const p[6][3] = {{1,2,3}, {1,3,2}, {2,1,3}, {2,3,1}, {3,1,2}, {3,2,1}};
+
+    for (int i = 0; i < 6; i++)
+        CHECK_EQ(median_of_3(p[i][0], p[i][1], p[i][2]), 2);
+    CHECK_EQ(median_of_3(5, 5, 1), 5);
+    CHECK_EQ(median_of_3(1, 5, 1), 1);
+}
+
+// MEAN must give what the old loop gave: negative codes count as 0 mV
+static void test_mean_matches_old_average(void)
+{
+    saadc_filter_t filter;
+    uint32_t       sum = 0;
+    int            n   = 0;
+
+    saadc_filter_reset(&filter, SAADC_FILTER_MEAN);
+    for (int i = 0; i < 150; i++) {
+        nrf_saadc_value_t code = (nrf_saadc_value_t)rnd(4200) - 100;
+
+        saadc_filter_add(&filter, code);
+        if (code >= 0)
+            sum += saadc_result_to_mv(code);
+        n++;
+    }
+    CHECK_EQ(saadc_filter_result(&filter), sum / n);
+}
+
+static void test_partial_blocks(void)
+{
+    saadc_filter_t filter;
+
+    // No complete block: the leftover samples are averaged
+    saadc_filter_reset(&filter, SAADC_FILTER_MEDIAN_OF_BLOCKS);
+    CHECK_EQ(saadc_filter_result(&filter), 0);
+    saadc_filter_add(&filter, 1000);
+    saadc_filter_add(&filter, 2000);
+    CHECK_EQ(saadc_filter_result(&filter),
+             (saadc_result_to_mv(1000) + saadc_result_to_mv(2000)) / 2);
+
+    // One complete block: the leftover sample is ignored
+    saadc_filter_add(&filter, 1500);
+    saadc_filter_add(&filter, 4000);
+    CHECK_EQ(saadc_filter_result(&filter), saadc_result_to_mv(1500));
+
+    // Negative codes do not take a place in a block
+    saadc_filter_reset(&filter, SAADC_FILTER_MEDIAN_OF_BLOCKS);
+    saadc_filter_add(&filter, -5);
+    saadc_filter_add(&filter, 100);
+    saadc_filter_add(&filter, 100);
+    saadc_filter_add(&filter, 100);
+    CHECK_EQ(filter.count, 1);
+    CHECK_EQ(filter.valid, 3);
+}
+
+static void test_converged(void)
+{
+    saadc_filter_t filter;
+
+    saadc_filter_reset(&filter, SAADC_FILTER_MEDIAN_OF_BLOCKS);
+    saadc_filter_add(&filter, 2000);
+    CHECK(!saadc_filter_converged(&filter, 500));
+    saadc_filter_add(&filter, 2000);
+    CHECK(saadc_filter_converged(&filter, 500));
+    CHECK(!saadc_filter_converged(&filter, 0));
+
+    // Against the standard error computed in double
+    for (int t = 0; t < 200; t++) {
+        double s = 0, q = 0, se;
+        int    n = 2 + rnd(40), spread = 1 + rnd(40);
+
+        saadc_filter_reset(&filter, SAADC_FILTER_MEAN);
+        for (int i = 0; i < n; i++) {
+            nrf_saadc_value_t code = 2000 + rnd(spread);
+            double            mv   = saadc_result_to_mv(code);
+
+            saadc_filter_add(&filter, code);
+            s += mv;
+            q += mv * mv;
+        }
+        se = sqrt((q - s * s / n) / (n - 1) / n) * 1000;
+        if (fabs(se - 1000) > 1)
+            CHECK_EQ(saadc_filter_converged(&filter, 1000), se < 1000);
+    }
+}
+
+/* Average error of both modes on the spiky signal and the cost per sample
+ */
+static void test_spike_rejection(void)
+{
+    double   truth = SIGNAL_CODE * (double)SAADC_MV_PER_FULL_SCALE / 4096;
+    double   error[2] = {0, 0};
+    clock_t  ticks[2] = {0, 0};
+    static nrf_saadc_value_t codes[SAMPLES];
+
+    for (int t = 0; t < TRIALS; t++) {
+        for (int i = 0; i < SAMPLES; i++)
+            codes[i] = spiky_code();
+        for (int mode = 0; mode < 2; mode++) {
+            saadc_filter_t filter;
+            clock_t        start = clock();
+
+            saadc_filter_reset(&filter, (saadc_filter_mode_t)mode);
+            for (int i = 0; i < SAMPLES; i++)
+                saadc_filter_add(&filter, codes[i]);
+            ticks[mode] += clock() - start;
+            error[mode] += fabs(saadc_filter_result(&filter) - truth);
+        }
+    }
+    for (int mode = 0; mode < 2; mode++)
+        printf("%-8s mean error %6.2f mV, %5.1f ns/sample\n",
+               mode == SAADC_FILTER_MEAN ? "mean" : "median", error[mode] / TRIALS,
+               (double)ticks[mode] * 1e9 / CLOCKS_PER_SEC / TRIALS / SAMPLES);
+    CHECK(error[SAADC_FILTER_MEDIAN_OF_BLOCKS] < error[SAADC_FILTER_MEAN] / 4);
+    CHECK(error[SAADC_FILTER_MEDIAN_OF_BLOCKS] / TRIALS < 5);
+}
+
+int main(void)
+{
+    test_median_of_3();
+    test_mean_matches_old_average();
+    test_partial_blocks();
+    test_converged();
+    test_spike_rejection();
+    return test_report("test_saadc_filter");
+}
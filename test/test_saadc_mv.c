@@ -0,0 +1,74 @@
+/* user-004: the integer SAADC code to mV conversion. Checks it is bit exact
+ * with the old float version for every 12 bit code, and counts the float
+ * operations the old version needed per reading. The nRF52810 has no FPU,
+ * each of them is a call into the soft-float library. The host has one,
+ * so it cannot time the difference
+ */
+#include "firmware.h"
+#include "fakes.h"
+#include "test.h"
+
+/* The soft-float routines the old conversion compiles to with
+ * -mfloat-abi=soft, counted
+ */
+static uint32_t m_float_calls = 0;
+
+static float ui2f(uint32_t a)       { m_float_calls++; return (float)a; }    // __aeabi_ui2f
+static float fmul(float a, float b) { m_float_calls++; return a * b; }       // __aeabi_fmul
+static float fdiv(float a, float b) { m_float_calls++; return a / b; }       // __aeabi_fdiv
+static uint32_t f2uiz(float a)      { m_float_calls++; return (uint32_t)a; } // __aeabi_f2uiz
+
+// The conversion as it was before, kept here as the reference
+static uint32_t float_result_to_mv(uint32_t saadc_result)
+{
+    float adc_denom     = 4096.0;
+    float adc_ref_mv    = 600.0;
+    float adc_prescale  = 5.0;
+    float adc_res_in_mv = fmul(fdiv(fmul(ui2f(saadc_result), adc_ref_mv), adc_denom), adc_prescale);
+
+    return f2uiz(adc_res_in_mv);
+}
+
+static void test_bit_exact(void)
+{
+    uint32_t mismatches = 0;
+
+    for (uint32_t code = 0; code < (1u << SAADC_RESOLUTION_BITS); code++) {
+        if (saadc_result_to_mv(code) != float_result_to_mv(code)) {
+            if (mismatches++ < 5)
+                printf("code %u: %u mV, float %u mV\n", code,
+                       saadc_result_to_mv(code), float_result_to_mv(code));
+        }
+    }
+    CHECK_EQ(mismatches, 0);
+    CHECK_EQ(saadc_result_to_mv(0), 0);
+    CHECK_EQ(saadc_result_to_mv(4095), 2999);
+}
+
+/* Soft-float calls per reading of each acquisition profile, at most
+ * max_samples conversions of each scan channel
+ */
+static void report_float_calls(void)
+{
+    static char const * const name[] = {"LEGACY", "REGULAR", "CALIBRATION"};
+    uint32_t                  per_code;
+
+    m_float_calls = 0;
+    (void)float_result_to_mv(2048);
+    per_code = m_float_calls;
+    CHECK_EQ(per_code, 5);
+
+    printf("profile      conversions  soft-float calls before  after\n");
+    for (int p = 0; p < ARRAY_SIZE(m_saadc_profiles); p++) {
+        uint32_t conversions = m_saadc_profiles[p].max_samples * SAADC_SCAN_CHANNELS;
+
+        printf("%-11s  %11u  %23u  %5u\n", name[p], conversions, conversions * per_code, 0);
+    }
+}
+
+int main(void)
+{
+    test_bit_exact();
+    report_float_calls();
+    return test_report("test_saadc_mv");
+}
@@ -0,0 +1,154 @@
+/* user-002: the SAADC acquisition profiles. Checks that a profile's
+ * oversampling, burst and acquisition time reach the driver, and compares
+ * the profiles on a simulated SAADC with white noise: error of the reading
+ * against the true level, conversions the CPU waits for and conversion time
+ */
+#include <math.h>
+#include "firmware.h"
+#include "fakes.h"
+#include "test.h"
+
+#define NOISE_LSB       4.0          // rms noise of one raw sample
+#define TRIALS          300
+
+static nrf_drv_saadc_config_t     m_saadc_config;
+static nrf_saadc_channel_config_t m_channel_config[SAADC_SCAN_CHANNELS];
+static uint8_t                    m_channels = 0;
+
+ret_code_t nrf_drv_saadc_init(nrf_drv_saadc_config_t const * p_config, nrfx_saadc_event_handler_t handler)
+{
+    m_saadc_config = *p_config;
+    m_channels     = 0;
+    return NRF_SUCCESS;
+}
+
+ret_code_t nrf_drv_saadc_channel_init(uint8_t channel, nrf_saadc_channel_config_t const * p_config)
+{
+    m_channel_config[channel] = *p_config;
+    m_channels++;
+    return NRF_SUCCESS;
+}
+
+/* Simulated SAADC. Each conversion averages 2^m_oversample raw samples of
+ * m_level plus gaussian noise and rounds to a 12 bit code
+ */
+static double   m_level;
+static uint8_t  m_oversample;
+static uint32_t m_conversions;
+static uint32_t m_rng = 12345;
+
+static double uniform(void)
+{
+    m_rng = m_rng * 1664525u + 1013904223u;
+    return ((m_rng >> 8) + 0.5) / 16777216.0;
+}
+
+static double gaussian(void)
+{
+    return sqrt(-2.0 * log(uniform())) * cos(2.0 * M_PI * uniform());
+}
+
+ret_code_t nrfx_saadc_sample_convert(uint8_t channel, nrf_saadc_value_t * p_value)
+{
+    uint32_t n   = 1u << m_oversample;
+    double   sum = 0;
+
+    for (uint32_t i = 0; i < n; i++)
+        sum += m_level + NOISE_LSB * gaussian();
+    *p_value = (nrf_saadc_value_t)lround(sum / n);
+    m_conversions++;
+    return NRF_SUCCESS;
+}
+
+static void test_profiles_are_consistent(void)
+{
+    for (int i = 0; i < ARRAY_SIZE(m_saadc_profiles); i++) {
+        saadc_acq_profile_t const * p = &m_saadc_profiles[i];
+
+        // Oversampling a scan only works with burst
+        if (p->oversample != NRF_SAADC_OVERSAMPLE_DISABLED)
+            CHECK_EQ(p->burst, NRF_SAADC_BURST_ENABLED);
+        CHECK(p->min_samples <= p->max_samples);
+        CHECK_EQ(p->min_samples % SAADC_FILTER_BLOCK, 0);
+        CHECK_EQ(p->max_samples % SAADC_FILTER_BLOCK, 0);
+    }
+}
+
+static void test_profile_reaches_driver(void)
+{
+    saadc_acq_profile_t const * p_regular = &m_saadc_profiles[REGULAR_SAADC_PROFILE];
+    saadc_acq_profile_t const * p_cal     = &m_saadc_profiles[CALIBRATION_SAADC_PROFILE];
+    nrf_saadc_channel_config_t  channel   = NRF_SAADC_CUSTOM_CHANNEL_CONFIG_SE(NRF_SAADC_INPUT_AIN2, *p_cal);
+
+    m_meas_cycle = 0;
+    saadc_scan_init();
+    CHECK_EQ(m_saadc_config.oversample, p_regular->oversample);
+    CHECK_EQ(m_saadc_config.low_power_mode, false);
+    CHECK_EQ(m_channels, SAADC_SCAN_CHANNELS);
+    for (int ch = 0; ch < SAADC_SCAN_CHANNELS; ch++) {
+        CHECK_EQ(m_channel_config[ch].burst,    p_regular->burst);
+        CHECK_EQ(m_channel_config[ch].acq_time, p_regular->acq_time);
+        CHECK_EQ(m_channel_config[ch].pin_p,    m_saadc_channel_rate[ch].input);
+    }
+
+    init_saadc_for_blocking_sample_conversion(channel);
+    CHECK_EQ(m_saadc_config.oversample, p_cal->oversample);
+    CHECK_EQ(m_channel_config[0].burst, p_cal->burst);
+}
+
+static uint32_t acq_time_us(nrf_saadc_acqtime_t acq_time)
+{
+    static uint8_t const us[] = {3, 5, 10, 15, 20, 40};
+    return us[acq_time];
+}
+
+/* Takes TRIALS calibration readings with the profile, returns the rms error
+ * in mV and the average number of conversions per reading
+ */
+static double profile_error(saadc_acq_profile_t const * p_profile, double * p_conversions)
+{
+    double sq_sum = 0;
+
+    m_oversample  = p_profile->oversample;
+    m_conversions = 0;
+    for (int t = 0; t < TRIALS; t++) {
+        double truth;
+
+        m_level = 1500.0 + 700.0 * uniform();
+        truth   = m_level * SAADC_MV_PER_FULL_SCALE / 4096.0;
+        PT1_READ = false;
+        read_saadc_and_store_avg_in_cal_pt(p_profile);
+        sq_sum += (PT1_MV_VAL - truth) * (PT1_MV_VAL - truth);
+    }
+    *p_conversions = (double)m_conversions / TRIALS;
+    return sqrt(sq_sum / TRIALS);
+}
+
+static void test_profile_comparison(void)
+{
+    static char const * const name[] = {"LEGACY", "REGULAR", "CALIBRATION"};
+    double error[ARRAY_SIZE(m_saadc_profiles)];
+
+    printf("profile       rms error  conversions  conversion time\n");
+    for (int i = 0; i < ARRAY_SIZE(m_saadc_profiles); i++) {
+        saadc_acq_profile_t const * p = &m_saadc_profiles[i];
+        double conversions;
+
+        error[i] = profile_error(p, &conversions);
+        printf("%-12s  %6.3f mV  %11.1f  %10.0f us\n", name[i], error[i], conversions,
+               conversions * (1u << p->oversample) * (acq_time_us(p->acq_time) + 2));
+        CHECK(conversions <= p->max_samples);
+    }
+    // Same or lower noise than the old 150 sample loop, in far fewer
+    // conversions the CPU waits for
+    CHECK(error[SAADC_PROFILE_REGULAR]     <= error[SAADC_PROFILE_LEGACY]);
+    CHECK(error[SAADC_PROFILE_CALIBRATION] <= error[SAADC_PROFILE_REGULAR]);
+}
+
+int main(void)
+{
+    test_profiles_are_consistent();
+    test_profile_reaches_driver();
+    test_profile_comparison();
+    return test_report("test_saadc_profiles");
+}
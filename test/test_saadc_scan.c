@@ -0,0 +1,164 @@
+/* user-001: the single pass scan of pH, battery and temperature against a
+ * SAADC stand-in. The stand-in fills the buffers the firmware queues with
+ * one sample per active channel and scan, in channel order, like EasyDMA.
+ * Each channel's result is compared with the old three-pass path, a plain
+ * mean of the float conversion with negative codes counted as 0 mV, over
+ * the same samples
+ */
+#include <stdlib.h>
+#include "firmware.h"
+#include "fakes.h"
+#include "test.h"
+
+#define MAX_QUEUED 4
+
+static nrf_saadc_value_t * m_queued[MAX_QUEUED];
+static uint16_t            m_queued_size[MAX_QUEUED];
+static int                 m_queued_cnt = 0;
+static uint32_t            m_sample_no[SAADC_SCAN_CHANNELS];
+
+ret_code_t nrf_drv_saadc_buffer_convert(nrf_saadc_value_t * p_buffer, uint16_t size)
+{
+    if (m_queued_cnt == MAX_QUEUED)
+        return NRF_ERROR_BUSY;
+    m_queued[m_queued_cnt]        = p_buffer;
+    m_queued_size[m_queued_cnt++] = size;
+    return NRF_SUCCESS;
+}
+
+typedef int16_t (*signal_t)(uint8_t ch, uint32_t n);
+
+// Fills the oldest queued buffer, returns its size
+static uint16_t saadc_fill(signal_t signal, nrf_saadc_value_t ** pp_buffer)
+{
+    uint16_t size = m_queued_size[0];
+
+    *pp_buffer = m_queued[0];
+    for (int i = 0; i < size; i++) {
+        uint8_t ch = m_scan_active[i % m_scan_active_cnt];
+        (*pp_buffer)[i] = signal(ch, m_sample_no[ch]++);
+    }
+    m_queued_cnt--;
+    memmove(&m_queued[0], &m_queued[1], m_queued_cnt * sizeof(m_queued[0]));
+    memmove(&m_queued_size[0], &m_queued_size[1], m_queued_cnt * sizeof(m_queued_size[0]));
+    return size;
+}
+
+// Runs one measurement cycle's scan to the end
+static void run_scan(signal_t signal)
+{
+    bool done = false;
+
+    m_queued_cnt = 0;
+    memset(m_sample_no, 0, sizeof(m_sample_no));
+    saadc_scan_init();
+    saadc_scan_start();
+    while (!done) {
+        nrf_saadc_value_t * p_buffer;
+        uint16_t            size;
+
+        CHECK(m_queued_cnt > 0);
+        if (m_queued_cnt == 0)
+            return;
+        size = saadc_fill(signal, &p_buffer);
+        done = saadc_scan_process(p_buffer, size);
+    }
+}
+
+// The old per-channel pass over the first n samples
+static uint32_t three_pass_mean(signal_t signal, uint8_t ch, uint32_t n)
+{
+    uint32_t sum = 0;
+
+    for (uint32_t i = 0; i < n; i++) {
+        int16_t code = signal(ch, i);
+        if (code >= 0)
+            sum += (uint32_t)(((code * 600.0) / 4096.0) * 5.0);
+    }
+    return sum / n;
+}
+
+static int16_t constant_signal(uint8_t ch, uint32_t n)
+{
+    static int16_t const level[SAADC_SCAN_CHANNELS] = {
+        [SAADC_SCAN_PH_CH] = 2048, [SAADC_SCAN_BATT_CH] = 1000, [SAADC_SCAN_TEMP_CH] = 3001
+    };
+    return level[ch];
+}
+
+// Battery noise that never settles, with negative codes; the others constant
+static int16_t noisy_batt_signal(uint8_t ch, uint32_t n)
+{
+    if (ch != SAADC_SCAN_BATT_CH)
+        return constant_signal(ch, n);
+    return (int16_t)((n * 2654435761u >> 20) % 400) - 20;
+}
+
+static void test_all_channels_match_three_pass(void)
+{
+    uint8_t record[BIN_RECORD_LEN];
+
+    m_meas_cycle = 0;
+    run_scan(constant_signal);
+    CHECK_EQ(m_scan_active_cnt, SAADC_SCAN_CHANNELS);
+    // Constant input settles after the profile's minimum
+    CHECK_EQ(AVG_SAMPLE_CNT, m_saadc_profiles[REGULAR_SAADC_PROFILE].min_samples);
+    CHECK_EQ(AVG_PH_VAL,   three_pass_mean(constant_signal, SAADC_SCAN_PH_CH,   AVG_SAMPLE_CNT));
+    CHECK_EQ(AVG_BATT_VAL, three_pass_mean(constant_signal, SAADC_SCAN_BATT_CH, AVG_SAMPLE_CNT));
+    CHECK_EQ(AVG_TEMP_VAL, three_pass_mean(constant_signal, SAADC_SCAN_TEMP_CH, AVG_SAMPLE_CNT));
+    for (int ch = 0; ch < SAADC_SCAN_CHANNELS; ch++)
+        CHECK_EQ(CHANNEL_AGE[ch], 0);
+    // The early stop is published with the reading, bit 63 of the record
+    CHECK_EQ(meas_flags(), HIST_EARLY);
+    create_binary_record(1, AVG_PH_VAL, AVG_BATT_VAL, AVG_TEMP_VAL, 0, meas_flags(), record);
+    CHECK_EQ(record[7] & 0xE0, 0x80);
+}
+
+static void test_noisy_mean_channel_matches_three_pass(void)
+{
+    m_meas_cycle = 0;
+    run_scan(noisy_batt_signal);
+    // Never converges, so every buffer up to the maximum is used
+    CHECK_EQ(AVG_SAMPLE_CNT, m_saadc_profiles[REGULAR_SAADC_PROFILE].max_samples);
+    CHECK_EQ(AVG_BATT_VAL, three_pass_mean(noisy_batt_signal, SAADC_SCAN_BATT_CH, AVG_SAMPLE_CNT));
+    CHECK_EQ(AVG_PH_VAL,   three_pass_mean(noisy_batt_signal, SAADC_SCAN_PH_CH,   AVG_SAMPLE_CNT));
+    CHECK_EQ(m_scan_filter[SAADC_SCAN_PH_CH].valid, AVG_SAMPLE_CNT);
+    CHECK_EQ(meas_flags() & HIST_EARLY, 0);
+}
+
+// Decimated channels are left out of the scan and keep their value
+static void test_decimated_channels_keep_value(void)
+{
+    uint32_t batt;
+
+    m_meas_cycle = 0;
+    run_scan(constant_signal);
+    batt = AVG_BATT_VAL;
+    AVG_TEMP_VAL = 0;
+
+    run_scan(noisy_batt_signal);
+    CHECK_EQ(m_scan_active_cnt, 1);
+    CHECK_EQ(m_scan_active[0], SAADC_SCAN_PH_CH);
+    CHECK_EQ(AVG_BATT_VAL, batt);
+    CHECK_EQ(AVG_TEMP_VAL, 0);
+    CHECK_EQ(CHANNEL_AGE[SAADC_SCAN_PH_CH],   0);
+    CHECK_EQ(CHANNEL_AGE[SAADC_SCAN_BATT_CH], 1);
+    CHECK_EQ(CHANNEL_AGE[SAADC_SCAN_TEMP_CH], 1);
+
+    // Temperature is due every m_saadc_channel_rate[].decimation cycles
+    while (m_meas_cycle % m_saadc_channel_rate[SAADC_SCAN_TEMP_CH].decimation != 0)
+        run_scan(constant_signal);
+    run_scan(constant_signal);
+    CHECK_EQ(m_scan_active_cnt, 2);
+    CHECK_EQ(AVG_TEMP_VAL, three_pass_mean(constant_signal, SAADC_SCAN_TEMP_CH, AVG_SAMPLE_CNT));
+    CHECK_EQ(CHANNEL_AGE[SAADC_SCAN_TEMP_CH], 0);
+    CHECK(CHANNEL_AGE[SAADC_SCAN_BATT_CH] > 1);
+}
+
+int main(void)
+{
+    test_all_channels_match_three_pass();
+    test_noisy_mean_channel_matches_three_pass();
+    test_decimated_channels_keep_value();
+    return test_report("test_saadc_scan");
+}
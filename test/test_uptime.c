@@ -0,0 +1,54 @@
+/* user-018: the uptime clock. Steps a simulated 1024 Hz app timer counter
+ * one second at a time across several UPTIME_TIMER_PERIOD_S rollovers and
+ * the 24 bit counter wrap, with the uptime timer firing on time and late
+ */
+#include "firmware.h"
+#include "fakes.h"
+#include "test.h"
+
+#define RUN_S           40000   // over two wraps of the 24 bit counter
+
+static uint32_t ticks_at(uint32_t boot_ticks, uint32_t t)
+{
+    return (boot_ticks + t * APP_TIMER_TICK_FREQ) & APP_TIMER_MAX_CNT_VAL;
+}
+
+/* Runs the clock for RUN_S seconds from boot_ticks. The timer fires
+ * late_s seconds after each period ends
+ */
+static void run(uint32_t boot_ticks, uint32_t late_s)
+{
+    uint32_t next_fire = UPTIME_TIMER_PERIOD_S + late_s;
+    uint32_t bad       = 0;
+
+    m_uptime_base_s     = 0;
+    fake_timer_ticks    = boot_ticks;
+    m_uptime_base_ticks = app_timer_cnt_get();
+    for (uint32_t t = 0; t <= RUN_S; t++) {
+        // One tick before a period ends
+        if (t % UPTIME_TIMER_PERIOD_S == 0 && t > 0) {
+            fake_timer_ticks = (ticks_at(boot_ticks, t) - 1) & APP_TIMER_MAX_CNT_VAL;
+            CHECK_EQ(uptime_seconds(), t - 1);
+        }
+        fake_timer_ticks = ticks_at(boot_ticks, t);
+        if (t == next_fire) {
+            uptime_timer_handler(NULL);
+            next_fire += UPTIME_TIMER_PERIOD_S;
+        }
+        if (uptime_seconds() != t && bad++ < 5)
+            CHECK_EQ(uptime_seconds(), t);
+    }
+    CHECK_EQ(bad, 0);
+}
+
+int main(void)
+{
+    CHECK_EQ(APP_TIMER_TICK_FREQ, 1024);
+    CHECK_EQ(APP_TIMER_TICKS(UPTIME_TIMER_PERIOD_S * 1000), UPTIME_TIMER_PERIOD_S * 1024);
+    CHECK(APP_TIMER_TICKS(UPTIME_TIMER_PERIOD_S * 1000) < APP_TIMER_MAX_CNT_VAL / 2);
+
+    run(0, 0);
+    run(APP_TIMER_MAX_CNT_VAL - 100, 0);
+    run(12345, 3);
+    return test_report("test_uptime");
+}